@@ -57,7 +57,7 @@ bool AmIBeingDebugged(void)
     return cachedResult;
 }
 
-static char commandline[ 1024];
+static thread_local char commandline[ 1024];
 char* MakeCommandLine( int argc, const char * const argv[])
 {
 	char* b = commandline;
@@ -72,6 +72,65 @@ char* MakeCommandLine( int argc, const char * const argv[])
 	return commandline;
 }
 
+/*
+		Options are scanned the way POSIX getopt does it, flags can be grouped, values can
+		be attached or in the next argument, and the first parameter, or "--", ends the
+		options.  Unlike getopt, everything it keeps is in the caller's OptionScan_t, and
+		argv is never rearranged, so commands can parse their options on any thread.
+*/
+enum
+{
+	kOptionUnknown = 0,
+	kOptionFlag,				// Stands alone, can be grouped with others
+	kOptionValue				// Takes the rest of the argument, or the next argument
+};
+
+typedef struct OptionScan
+{
+	int index = 1;				// Next argument to look at, the first parameter when done
+	int offset = 0;				// Position within a group of flags, 0 between arguments
+	int option = 0;				// The option just found
+	int kind = kOptionUnknown;	// What it is
+	const char* value = nullptr;	// And its value, null if it is missing
+} OptionScan_t;
+
+static bool NextOption( int argc, const char * const argv[], const char kinds[ 128], OptionScan_t &scan)
+{// False when there are no more options
+	if( scan.offset == 0)
+	{// Starting a new argument
+		if( scan.index >= argc || argv[ scan.index] == nullptr)
+			return false;
+		const char* arg = argv[ scan.index];
+		if( arg[ 0] != '-' || arg[ 1] == 0)
+			return false;
+		if( strcmp( arg, "--") == 0)
+		{
+			++scan.index;
+			return false;
+		}
+		scan.offset = 1;
+	}
+	const char* arg = argv[ scan.index];
+	scan.option = (unsigned char) arg[ scan.offset++];
+	scan.kind = scan.option < 0x80 ? (int) kinds[ scan.option] : (int) kOptionUnknown;
+	scan.value = nullptr;
+	if( scan.kind == kOptionValue)
+	{// The value is the rest of this argument, or all of the next one
+		if( arg[ scan.offset] != 0)
+			scan.value = arg + scan.offset;
+		else if( scan.index + 1 < argc)
+			scan.value = argv[ ++scan.index];
+		++scan.index;
+		scan.offset = 0;
+	}
+	else if( arg[ scan.offset] == 0)
+	{// End of a group of flags
+		++scan.index;
+		scan.offset = 0;
+	}
+	return true;
+}
+
 int GetAllOpts(
     int argc, const char * const argv[],
     const char* boolOpts, bool* boolValues[],
@@ -81,69 +140,45 @@ int GetAllOpts(
     const char* int64Opts, int64* int64Values[],
     const char* paramOpts, const char* const helpMessages[])// Param options are from "SFI.*" for string, float, integer, and uncounted
 {
-	MakeCommandLine( argc, argv);
     bool displayHelp = false;
     char badchoice[ 2] = {0};
-    char optstr[ 64];
-    char* o = optstr;
+    char kinds[ 128] = {0};		// What each option letter is, all on our stack so any thread can parse at once
     for( const char* s = boolOpts; s && *s; ++s)
     {
-        *o++ = tolower_c( *s);
-        *o++ = toupper_c( *s);
-        *o++ = ':';
-    }
-    for( const char* s = strOpts; s && *s; ++s)
-    {
-        *o++ = *s;
-        *o++ = ':';
-    }
-    for( const char* s = floatOpts; s && *s; ++s)
-    {
-        *o++ = *s;
-        *o++ = ':';
-    }
-    for( const char* s = intOpts; s && *s; ++s)
-    {
-        *o++ = *s;
-        *o++ = ':';
+        kinds[ tolower_c( *s) & 0x7f] = kOptionFlag;
+        kinds[ toupper_c( *s) & 0x7f] = kOptionValue;
     }
-    for( const char* s = int64Opts; s && *s; ++s)
+    const char* valueOpts[] = { strOpts, floatOpts, intOpts, int64Opts};
+    for( const char* opts : valueOpts)
     {
-        *o++ = *s;
-        *o++ = ':';
+        for( const char* s = opts; s && *s; ++s)
+            kinds[ *s & 0x7f] = kOptionValue;
     }
-
-	*o++ = 'h';
-	*o = 0;
-
-    opterr = 1;
-    optind = 1;
-    optreset = 1;
+    kinds[ 'h'] = kOptionFlag;
+    OptionScan_t scan;
 
     try
     {
-        int optResult = 0;
-#if WINCODE
-		while( (optResult = getopt(argc, (const char**)(argv), optstr)) >= 0)
-#else
-        while( (optResult = getopt( argc, const_cast<char * const *>( argv), optstr)) >= 0)
-#endif
+        while( NextOption( argc, argv, kinds, scan))
         {
-            if( optResult == '?')
-                xraise( "Command line error", nullptr);
+            if( scan.kind == kOptionValue && scan.value == nullptr)
+            {
+                badchoice[ 0] = (char) scan.option;
+                xraise( "Option needs a value", "str option", badchoice, NULL);
+            }
             int vindex = 0;     // Value index
             for( const char* s = boolOpts; s && *s; ++s, ++vindex)
             {
-                if( optopt == tolower( *s))
+                if( scan.option == tolower( *s))
                 {// Lower case bool option takes no parameter and toggles value
                     *boolValues[ vindex] = !*boolValues[ vindex];
                     goto break2;
                 }
-                else if( optopt == toupper( *s))
+                else if( scan.option == toupper( *s))
                 {// Uppder case bool option takes parameter 1 or 0
-                    if( strcmp( optarg, "0") == 0) *boolValues[ vindex] = false;
-                    else if( strcmp( optarg, "1") == 0) *boolValues[ vindex] = true;
-                    else xraise( "Boolean options must be 1 or 0", "str found", optarg, NULL);
+                    if( strcmp( scan.value, "0") == 0) *boolValues[ vindex] = false;
+                    else if( strcmp( scan.value, "1") == 0) *boolValues[ vindex] = true;
+                    else xraise( "Boolean options must be 1 or 0", "str found", scan.value, NULL);
                     goto break2;
                 }
             }
@@ -151,9 +186,9 @@ int GetAllOpts(
             vindex = 0;
             for( const char* s = strOpts; s && *s; ++s, ++vindex)
             {
-                if( optopt == *s)
+                if( scan.option == *s)
                 {
-                    *strValues[ vindex] = optarg;
+                    *strValues[ vindex] = scan.value;
                     goto break2;
                 }
             }
@@ -161,9 +196,9 @@ int GetAllOpts(
             vindex = 0;
             for( const char* s = floatOpts; s && *s; ++s, ++vindex)
             {
-                if( optopt == *s)
+                if( scan.option == *s)
                 {// ConvertTimeToSeconds includes PitchToFloat and hex conversions for absolute values
-                    *floatValues[ vindex] = ConvertTimeToSeconds( optarg);
+                    *floatValues[ vindex] = ConvertTimeToSeconds( scan.value);
                     goto break2;
                 }
             }
@@ -171,9 +206,9 @@ int GetAllOpts(
             vindex = 0;
             for( const char* s = intOpts; s && *s; ++s, ++vindex)
             {
-                if( optopt == *s)
+                if( scan.option == *s)
                 {
-                    *intValues[ vindex] = xatoi( optarg);
+                    *intValues[ vindex] = xatoi( scan.value);
                     goto break2;
                 }
             }
@@ -181,20 +216,20 @@ int GetAllOpts(
             vindex = 0;
             for( const char* s = int64Opts; s && *s; ++s, ++vindex)
             {
-                if( optopt == *s)
+                if( scan.option == *s)
                 {
-                    *int64Values[ vindex] = xatoint64( optarg);
+                    *int64Values[ vindex] = xatoint64( scan.value);
                     goto break2;
                 }
             }
 
-            if( optopt == 'h')
+            if( scan.option == 'h')
             {
                 displayHelp = true;
 				goto break2;
             }
 
-            badchoice[0] = (char) optopt;
+            badchoice[0] = (char) scan.option;
             xraise( "Option not recognized.  Use -h to list available options.", "str option", badchoice, NULL);
 
             break2:;    // Success, get next option
@@ -205,7 +240,7 @@ int GetAllOpts(
             int requiredParams = strli( paramOpts);
             if( strchr( paramOpts, '.'))
             {// There are a minimum number of parameters, but could be much more
-                if( argc - optind < requiredParams-1)
+                if( argc - scan.index < requiredParams-1)
                 {
                     printf( "The %s command requires at least %d parameters.\n", argv[ 0], requiredParams-1);
                     displayHelp = true;
@@ -213,7 +248,7 @@ int GetAllOpts(
             }
             else if( strchr( paramOpts, '*'))
             {// There are a minimum number of parameters, the set of parameters are completely optional
-                if( argc - optind < requiredParams-2)
+                if( argc - scan.index < requiredParams-2)
                 {
                     printf( "The %s command requires at least %d parameters.\n", argv[ 0], requiredParams-2);
                     displayHelp = true;
@@ -221,7 +256,7 @@ int GetAllOpts(
             }
             else
             {
-               if( argc - optind != requiredParams)
+               if( argc - scan.index != requiredParams)
                 {
                     printf( "The %s command requires %d parameters.\n", argv[ 0], requiredParams);
                     displayHelp = true;
@@ -231,7 +266,7 @@ int GetAllOpts(
             // Validate parameter types
 
             char typeCode = 'S';
-			int localOptInd = optind;
+			int localOptInd = scan.index;
             for( int a=0; a < requiredParams && localOptInd + a < argc; a++)
             {// No need to check type code S
                 typeCode = paramOpts[ a];
@@ -337,7 +372,7 @@ int GetAllOpts(
 //		printf( "Version %s %s %s\n", versionString, __DATE__, __TIME__);
         sraise( "Stopped by -h.", nullptr);
     }
-    return optind;
+    return scan.index;
 }
 
 
@@ -707,11 +742,9 @@ public:
 #include "lut.h"
 static lut<note_t> sNoteList;
 
-double PitchToFreq( const char* arg)
-{// For accepting pitch on the command line as substitute for frequency
-	// a4 is 440hz
-	if( sNoteList.count( NULL, 0, NULL) == 0)
-	{// No list yet, make it
+static bool BuildNoteList()
+{// a4 is 440hz
+	{
 		const char * notess[] = { "c", "c#", "d", "d#", "e", "f", "f#", "g", "g#", "a", "a#", "b"};
 		const char * notesf[] = { "c", "db", "d", "eb", "fb", "f", "gb", "g", "ab", "a", "bb", "cb"};
 		// Also the upper case versions
@@ -744,6 +777,13 @@ double PitchToFreq( const char* arg)
 			}
 		}
 	}
+	return true;
+}
+
+double PitchToFreq( const char* arg)
+{// For accepting pitch on the command line as substitute for frequency
+	static bool built = BuildNoteList();	// Once, even with options being parsed on several threads
+	(void) built;
 	note_t* thisNote = sNoteList.lookup( arg, strli( arg));
 	if( thisNote)
 		return thisNote->iFreq;
@@ -1570,6 +1610,18 @@ EditableCommandLine::EditableCommandLine( const char* promptp)
 {
 }
 
+void EditableCommandLine::Grow( size_t needed)
+{// Doubles, so a long paste costs about the same as a short one per character
+	size_t size = cmdLineStorage.size();
+	if( needed <= size)
+		return;
+	while( size < needed)
+		size *= 2;
+	cmdLineStorage.resize( size, 0);
+	cmdLine = cmdLineStorage.data();
+	len = (int) size - 1;
+}
+
 void EditableCommandLine::DisplayPrompt()
 {
 	char ch = cmdLine[ pos];
@@ -1651,10 +1703,9 @@ char* EditableCommandLine::ProcessOneCharacter( int readCh)
         if( arrowPos < cmdLineHistory.size())
         {
             ++arrowPos;
-            if( arrowPos == cmdLineHistory.size())
-                strncpy( cmdLine, temporaryLastLine.c_str(), len);
-            else
-                strncpy( cmdLine, cmdLineHistory[ arrowPos].c_str(), len);
+            const std::string &line = arrowPos == cmdLineHistory.size() ? temporaryLastLine : cmdLineHistory[ arrowPos];
+            Grow( line.length() + 1);
+            strncpy( cmdLine, line.c_str(), len);
             cmdLen = strli( cmdLine);
             pos = cmdLen;
             printf( "\n%s %.*s\033" "7%s\033" "8", prompt, pos, cmdLine, &cmdLine[ pos]); fflush( stdout);
@@ -1668,6 +1719,7 @@ char* EditableCommandLine::ProcessOneCharacter( int readCh)
                 temporaryLastLine = cmdLine;
             }
             --arrowPos;
+            Grow( cmdLineHistory[ arrowPos].length() + 1);
             strncpy( cmdLine, cmdLineHistory[ arrowPos].c_str(), len);
             pos = strli( cmdLine);
             cmdLen = strli( cmdLine);
@@ -1678,7 +1730,7 @@ char* EditableCommandLine::ProcessOneCharacter( int readCh)
         if( pos < cmdLen)
         {
 			int glyphLen = UTF8TotalGlyphLength( (uint8_t*) cmdLine, pos, cmdLen, &pos);
-			memcpy( &cmdLine[ pos], &cmdLine[ pos+glyphLen], len - pos - glyphLen);
+			memmove( &cmdLine[ pos], &cmdLine[ pos+glyphLen], cmdLen - pos - glyphLen + 1);
             printf( "\033" "7\033[K%s\033" "8", &cmdLine[pos]); fflush( stdout);
         }
         break;
@@ -1687,7 +1739,7 @@ char* EditableCommandLine::ProcessOneCharacter( int readCh)
         if( pos > 0)
         {
 			int glyphLen = UTF8TotalGlyphLength( (uint8_t*) cmdLine, pos-1, cmdLen, &pos);
-			memcpy( &cmdLine[ pos], &cmdLine[ pos+glyphLen], len - pos - glyphLen);
+			memmove( &cmdLine[ pos], &cmdLine[ pos+glyphLen], cmdLen - pos - glyphLen + 1);
             if( glyphLen > 2)
                 DisplayPrompt();    // Might bee a double wide
             else
@@ -1712,7 +1764,9 @@ char* EditableCommandLine::ProcessOneCharacter( int readCh)
         DisplayPrompt();
         break;
     default:
-        memcpy( &cmdLine[ pos+1], &cmdLine[ pos], len - pos);
+        if( cmdLen + 1 >= len)
+            Grow( cmdLen + 2);
+        memmove( &cmdLine[ pos+1], &cmdLine[ pos], cmdLen - pos + 1);
         ++cmdLen;      // We cached string length earlier
         cmdLine[ pos++] = (char) readCh;
         if( utfBytesLeft)
@@ -1727,7 +1781,7 @@ char* EditableCommandLine::ProcessOneCharacter( int readCh)
         {// Reached the end of this UTF8 multi-byte - or is just one byte
 			if( Utf8IsEvilVariationSelector( &cmdLine[ utfPos]))
 			{// MacOS terminal can't display skin tone modifiers correctly, skip them
-				memcpy( &cmdLine[ utfPos], &cmdLine[ pos], len - pos);
+				memmove( &cmdLine[ utfPos], &cmdLine[ pos], cmdLen - pos + 1);
 				pos = utfPos;
 				break;
 			}
@@ -25,11 +25,11 @@ double ConvertAsciiToFloat( const char* s);	// Like xatof but also accepts hexad
 double PitchToFreq( const char* s);			// Like ConvertAsciiToFloat but also accepts musical notes
 double ConvertTimeToSeconds( const char* curArg);	// accepts hh:mm:ss.sss but also falls back to PitchToFreq
 time_t xatot( const char* datetimeString);	// Accepts date and time as yyyy-mm-dd hh:mm:ss
-char* MakeCommandLine( int argc, const char * const argv[]);	// Returns a static buffer
+char* MakeCommandLine( int argc, const char * const argv[]);	// Returns a buffer private to the calling thread
 void EnableVT100Console();
 size_t decode_utf8_to_utf32( uint32_t *utf32Ptr, const uint8_t* utf8_ptr);
 
-// Options interpreter with built-in help
+// Options interpreter with built-in help, safe to call from several threads at once
 
 int GetAllOpts(
     int argc, const char * const argv[],
@@ -172,6 +172,10 @@ public:
     size_t ReadBuf( char* buf, size_t len);
     int ReadChar();
     int ReadCmd();
+    inline int TypeAhead() const	// Characters already read but not returned yet
+    {
+        return iTypeAheadLength;
+    }
     void ReadLine( 	// Reads in a whole line to typeahaed buffer, or provided buffer
     	char* buf = nullptr,
     	size_t buflen = 0);
@@ -222,16 +226,19 @@ void DoHelp(
 
 class EditableCommandLine
 {
-    char cmdLine[ 512] = {0};    // Command line read asynchrounously
+    std::vector<char> cmdLineStorage = std::vector<char>( 512, 0);   // Grows for long lines
+    char* cmdLine = cmdLineStorage.data();    // Command line read asynchrounously
     static std::vector<std::string> cmdLineHistory;
     std::string temporaryLastLine;
     size_t arrowPos = (int) cmdLineHistory.size();           // Position in cmdLineHistory for uparrow/downarrow
     int pos = 0;            // Byte position to insert in cmdLine
     int utfBytesLeft = 0;   // Working out a UTF8 multibyte
     int utfPos = 0;         // Position of first byte of UTF8  multibyte
-    int len = CountItems( cmdLine) - 1;  // Always leave the trailing nul
+    int len = (int) cmdLineStorage.size() - 1;  // Always leave the trailing nul
     const char* prompt = ">";
 
+    void Grow( size_t needed);    // Room for at least needed bytes, including the nul
+
 public:
     EditableCommandLine( const char* promptp);
     void DisplayPrompt();
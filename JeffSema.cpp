@@ -3,62 +3,122 @@
 
 #include "JeffSema.h"
 #include <errno.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int Futex( std::atomic<int32_t>* address, int op, int32_t value, const struct timespec* timeout = nullptr)
+{
+	return (int) syscall( SYS_futex, (int32_t*) address, op | FUTEX_PRIVATE_FLAG, value, timeout, nullptr, FUTEX_BITSET_MATCH_ANY);
+}
+#endif
 
 JeffSemaphore::JeffSemaphore()
 :
-	iCurrentCount( 0)
+	iCurrentCount( 0),
+	iWakeups( 0)
 {
+#if !defined(__linux__)
 	pthread_mutex_init( &iMutex, nullptr);
 	pthread_cond_init( &iCond, nullptr);
+#endif
 }
 
-bool JeffSemaphore::Decrement( const struct timespec * wakeupTime)
-{// Should probably return something if we timed out with
+bool JeffSemaphore::TakeWakeup( const struct timespec * wakeupTime)
+{// Waits for Increment to give us a wakeup
+#if defined(__linux__)
+	for(;;)
+	{
+		int32_t wakeups = iWakeups.load( std::memory_order_relaxed);
+		while( wakeups > 0)
+		{
+			if( iWakeups.compare_exchange_weak( wakeups, wakeups - 1, std::memory_order_acquire, std::memory_order_relaxed))
+				return true;
+		}
+		if( wakeupTime == nullptr)
+			Futex( &iWakeups, FUTEX_WAIT, 0);	// Only sleeps if there are still none
+		else if( Futex( &iWakeups, FUTEX_WAIT_BITSET | FUTEX_CLOCK_REALTIME, 0, wakeupTime) != 0 && errno == ETIMEDOUT)
+			return false;
+	}
+#else
 	bool retval = true;
 	pthread_mutex_lock( &iMutex);
-	while( iCurrentCount == 0)
+	while( iWakeups.load( std::memory_order_relaxed) == 0)
 	{// Until the mutex is released, wait for it
-		if( ETIMEDOUT == pthread_cond_timedwait( &iCond, &iMutex, wakeupTime))
+		if( wakeupTime == nullptr)
+			pthread_cond_wait( &iCond, &iMutex);
+		else if( ETIMEDOUT == pthread_cond_timedwait( &iCond, &iMutex, wakeupTime))
 		{
-			++iCurrentCount;	// Make up for decrement after break
 			retval = false;
 			break;
 		}
 	}
-	--iCurrentCount;
+	if( retval)
+		iWakeups.fetch_sub( 1, std::memory_order_relaxed);
 	pthread_mutex_unlock( &iMutex);
 	return retval;
+#endif
 }
 
-bool JeffSemaphore::Decrement( )
+void JeffSemaphore::GiveWakeups( int32_t count)
 {
+#if defined(__linux__)
+	iWakeups.fetch_add( count, std::memory_order_release);
+	Futex( &iWakeups, FUTEX_WAKE, count);
+#else
 	pthread_mutex_lock( &iMutex);
-	while( iCurrentCount == 0)
-	{// Until the mutex is released, wait for it
-		pthread_cond_wait( &iCond, &iMutex);
-	}
-	iCurrentCount--;
+	iWakeups.fetch_add( count, std::memory_order_relaxed);
+	for( int32_t w = 0; w < count; ++w)
+		pthread_cond_signal( &iCond);
 	pthread_mutex_unlock( &iMutex);
-	return true;
+#endif
+}
+
+bool JeffSemaphore::Wait( const struct timespec * wakeupTime)
+{// We already counted ourselves as waiting
+	if( TakeWakeup( wakeupTime))
+		return true;
+	int32_t current = iCurrentCount.load( std::memory_order_relaxed);
+	while( current < 0)
+	{// Timed out, stop being counted as waiting, unless an Increment already counted us out
+		if( iCurrentCount.compare_exchange_weak( current, current + 1, std::memory_order_relaxed))
+			return false;
+	}
+	return TakeWakeup( nullptr);	// It did, so our wakeup is on its way
+}
+
+bool JeffSemaphore::Decrement( const struct timespec * wakeupTime)
+{// Returns false if we timed out
+	if( iCurrentCount.fetch_sub( 1, std::memory_order_acquire) > 0)
+		return true;
+	return Wait( wakeupTime);
+}
+
+bool JeffSemaphore::Decrement( )
+{
+	if( iCurrentCount.fetch_sub( 1, std::memory_order_acquire) > 0)
+		return true;
+	return Wait( nullptr);
 }
 
 bool JeffSemaphore::Increment(
 	unsigned long count)			// How far to increment
 {
-	bool retval = true;
-	pthread_mutex_lock( &iMutex);
-	iCurrentCount += count;
-	if( iCurrentCount == 1)
-		pthread_cond_signal( &iCond);
-	else
-		pthread_cond_broadcast( &iCond);
-	pthread_mutex_unlock( &iMutex);
-	return retval;
+	int32_t previous = iCurrentCount.fetch_add( (int32_t) count, std::memory_order_release);
+	if( previous < 0)
+	{// Someone is waiting, wake up as many as we can satisfy
+		int32_t waiting = -previous;
+		GiveWakeups( waiting < (int32_t) count ? waiting : (int32_t) count);
+	}
+	return true;
 }
 
 JeffSemaphore::~JeffSemaphore()
 {
+#if !defined(__linux__)
 	pthread_cond_destroy( &iCond);
 	pthread_mutex_destroy( &iMutex);
+#endif
 }
 
@@ -5,13 +5,29 @@
 
 #define _TIMESPEC_DEFINED   // pthread.h needs this on Windows to avoid duplicate definition
 #include <pthread.h>
+#include <atomic>
+#include <stdint.h>
 
+/*
+		The count is an atomic that goes negative by the number of threads waiting, so when
+		nobody has to wait, Increment and Decrement are one atomic instruction each.  Only
+		waiting, and waking waiters, goes to the system, a futex on Linux, and a mutex and
+		condition elsewhere.  Increment hands out exactly as many wakeups as there are
+		waiters it satisfies, so nobody else wakes up to find nothing there.
+*/
 class JeffSemaphore
 {
 private:
-	unsigned long iCurrentCount;		// Current state, 0 is unlocked
-	pthread_mutex_t iMutex;				// Locks semaphore's counter and condition
-	pthread_cond_t iCond;				// Conditions the value of the semaphore
+	std::atomic<int32_t> iCurrentCount;	// Current state, negative is how many are waiting
+	std::atomic<int32_t> iWakeups;		// Handed out by Increment to waiters, not taken yet
+#if !defined(__linux__)
+	pthread_mutex_t iMutex;				// Only used for waiting
+	pthread_cond_t iCond;
+#endif
+
+	bool TakeWakeup( const struct timespec * wakeupTime);	// False on timeout
+	void GiveWakeups( int32_t count);
+	bool Wait( const struct timespec * wakeupTime);
 
 public:
 	JeffSemaphore();
@@ -20,13 +36,16 @@ public:
 	
 	bool Decrement(	);			// Decrement (should include a wait time)
 
-	bool Decrement( const struct timespec * wakeupTime);
+	bool Decrement( const struct timespec * wakeupTime);	// Absolute time of day, false if it got there first
 
 	bool Increment(				// Increment (signal)
 		unsigned long count = 1);			// How many times to increment count
 	
 	inline unsigned long Count() const	// Returns current count
-		{return iCurrentCount;}
+	{
+		int32_t count = iCurrentCount.load( std::memory_order_relaxed);
+		return count > 0 ? (unsigned long) count : 0;
+	}
 };
 
 
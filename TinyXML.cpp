@@ -9,6 +9,9 @@
 
 #include "xraise.h"
 #include "TinyXML.hpp"
+#include "bytescan.hpp"
+#include "json.hpp"
+#include <algorithm>
 
 static bool sPreserveCase = false;
 
@@ -39,20 +42,28 @@ static char* SkipQuotedString( char* pos)
 {// pos should be pointing at the open quote, we use that as the quote character
  // Quotes are quoted with "\"
 	char theQuote = *pos++;
-	while( *pos && *pos != theQuote)
+	for( ;;)
 	{
-		if( *pos == '\\' && pos[1] ==  theQuote)
-			++pos;	// Skip quoted quotes
-		++pos;
+		pos = FindEitherInString( pos, theQuote, '\\');
+		if( *pos != '\\')
+			return pos;		// The close quote, or the end
+		pos += pos[1] == theQuote ? 2 : 1;	// Skip quoted quotes
 	}
-	return pos;
 }
 
+/*
+		The skippers below jump straight to the next byte that could matter, a quote, the
+		first character of the delimiter, or the nul, and only compare the whole delimiter
+		there.  They stop in exactly the places the one byte at a time loops did.
+*/
 static char* SkipEverythingUntil( char* pos, const char* delimiter)
 {// Skips ahead to delimited given, but allows the delimiter within quotes
 	size_t dlen = strlen( delimiter);
-	while( *pos && strncmp( pos, delimiter, dlen) != 0)
+	for( ;;)
 	{
+		pos = FindAnyInString( pos, delimiter[ 0], '"', '\'');
+		if( *pos == 0 || strncmp( pos, delimiter, dlen) == 0)
+			break;
 		if( *pos == '"' || *pos == '\'')
 			pos = SkipQuotedString( pos);
 		if( *pos) ++pos;
@@ -60,58 +71,48 @@ static char* SkipEverythingUntil( char* pos, const char* delimiter)
 	if( *pos)
 	{	// Nullify and skip the delimiter
 		*pos = 0;
-		pos += strlen( delimiter);
+		pos += dlen;
 	}
 	return pos;
 }
 
 static char* SkipWhitespace( char* pos)
 {// Returns pointer to first non-whitespace character
-	while( *pos)
+	for( ;;)
 	{
-		if( strncmp( pos, "<!--", 4) == 0)
-			pos = SkipEverythingUntil( pos, "-->");
-		else if( *pos > ' ')
-			break;
-		else
-			++pos;
+		pos = SkipSpaceInString( pos);
+		if( *pos != '<' || strncmp( pos, "<!--", 4) != 0)
+			return pos;
+		pos = SkipEverythingUntil( pos, "-->");
 	}
-	return pos;
 }
 
 
 static char* SkipEverythingUntil( char* pos, char delimiter)
 {// Skips ahead to delimited given, but allows the delimiter within quotes
 	pos = SkipWhitespace( pos);
-	while( *pos && *pos != delimiter)
+	for( ;;)
 	{
-		if( *pos == '"')
-			pos = SkipQuotedString( pos);
+		pos = FindEitherInString( pos, delimiter, '"');
+		if( *pos == 0 || *pos == delimiter)
+			break;
+		pos = SkipQuotedString( pos);
 		if( *pos) ++pos;
 	}
 	if( *pos) *pos++ = 0;	// Nullify and skip the delimiter
 	return pos;
 }
 
-static char* SkipEverythingUntilButLeaveBehind( char* pos, char delimiter, char del2)
-{// Skips ahead to delimited given, but allows the delimiter within quotes
-	pos = SkipWhitespace( pos);
-	while( *pos && *pos != delimiter && *pos != del2)
-	{
-		if( *pos == '"')
-			pos = SkipQuotedString( pos);
-		if( *pos) ++pos;
-	}
-	return pos;
-}
-
 bool SkipEverythingUntil( char* &pos, char delimiter1, const char* delimiter2)
 {// Skips until the first one of the pair. "pos" is updated in place
 	bool retval = false;		// True means we matched delimter2, False delimter1 or end of string
 	size_t dlen = strlen( delimiter2);
 	pos = SkipWhitespace( pos);
-	while( *pos && *pos != delimiter1 && strncmp( pos, delimiter2, dlen) != 0)
+	for( ;;)
 	{
+		pos = FindAnyInString( pos, delimiter1, delimiter2[ 0], '"');
+		if( *pos == 0 || *pos == delimiter1 || strncmp( pos, delimiter2, dlen) == 0)
+			break;
 		if( *pos == '"')
 			pos = SkipQuotedString( pos);
 		if( *pos) ++pos;
@@ -141,11 +142,89 @@ static char* SkipComment( char* pos)
 	return pos;
 }
 
+void TinyXml::Clear()
+{
+	iNodes.clear();
+	iNodes.reserve( 64);
+	iKeywordIds.clear();
+	iKeywordCounts.clear();
+	iSavedCounts.clear();
+	iPathHeads.clear();
+	iPathEntries.clear();
+	iIndexed = false;
+}
+
+int TinyXml::NewNode()
+{// Not linked in yet, and any reference into the arena is stale after this
+	iNodes.emplace_back();
+	return (int) iNodes.size() - 1;
+}
+
+void TinyXml::LinkChild( int parent, int child)
+{// Appends child to the end of parent's list
+	iNodes[ child].parent = parent;
+	int last = iNodes[ parent].lastChild;
+	if( last < 0)
+		iNodes[ parent].firstChild = child;
+	else
+		iNodes[ last].nextSibling = child;
+	iNodes[ parent].lastChild = child;
+}
+
+/*
+		Sibling indexes.  Each keyword gets an id the first time it is seen, and one count, which
+		belongs to whichever open element had a child with it last.  When an element claims a
+		count from an outer one, the outer one's is saved, and put back as the inner one closes,
+		so a child's index is found in constant time however many siblings came before it.
+*/
+size_t TinyXml::CaseBlindHash::operator()( const char* keyword) const
+{
+	size_t hash = 0;
+	for( ; *keyword; ++keyword)
+		hash = hash * 31 + (unsigned char) toupper_c( *keyword);
+	return hash;
+}
+
+bool TinyXml::CaseBlindEqual::operator()( const char* a, const char* b) const
+{
+	return strcasecmp( a, b) == 0;
+}
+
+int TinyXml::NextIndex( int parent, const char* keyword)
+{// How many earlier children of parent had this keyword
+	int id = iKeywordIds.try_emplace( keyword, (int) iKeywordCounts.size()).first->second;
+	if( id == (int) iKeywordCounts.size())
+		iKeywordCounts.emplace_back();
+	KeywordCount_t &slot = iKeywordCounts[ id];
+	if( slot.owner != parent)
+	{// Parent's first one, keep whoever had it
+		iSavedCounts.push_back( { id, slot});
+		slot.owner = parent;
+		slot.count = 0;
+	}
+	return slot.count++;
+}
+
+void TinyXml::ForgetCounts( size_t saved)
+{// Puts back the counts saved since saved, newest first
+	while( iSavedCounts.size() > saved)
+	{
+		iKeywordCounts[ iSavedCounts.back().keyword] = iSavedCounts.back().count;
+		iSavedCounts.pop_back();
+	}
+}
+
 char* TinyXml::Initialize( char* pos, const char* parentKeyword /* == nullptr */)
-{// Recursively initialize a TinyXML thing.
+{// Initialize a TinyXML thing.
  // BEWARE! the caracter string passed IS modified, terminating nuls are scattered througought,
  // and must have a lifetime that exceeds this object, as we keep pointers into it.  It is NOT
  // copied.
+	Clear();
+	return ParseElement( NewNode(), pos, parentKeyword);
+}
+
+char* TinyXml::ParseElement( int node, char* pos, const char* parentKeyword)
+{// Recursively parses one element into node, and its children after it in the arena
 	pos = SkipWhitespace( pos);
 	pos = SkipEverythingUntil( pos, '<');
 	while( *pos == '!')	// Should probably be all non-token characters
@@ -158,24 +237,25 @@ char* TinyXml::Initialize( char* pos, const char* parentKeyword /* == nullptr */
 	{// We're finishing our parent's block
 		return pos;
 	}
-	iMyKeyword = pos;
+	const char* myKeyword = pos;
+	iNodes[ node].keyword = myKeyword;
 	pos = SkipTokenStuff( pos);
 	char* keyworedEnd = pos;
 	pos = SkipWhitespace( pos);
-	iMyParameters = pos;
-	iSelfTerminated = SkipEverythingUntil( pos, '>', "/>");	//Updates 'pos', handles self-terminated case
+	iNodes[ node].parameters = pos;
+	bool selfTerminated = SkipEverythingUntil( pos, '>', "/>");	//Updates 'pos', handles self-terminated case
 	*keyworedEnd = 0;
 
 	#ifdef TOUCHSTONE
-	if( parentKeyword && strcasecmp( parentKeyword, "tr") == 0 && strcasecmp( parentKeyword, iMyKeyword) == 0)
+	if( parentKeyword && strcasecmp( parentKeyword, "tr") == 0 && strcasecmp( parentKeyword, myKeyword) == 0)
 	{// Need to back up and end the parent, bug in touchstone HTML
 		*keyworedEnd = '>';
-		pos = iMyKeyword-1;
+		pos = (char*) myKeyword-1;
 		*pos = -1;
 		return pos;
 	}
 
-	if( !iSelfTerminated)
+	if( !selfTerminated)
 	{// Old style keywords that always self terminate (Touchstone)
 		const char* selfies[] =
 		{
@@ -186,37 +266,41 @@ char* TinyXml::Initialize( char* pos, const char* parentKeyword /* == nullptr */
 
 		for( int s = 0; s < CountItems( selfies); ++s)
 		{// Check the list for selfies
-			if( strcasecmp( iMyKeyword, selfies[ s]) == 0)
+			if( strcasecmp( myKeyword, selfies[ s]) == 0)
 			{// Matched
-				iSelfTerminated = true;
+				selfTerminated = true;
 				break;
 			}
 		}
 	}
 	#endif
 	
-	if( iSelfTerminated)
+	if( selfTerminated)
 	{
 		pos = SkipWhitespace( pos);
 	}
-	iMyContent = pos;
-	//printf( "Parsing %s\n", iMyKeyword);
+	iNodes[ node].selfTerminated = selfTerminated;
+	iNodes[ node].content = pos;
+	//printf( "Parsing %s\n", myKeyword);
 /*
-		Iterate filling in our tag list until we get our delimiter
+		Iterate filling in our tag list until we get our delimiter.  Each candidate goes on the
+		end of the arena, and if it turns out not to be a child, it and everything parsed into
+		it is dropped by cutting the arena back.
 */
-	for(;!iSelfTerminated;)
+	size_t myCounts = iSavedCounts.size();
+	for(;!selfTerminated;)
 	{// For each tag you find
-		TinyXml candidate;
-		candidate.iMyIndex = 0;
-		candidate.iMyKeyword = nullptr;
-		pos = candidate.Initialize( pos, iMyKeyword);
+		int candidate = NewNode();
+		pos = ParseElement( candidate, pos, myKeyword);
 		if( *pos == -1)
 		{// Handles case where closers are omitted, and parents are closed by their children
 			*pos = '<';
+			iNodes.resize( candidate);
 			break;
 		}
 		if( *pos == '/')
 		{// This is our closer, or it at least SHOULD be
+			iNodes.resize( candidate);
 			pos = SkipWhitespace( ++pos);	// This is probably not required
 			char* myCloser = pos;
 			pos = SkipTokenStuff( pos);
@@ -225,46 +309,39 @@ char* TinyXml::Initialize( char* pos, const char* parentKeyword /* == nullptr */
 			pos = SkipEverythingUntil( pos, '>');
 			pos = SkipWhitespace( pos);
 			*myCloserEnd = 0;
-			if( strcasecmp( iMyKeyword, myCloser) != 0)
+			if( strcasecmp( myKeyword, myCloser) != 0)
 			{
 				if( parentKeyword && strcasecmp( parentKeyword, myCloser) == 0)
 				{// This is my parent's closer, mine is missing
 					// Uncomment these fprintf's if you want malform XML diagnostics
-					//fprintf( stderr, "Unbalenced tokens, %s closed by parent /%s\n", iMyKeyword, myCloser);
+					//fprintf( stderr, "Unbalenced tokens, %s closed by parent /%s\n", myKeyword, myCloser);
 					*myCloserEnd = '>';	// Put this back
+					ForgetCounts( myCounts);
 					return myCloser-1;	// Let parent close itself
 				}
-				//fprintf( stderr, "Unbalenced tokens, %s closed by /%s\n", iMyKeyword, myCloser);
+				//fprintf( stderr, "Unbalenced tokens, %s closed by /%s\n", myKeyword, myCloser);
 			}
 			break;
 		}
-		//	Figure out the index for this keyword by counting predecessors that match
-		if( candidate.iMyKeyword)
-		{// If *pos is nul, iMyKeyword may or may not have been set.
-			for( std::vector<TinyXml*>::iterator it = iXmlContent.begin() ; it != iXmlContent.end(); ++it)
-			{
-				if( strcasecmp( (*it)->iMyKeyword, candidate.iMyKeyword) == 0)
-					candidate.iMyIndex++;
-			}
-			iXmlContent.push_back( new TinyXml( candidate));
-			candidate.iXmlContent.clear();
+		//	The index for this keyword is the number of predecessors that match
+		if( iNodes[ candidate].keyword)
+		{// If *pos is nul, the keyword may or may not have been set.
+			iNodes[ candidate].index = NextIndex( node, iNodes[ candidate].keyword);
+			LinkChild( node, candidate);
 		}
+		else
+			iNodes.resize( candidate);
 		if( *pos == 0)
 		{
 			break;	// Okay, we're done
 		}
 	}
+	ForgetCounts( myCounts);
 	return pos;
 }
 
 TinyXml::~TinyXml()
-{
-	while( iXmlContent.size())
-	{
-		auto temp = iXmlContent.back();
-		delete temp;
-		iXmlContent.pop_back();
-	}
+{// The arena goes in one piece
 }
 
 bool CompareKeywordLists( const keywordPair_t* partialKeywordList, const keywordPair_t* fullKeywordList)
@@ -291,27 +368,141 @@ bool CompareKeywordLists( const keywordPair_t* partialKeywordList, const keyword
 	}
 }
 
-typedef struct InquiryContext
-{// Used by InquireByKeyword to walk the tags looking for the value
-	const keywordPair_t* keywordList;
-	char** returnedParameters;
-	char** returnedValue;
-} InquiryContext_t;
+/*
+		A query matches a node when its steps, inner to outer, match the node and its parents.
+		Nodes are in document order in the arena, which is the order IterateOverCcontent would
+		find them, so the first match is the same one it would stop at.  With the index, only
+		the nodes whose innermost kIndexDepth steps hash the same are checked.
+*/
+TinyXmlQuery::TinyXmlQuery( const keywordPair_t* keywordList)
+{
+	for( ; keywordList; keywordList = keywordList->iParent)
+		Append( keywordList->keyword, keywordList->index);
+	std::reverse( iSteps.begin(), iSteps.end());	// That list went inner to outer
+}
+
+TinyXmlQuery::TinyXmlQuery( const char* keyword, int index, ...)
+{
+	va_list vl;
+	va_start( vl, index);
+	while( keyword)
+	{
+		Append( keyword, index);
+		keyword = va_arg( vl, const char*);
+		if( keyword)
+			index = va_arg( vl, int);
+	}
+	va_end( vl);
+}
+
+void TinyXmlQuery::Append( const char* keyword, int index)
+{
+	iSteps.push_back( { keyword, index, StepHash( keyword, index)});
+}
+
+uint64_t TinyXmlQuery::IndexKey() const
+{
+	size_t steps = iSteps.size();
+	uint64_t path = iSteps[ steps - 1].hash;
+	for( size_t s = 1; s < steps && s < kIndexDepth; ++s)
+		path = Outward( path, iSteps[ steps - 1 - s].hash);
+	return path;
+}
+
+uint64_t TinyXmlQuery::StepHash( const char* keyword, int index)
+{// FNV-1a, upper cased to match strcasecmp
+	uint64_t hash = 14695981039346656037ull;
+	for( ; keyword && *keyword; ++keyword)
+		hash = (hash ^ (unsigned char) toupper_c( *keyword)) * 1099511628211ull;
+	return (hash ^ (uint32_t) index) * 1099511628211ull;
+}
 
-static bool InquiryFinder( void* context, const keywordPair_t* keywordList, char* parameters, char* contentValue)
-{//
-	InquiryContext_t* ic = (InquiryContext_t *) context;
-	if( CompareKeywordLists( ic->keywordList, keywordList))
-	{// Got a match, return the value
-		if( ic->returnedParameters)
-			*(ic->returnedParameters) = parameters;
-		if( ic->returnedValue)
-			*(ic->returnedValue) = contentValue;
-		return false;	// We're done
+uint64_t TinyXmlQuery::Outward( uint64_t path, uint64_t step)
+{
+	return path ^ (step + 0x9e3779b97f4a7c15ull + (path << 6) + (path >> 2));
+}
+
+bool TinyXml::Matches( int node, const TinyXmlQuery &query) const
+{// Same test as CompareKeywordLists
+	const std::vector<TinyXmlQuery::Step_t> &steps = query.Steps();
+	for( size_t s = steps.size(); s-- > 0; node = iNodes[ node].parent)
+	{
+		if( node < 0)
+			return false;		// The query goes further out than the document
+		const TinyXmlNode_t &me = iNodes[ node];
+		if( me.index != steps[ s].index || me.keyword == nullptr || strcasecmp( me.keyword, steps[ s].keyword) != 0)
+			return false;
 	}
-	return true;	// Not found, keep looing
+	return true;
 }
 
+void TinyXml::BuildIndex()
+{// Each node goes in under its innermost path of each length up to kIndexDepth
+	iPathHeads.clear();
+	iPathEntries.clear();
+	iIndexed = false;
+	if( !Initialized())
+		return;
+	std::vector<uint64_t> stepHashes( iNodes.size());
+	for( size_t n = 0; n < iNodes.size(); ++n)
+		stepHashes[ n] = TinyXmlQuery::StepHash( iNodes[ n].keyword, iNodes[ n].index);
+	iPathEntries.reserve( iNodes.size() * 2);
+	iPathHeads.reserve( iNodes.size() * 2);
+	for( int node = (int) iNodes.size() - 1; node >= 0; --node)
+	{// Backwards, adding to the front, so each path's entries are in document order
+		uint64_t path = stepHashes[ node];
+		int outer = node;
+		for( int depth = 0; depth < TinyXmlQuery::kIndexDepth; ++depth)
+		{
+			int &head = iPathHeads.try_emplace( path, -1).first->second;
+			iPathEntries.push_back( { node, head});
+			head = (int) iPathEntries.size() - 1;
+			outer = iNodes[ outer].parent;
+			if( outer < 0)
+				break;
+			path = TinyXmlQuery::Outward( path, stepHashes[ outer]);
+		}
+	}
+	iIndexed = true;
+}
+
+bool TinyXml::InquireByKeyword( const TinyXmlQuery &query, char** returnedParameters, char** returnedValue)
+{// Returns what the first node that matches would have been handed by IterateOverCcontent, true if there is one
+	if( !Initialized() || query.Empty())
+		return false;
+	int found = -1;
+	if( iIndexed)
+	{
+		auto head = iPathHeads.find( query.IndexKey());
+		for( int entry = head == iPathHeads.end() ? -1 : head->second; entry >= 0; entry = iPathEntries[ entry].next)
+		{
+			if( Matches( iPathEntries[ entry].node, query))
+			{
+				found = iPathEntries[ entry].node;
+				break;
+			}
+		}
+	}
+	else
+	{// One pass over the arena
+		for( int node = 0; node < (int) iNodes.size(); ++node)
+		{
+			if( Matches( node, query))
+			{
+				found = node;
+				break;
+			}
+		}
+	}
+	if( found < 0)
+		return false;
+	const TinyXmlNode_t &me = iNodes[ found];
+	if( returnedParameters)
+		*returnedParameters = me.parameters;
+	if( returnedValue)
+		*returnedValue = me.firstChild < 0 ? me.content : nullptr;	// Null when it has children, like the handler gets
+	return true;
+}
 
 bool TinyXml::InquireByKeyword( const keywordPair_t* keywordList, char** returnedParameters, char** returnedValue)
 {// Returns content for a specific nested list of keywords, true if found, false if not found
@@ -321,10 +512,7 @@ bool TinyXml::InquireByKeyword( const keywordPair_t* keywordList, char** returne
  // Tag heiarchy is only checked as deep as provided. Actual tag heiarchy may be deeper
  //
  // returnedValue is a direct pointer in the content, don't write back to it!
-	if( iMyKeyword == nullptr)
- 		return false;	// We are not initialized
-	InquiryContext_t context = {keywordList, returnedParameters, returnedValue};
-	return !IterateOverCcontent( &context, InquiryFinder, nullptr);
+	return InquireByKeyword( TinyXmlQuery( keywordList), returnedParameters, returnedValue);
 }
 
 bool TinyXml::InquireByKeyword( char** returnedParameters, char** returnedValue, ...)	// Returns content for a specific nested list of keywords
@@ -332,57 +520,47 @@ bool TinyXml::InquireByKeyword( char** returnedParameters, char** returnedValue,
  // After the firs two parameters, it's keyword followed by instance number for the tag nesting your are inquiring
  // Don't forget to add a trailing nullptr at the end of your parameter list or weird things will happen
  // Note you don't need all of the top levels.
-	if( iMyKeyword == nullptr)
- 		return false;	// We are not initialized
+	TinyXmlQuery query;
 	va_list vl;
 	va_start(vl,returnedValue);
-	const keywordPair_t* nextParent = nullptr;
-	keywordPair_t* query = nullptr;
-
 	for(;;)
 	{// Construct as keyword list
 		char* nextKey = va_arg( vl, char*);
 		if( nextKey == nullptr)
 			break;
 		int nextIndex = va_arg( vl, int);
-		query = new keywordPair_t() ;
-		query->iParent = nextParent;
-		query->keyword = nextKey;
-		query->index = nextIndex;
-		nextParent = query;
+		query.Append( nextKey, nextIndex);
 	}
 	va_end(vl);
-	bool retval = InquireByKeyword( query, returnedParameters, returnedValue);
-	const keywordPair_t* cquery = query;
-	while( cquery)
-	{
-		nextParent = cquery->iParent;
-		delete cquery;
-		cquery = nextParent;
-	}
-	return retval;
+	return InquireByKeyword( query, returnedParameters, returnedValue);
 }
 
 bool TinyXml::IterateOverCcontent( void* context, ContentHandler_t handler, const keywordPair_t* parent)
 {// Calls the handler for each terminus keyword. Stops iterating if hander returns false
-	if( iMyKeyword == nullptr)
+	if( !Initialized())
  		return false;	// We are not initialized
+	return IterateOverNode( 0, context, handler, parent);
+}
+
+bool TinyXml::IterateOverNode( int node, void* context, ContentHandler_t handler, const keywordPair_t* parent)
+{
+	const TinyXmlNode_t &me = iNodes[ node];
 	keywordPair_t mykey;
 	mykey.iParent = parent;
-	mykey.keyword = iMyKeyword;
-	mykey.index = iMyIndex;
-	mykey.iSelfTerminated = iSelfTerminated;
-	if( iXmlContent.size() == 0)
+	mykey.keyword = me.keyword;
+	mykey.index = me.index;
+	mykey.iSelfTerminated = me.selfTerminated;
+	if( me.firstChild < 0)
 	{
-		return (*handler)( context, &mykey, iMyParameters, iMyContent);
+		return (*handler)( context, &mykey, me.parameters, me.content);
 	}
 	else
 	{
-		if(! (*handler)( context, &mykey, iMyParameters, nullptr))	// The null content indicates beginning
+		if(! (*handler)( context, &mykey, me.parameters, nullptr))	// The null content indicates beginning
 			return false;
-		for( unsigned int i = 0; i < iXmlContent.size(); ++i)
+		for( int child = me.firstChild; child >= 0; child = iNodes[ child].nextSibling)
 		{
-			if( !iXmlContent[i]->IterateOverCcontent( context, handler, &mykey))
+			if( !IterateOverNode( child, context, handler, &mykey))
 				return false;	// Stop iterating when handler returns false
 		}
 		if(! (*handler)( context, &mykey, nullptr, nullptr))		// The null parameters indicates end
@@ -391,6 +569,279 @@ bool TinyXml::IterateOverCcontent( void* context, ContentHandler_t handler, cons
 	return true;
 }
 
+/*
+		Streaming parse
+
+		Each state picks up where the last chunk left off, and only the tag being read, and the
+		text of an element that may turn out to be a leaf, are copied.  Text and tags are scanned
+		the same way Initialize does, with double quotes hiding delimiters.
+*/
+TinyXmlStream::TinyXmlStream( void* context, ContentHandler_t handler)
+:
+	iContext( context),
+	iHandler( handler)
+{
+}
+
+const char* TinyXmlStream::ScanUntil( const char* pos, const char* end, char stop, std::string* into)
+{// Returns where stop is, outside quotes, or end, adding what it passed to into
+	const char* from = pos;
+	while( pos < end)
+	{
+		if( iQuoted)
+		{
+			if( iEscaped)
+			{// Quoted quotes don't end it
+				iEscaped = false;
+				if( *pos == '"')
+				{
+					++pos;
+					continue;
+				}
+			}
+			pos = FindEither( pos, end, '"', '\\');
+			if( pos == end)
+				break;
+			if( *pos == '\\')
+				iEscaped = true;
+			else
+				iQuoted = false;
+			++pos;
+		}
+		else
+		{
+			pos = FindEither( pos, end, stop, '"');
+			if( pos == end || *pos == stop)
+				break;
+			iQuoted = true;
+			++pos;
+		}
+	}
+	if( into)
+		into->append( from, pos - from);
+	return pos;
+}
+
+std::string* TinyXmlStream::Capturing()
+{// Where text goes, if anywhere
+	if( iDepth == 0)
+		return nullptr;
+	Level_t &top = iLevels[ iDepth-1];
+	if( top.selfTerminated || (!top.started && !top.hasContent))
+		return &top.content;
+	return nullptr;
+}
+
+void TinyXmlStream::EndText()
+{// At a '<', or the end of the input
+	if( iDepth == 0)
+		return;
+	Level_t &top = iLevels[ iDepth-1];
+	if( top.selfTerminated)
+	{// Its content was the text after it, without the leading whitespace
+		size_t skip = 0;
+		while( skip < top.content.length() && top.content[ skip] <= ' ')
+			++skip;
+		top.content.erase( 0, skip);
+		Close();
+	}
+	else if( !top.started)
+		top.hasContent = true;
+}
+
+void TinyXmlStream::Call( Level_t &level, char* parameters, char* content)
+{
+	if( !iStopped && !(*iHandler)( iContext, &level.key, parameters, content))
+		iStopped = true;
+}
+
+void TinyXmlStream::Close()
+{
+	Level_t &top = iLevels[ iDepth-1];
+	if( top.started)
+		Call( top, nullptr, nullptr);		// The null parameters indicates end
+	else
+		Call( top, top.parameters.data(), top.content.data());
+	if( --iDepth == 0)
+		iDone = true;					// Initialize only reads the one element too
+}
+
+void TinyXmlStream::Open( char* pos)
+{
+	char* keyword = pos;
+	pos = SkipTokenStuff( pos);
+	char* keywordEnd = pos;
+	pos = SkipWhitespace( pos);
+	char* parameters = pos;
+	char* parametersEnd = pos + strlen( pos);
+	bool selfTerminated = parametersEnd > parameters && parametersEnd[ -1] == '/';
+	if( selfTerminated)
+		parametersEnd[ -1] = 0;
+	*keywordEnd = 0;			// Same as Initialize, even when the parameters start right there
+
+	int index = 0;
+	if( iDepth > 0)
+	{// Our parent has children after all
+		Level_t &parent = iLevels[ iDepth-1];
+		if( !parent.started)
+		{
+			parent.started = true;
+			Call( parent, parent.parameters.data(), nullptr);	// The null content indicates beginning
+		}
+		iUpper.assign( keyword);
+		for( char &ch : iUpper)
+			ch = toupper_c( ch);
+		index = parent.counts[ iUpper]++;
+	}
+	if( iDepth == iLevels.size())
+	{// Deeper than ever, everything may move
+		iLevels.emplace_back();
+		for( size_t l = 0; l < iDepth; ++l)
+		{
+			iLevels[ l].key.keyword = iLevels[ l].keyword.c_str();
+			iLevels[ l].key.iParent = l > 0 ? &iLevels[ l-1].key : nullptr;
+		}
+	}
+	Level_t &level = iLevels[ iDepth++];
+	level.keyword.assign( keyword);
+	level.parameters.assign( parameters);
+	level.content.clear();
+	level.started = false;
+	level.hasContent = false;
+	level.selfTerminated = selfTerminated;
+	level.counts.clear();
+	level.key.iParent = iDepth > 1 ? &iLevels[ iDepth-2].key : nullptr;
+	level.key.keyword = level.keyword.c_str();
+	level.key.index = index;
+	level.key.iSelfTerminated = selfTerminated;
+}
+
+void TinyXmlStream::Closer( char* pos)
+{
+	char* closer = SkipWhitespace( pos);
+	*SkipTokenStuff( closer) = 0;
+	while( iDepth > 0)
+	{
+		Level_t &top = iLevels[ iDepth-1];
+		bool ours = strcasecmp( top.keyword.c_str(), closer) == 0;
+		bool parents = !ours && iDepth > 1 && strcasecmp( iLevels[ iDepth-2].keyword.c_str(), closer) == 0;
+		Close();
+		if( !parents)
+			break;			// Ours, or unbalanced, it closes us either way
+	}
+}
+
+void TinyXmlStream::Tag()
+{
+	char* pos = SkipWhitespace( &iTag[ 0]);
+	if( *pos == '/')
+		Closer( pos+1);
+	else
+		Open( pos);
+}
+
+bool TinyXmlStream::Feed( const char* data, size_t length)
+{
+	const char* pos = data;
+	const char* end = data + length;
+	while( pos < end && !iStopped && !iDone)
+	{
+		switch( iState)
+		{
+		case kText:
+			pos = ScanUntil( pos, end, '<', Capturing());
+			if( pos < end)
+			{
+				EndText();
+				++pos;
+				iTag.clear();
+				iState = kMarkup;
+			}
+			break;
+		case kMarkup:
+			if( iTag.empty() && *pos != '!')
+			{
+				iState = kTag;
+				break;
+			}
+			iTag += *pos++;
+			if( iTag == "!--")
+				iState = kComment;
+			else if( iTag == "![CDATA[")
+				iState = kCData;
+			else if( strncmp( iTag.c_str(), "!--", iTag.length()) != 0 && strncmp( iTag.c_str(), "![CDATA[", iTag.length()) != 0)
+				iState = kBang;
+			iRun = 0;
+			break;
+		case kTag:
+			pos = ScanUntil( pos, end, '>', &iTag);
+			if( pos < end)
+			{
+				++pos;
+				Tag();
+				iState = kText;
+			}
+			break;
+		case kComment:
+		case kCData:
+			{// Up to "-->" or "]]>"
+				char twice = iState == kComment ? '-' : ']';
+				while( pos < end)
+				{
+					const char* next = FindEither( pos, end, twice, '>');
+					if( next != pos)
+						iRun = 0;		// Anything else in between breaks the run
+					pos = next;
+					if( pos == end)
+						break;
+					if( *pos++ == twice)
+						++iRun;
+					else if( iRun >= 2)
+					{
+						iState = kText;
+						break;
+					}
+					else
+						iRun = 0;
+				}
+			}
+			break;
+		case kBang:
+			pos = ScanUntil( pos, end, '<', nullptr);
+			if( pos < end)
+			{
+				++pos;
+				iTag.clear();
+				iState = kMarkup;
+			}
+			break;
+		}
+	}
+	return !iStopped;
+}
+
+bool TinyXmlStream::Finish()
+{
+	if( iState == kText && !iDone)
+		EndText();
+	while( iDepth > 0)
+		Close();
+	return !iStopped;
+}
+
+bool StreamXmlFile( FILE* f, void* context, ContentHandler_t handler)
+{
+	TinyXmlStream stream( context, handler);
+	std::vector<char> chunk( 65536);
+	size_t got;
+	while( (got = fread( chunk.data(), 1, chunk.size(), f)) > 0)
+	{
+		if( !stream.Feed( chunk.data(), got))
+			return false;
+	}
+	return stream.Finish();
+}
+
 #if 1
 bool batoi( char *s, int *result)
 {// A version of atoi that returns if it was successful or not
@@ -455,6 +906,14 @@ char* ResolveQuotedSpecials( char* pos)
 	char* outPos = pos;
 	while( *pos)
 	{// Copy the string handling special characters
+		char* amp = FindEitherInString( pos, '&', 0);
+		if( amp != pos)
+		{// Plain run up to the next '&'
+			memmove( outPos, pos, amp - pos);
+			outPos += amp - pos;
+			pos = amp;
+			continue;
+		}
 		if( strncmp( pos, "&lt;", 4) == 0)
 		{
 			*outPos++ = '<';
@@ -686,6 +1145,12 @@ bool WriteOutHandler( void* context, const keywordPair_t* keywordList, char* par
 			}
 		}
 	}
+	else if( wc->iXs == nullptr)
+	{// The whole document is one element with only content, like JSON that is just a value
+		wc->iXs = new XmlScope( keywordList->keyword);
+		wc->iXs->s() << contentValue;
+		wc->iXs->CloseTag();
+	}
 	else
 	{// Terminus keyword
 		bool hasMultipleLines = strchr( contentValue, '\n');
@@ -778,105 +1243,74 @@ void ReadCSVFile( char* fileContent, std::vector<std::vector<char*>> &csvContent
 }
 
 static char emptyString = 0;
-char* TinyXml::InitializeFromJSON( char* pos, const char* parentKeyword)
+/*
+		JSON is read with JsonDocument, and mapped onto the same tree XML makes.  The top is
+		"root", each member is named by its key, and each array element is an "Array-Element"
+		indexed by its place in the array.  Strings are unescaped in place, numbers and
+		literals are left as written, and an empty array or object is empty content.
+*/
+char* TinyXml::InitializeFromJSON( char* pos, const char* /*parentKeyword*/)
 {
-// Recursively initialize a TinyXML thing.
+// Initialize a TinyXML thing.
  // BEWARE! the caracter string passed IS modified, terminating nuls are scattered througought,
  // and must have a lifetime that exceeds this object, as we keep pointers into it.  It is NOT
  // copied.
-    if( !iMyKeyword)
-    {
-        iMyKeyword = "root";
-        iMyParameters = &emptyString;
-    }
-	pos = SkipWhitespace( pos);		// BUG this allows XML comments
-	if( *pos == 0)
-	{// I guess we're done
-	}
-	else if( *pos == '[')
-	{// Start list of items
-		++pos;
-		int index = 0;
-		for(;;)
-		{// add each item in the list
-			if(*pos == ']')
-			{
-				++pos;
-				break;		// End of list
-			}
-			iXmlContent.push_back( new TinyXml());
-            iXmlContent[ index]->iMyIndex = index;
-            iXmlContent[ index]->iMyKeyword = "Array-Element";
-            iXmlContent[ index]->iMyParameters = &emptyString;
-			pos = iXmlContent[ index]->InitializeFromJSON( pos, iMyKeyword);
-			++index;
-			pos = SkipWhitespace( pos);
-			if(*pos == ',')
-			{
-				++pos;
-			}
-			else if(*pos == ']')
-			{
-				++pos;
-				break;		// End of list
-			}
-			else
-				xraise( "JSON parse failure, expected ',' or ']'", nullptr);
-		}
-	}
-	else if( *pos == '{')
-	{// I don't fully understand how '{' is different from '['
-	 // other than '[' are unnamed.
-		++pos;
-        for( int index = 0;;++index)
-		{// add each item in the list
-			if(*pos == '}')
-			{
-				++pos;
-				break;		// End of list
-			}
-			iXmlContent.push_back( new TinyXml());
-			//iXmlContent[ index]->iMyIndex = index;
-			pos = iXmlContent[ index]->InitializeFromJSON( pos, iMyKeyword);
-			pos = SkipWhitespace( pos);
-			if(*pos == ',')
-			{
-				*pos++ = 0;
-			}
-			else if(*pos == '}')
+	Clear();
+	size_t length = strlen( pos);
+	JsonDocument document;
+	document.Parse( pos, length);
+	std::vector<char*> ends;		// Numbers and literals are only nul terminated once the document is done reading
+	iNodes.reserve( document.TokenCount() / 2 + 1);	// Never more values than that
+	int root = NewNode();
+	iNodes[ root].keyword = "root";
+	iNodes[ root].parameters = &emptyString;
+	AddJson( root, document.Root(), pos, ends);
+	for( char* end : ends)
+		*end = 0;
+	return pos + length;
+}
+
+void TinyXml::AddJson( int node, const JsonValue &value, char* text, std::vector<char*> &ends)
+{// The value becomes node's children, or its content
+	iNodes[ node].content = &emptyString;
+	switch( value.Type())
+	{
+	case kJsonObject:
+	case kJsonArray:
+		{
+			bool object = value.Type() == kJsonObject;
+			int index = 0;
+			for( JsonValue item = value.First(); item.Valid(); item = item.Next())
 			{
-				*pos++ = 0;
-                Sanitize( iXmlContent[ index]->iMyContent);    // Temporary
-				break;		// End of list
+				int child = NewNode();
+				LinkChild( node, child);
+				iNodes[ child].parameters = &emptyString;
+				if( object)
+				{// Unescaped over itself, where the document won't look again
+					JsonValue key = item.Key();
+					char* start = text + key.Offset() + 1;
+					*JsonUnescape( start, start, start + key.Text().length() - 2) = 0;
+					iNodes[ child].keyword = start;
+				}
+				else
+				{
+					iNodes[ child].keyword = "Array-Element";
+					iNodes[ child].index = index++;
+				}
+				AddJson( child, item, text, ends);
 			}
-			else
-				xraise( "JSON parse failure, expected ',' or '}'", nullptr);
 		}
-	}
-	else if( *pos == '"')
-	{// Start of a keyword
-		iMyKeyword = pos+1;
-		pos = SkipQuotedString( pos);
-		if( *pos)
-		{// Not done, Terminate the keyword and get contents
-            iMyParameters = pos;
-			*pos++ = 0;
-			pos = SkipWhitespace( pos);
-			if( *pos != ':')
-				xraise( "JSON parse failure, expected ':'", nullptr);
-			pos = SkipWhitespace( pos+1);
-			iMyContent = pos;
-			if( *iMyContent == '{' ||  *iMyContent == '[')
-			{// Content is a list, recurse to initialize the list
-				pos = InitializeFromJSON( pos, parentKeyword);
-			}
-			else
-			{// Content from here to comma
-				pos = SkipEverythingUntilButLeaveBehind( pos, ',', '}');
-			}
+		break;
+	case kJsonString:
+		{
+			char* start = text + value.Offset() + 1;
+			*JsonUnescape( start, start, start + value.Text().length() - 2) = 0;
+			iNodes[ node].content = start;
 		}
+		break;
+	default:
+		iNodes[ node].content = text + value.Offset();
+		ends.push_back( text + value.Offset() + value.Text().length());
+		break;
 	}
-	else
-		xraise( "JSON parse failure, expected '{', '[', or a quoted keyword", nullptr);
-	return pos;
 }
@@ -10,6 +10,9 @@
 #define TinyXML_hpp
 #include <vector>
 #include <sstream>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
 
 typedef struct keywordPair
 {// Lists of these are used to define where you are
@@ -19,8 +22,66 @@ typedef struct keywordPair
 	bool iSelfTerminated = false;	// Keyword was termnianted with "/>"
 } keywordPair_t;
 
+class JsonValue;
+
 typedef bool (*ContentHandler_t)( void* context, const keywordPair_t* keywordList, char* parameters, char* contentValue);
 
+/*
+		Every element lives in one arena, in document order, linked to its first child and next
+		sibling by index, so parsing allocates a handful of times however big the document is,
+		and it all goes away at once.  Strings point into the parsed buffer.
+*/
+typedef struct TinyXmlNode
+{
+	const char* keyword = nullptr;		// This is our keyword
+	char* parameters = nullptr;			// This all the stuff between the keyword and the '>', which is enitrely the client's problem
+	char* content = nullptr;			// This is our content, may or may not be more XML tags
+	int index = 0;						// This is our index for this keyword within our parent
+	bool selfTerminated = false;		// True if this came from a <keyword /> construct
+	int parent = -1;					// Arena indexes, -1 for none
+	int firstChild = -1;
+	int lastChild = -1;
+	int nextSibling = -1;
+} TinyXmlNode_t;
+
+/*
+		A keyword list for InquireByKeyword, compiled once and used as many times as you like.
+		Steps are added outer to inner, and like a keywordPair_t list, it only has to match as
+		deep as it goes.  The keywords aren't copied, so they must outlive the query, which
+		string literals do.
+*/
+class TinyXmlQuery
+{
+public:
+	typedef struct Step
+	{
+		const char* keyword;
+		int index;
+		uint64_t hash;						// Of the keyword, ignoring case, and the index
+	} Step_t;
+
+	static const int kIndexDepth = 4;		// Innermost steps the index goes by, the rest are checked
+
+	TinyXmlQuery() {}
+	TinyXmlQuery( const keywordPair_t* keywordList);
+	TinyXmlQuery( const char* keyword, int index, ...);	// Keyword, index pairs, outer to inner, then nullptr
+	void Append( const char* keyword, int index);		// Goes inside the steps so far
+	inline bool Empty() const
+	{
+		return iSteps.empty();
+	}
+	inline const std::vector<Step_t>& Steps() const
+	{
+		return iSteps;
+	}
+	uint64_t IndexKey() const;
+
+	static uint64_t StepHash( const char* keyword, int index);
+	static uint64_t Outward( uint64_t path, uint64_t step);	// Adds the next step out to a path's hash
+private:
+	std::vector<Step_t> iSteps;
+};
+
 class TinyXml
 {// Works on a buffer of XML, which it will destory in the process of parsing and dispatching
 public:
@@ -29,16 +90,124 @@ public:
 	char* InitializeFromJSON( char* pos, const char* parentKeyword = nullptr);
 	bool InquireByKeyword( const keywordPair_t* keywordList, char** returnedParameters, char** returnedValue);	// Returns content for a specific nested list of keywords
 	bool InquireByKeyword( char** returnedParameters, char** returnedValue, ...);	// Returns content for a specific nested list of keywords. index pairs
+	bool InquireByKeyword( const TinyXmlQuery &query, char** returnedParameters, char** returnedValue);
+	void BuildIndex();					// Optional, makes the inquiries constant time until the next Initialize
 	bool IterateOverCcontent( void* context, ContentHandler_t handler, const keywordPair_t* parent = nullptr);
 	void SetPreserveCase( bool preserve);
+	inline size_t NodeCount() const
+	{
+		return iNodes.size();
+	}
 private:
-	const char* iMyKeyword = nullptr;			// This is our keyword
-	char* iMyParameters = nullptr;		// This all the stuff between the keyword and the '>', which is enitrely the client's problem
-	char* iMyContent = nullptr;			// This is our content, may or may not be more XML tags
-	int iMyIndex = 0;					// This is our index for this keyword within our parent
-	bool iSelfTerminated=false;			// True if this came from a <keyword /> construct
-	std::vector<TinyXml*> iXmlContent;	// If content is just more XML tags
+	std::vector<TinyXmlNode_t> iNodes;	// Our own element is the first one
+	struct CaseBlindHash
+	{
+		size_t operator()( const char* keyword) const;
+	};
+	struct CaseBlindEqual
+	{
+		bool operator()( const char* a, const char* b) const;
+	};
+	typedef struct KeywordCount
+	{// While parsing, how many children of owner have had this keyword so far
+		int owner = -1;
+		int count = 0;
+	} KeywordCount_t;
+	typedef struct SavedCount
+	{
+		int keyword;
+		KeywordCount_t count;
+	} SavedCount_t;
+	std::unordered_map<const char*, int, CaseBlindHash, CaseBlindEqual> iKeywordIds;	// Each keyword once, ignoring case
+	std::vector<KeywordCount_t> iKeywordCounts;	// By keyword id
+	std::vector<SavedCount_t> iSavedCounts;		// Outer elements' counts, put back as each element closes
+	typedef struct PathEntry
+	{
+		int node;
+		int next;						// Next entry with the same path, in document order, -1 at the end
+	} PathEntry_t;
+	std::unordered_map<uint64_t, int> iPathHeads;	// From BuildIndex, the first entry for each hashed path
+	std::vector<PathEntry_t> iPathEntries;
+	bool iIndexed = false;
+	bool Initialized() const
+	{
+		return !iNodes.empty() && iNodes[ 0].keyword != nullptr;
+	}
+	void Clear();
+	int NewNode();
+	void LinkChild( int parent, int child);
+	int NextIndex( int parent, const char* keyword);
+	void ForgetCounts( size_t saved);
+	bool Matches( int node, const TinyXmlQuery &query) const;
+	char* ParseElement( int node, char* pos, const char* parentKeyword);
+	void AddJson( int node, const JsonValue &value, char* text, std::vector<char*> &ends);
+	bool IterateOverNode( int node, void* context, ContentHandler_t handler, const keywordPair_t* parent);
 };
+/*
+		The same parse, pushed a chunk at a time from a file or a pipe, calling the handler as it
+		goes, the way IterateOverCcontent would.  Only the elements still open are held, so a
+		document of any size takes the memory of its deepest path.  An element is only known to
+		be a leaf when it closes, so its start is called when its first child arrives.  The
+		strings handed to the handler are only good until it returns.  Unlike Initialize, an
+		element missing its closer is closed by its parent's, rather than dropped.
+*/
+class TinyXmlStream
+{
+public:
+	TinyXmlStream( void* context, ContentHandler_t handler);
+	bool Feed( const char* data, size_t length);	// False once the handler has said to stop
+	bool Finish();									// At the end of the input, closes whatever is still open
+	inline size_t Deepest() const
+	{// Most elements open at once so far
+		return iLevels.size();
+	}
+private:
+	enum State
+	{
+		kText = 0,
+		kMarkup,							// Just after '<', waiting to see if it's a comment
+		kTag,
+		kComment,
+		kCData,
+		kBang								// Some other <!, skipped to the next '<'
+	};
+	typedef struct Level
+	{
+		keywordPair_t key;
+		std::string keyword;
+		std::string parameters;
+		std::string content;
+		bool started = false;				// Start called, it has children
+		bool hasContent = false;			// Its text is all in
+		bool selfTerminated = false;		// Its content is the text after it
+		std::unordered_map<std::string, int> counts;	// Children so far, by keyword, for their indexes
+	} Level_t;
+
+	void* iContext;
+	ContentHandler_t iHandler;
+	std::vector<Level_t> iLevels;			// Reused, only the first iDepth are open
+	size_t iDepth = 0;
+	State iState = kText;
+	bool iQuoted = false;					// Inside a quoted string, which can hold delimiters
+	bool iEscaped = false;					// Backslash in a quoted string, a quote next doesn't end it
+	int iRun = 0;							// Dashes or brackets in a row, for the end of a comment or CDATA
+	bool iStopped = false;
+	bool iDone = false;						// The top element is closed
+	std::string iTag;						// The tag so far, between '<' and '>'
+	std::string iUpper;						// Scratch, for keyword counts
+
+	const char* ScanUntil( const char* pos, const char* end, char stop, std::string* into);
+	std::string* Capturing();
+	void EndText();
+	void Tag();
+	void Open( char* pos);
+	void Closer( char* pos);
+	void Close();
+	void Call( Level_t &level, char* parameters, char* content);
+};
+
+bool StreamXmlFile( FILE* f, void* context, ContentHandler_t handler);	// Reads to the end a chunk at a time, false if the handler stopped it
+
 char* ResolveQuotedSpecials( char* pos);
 char* Sanitize( char* pos);
 /*
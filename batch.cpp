@@ -0,0 +1,296 @@
+//
+//  batch.cpp
+//  quilter
+//
+//	A manifest lists render jobs, in XML or JSON.  Any element with a "generator" child is a
+//	job, so both of these work:
+//
+//		{"jobs": [{"name": "a", "generator": "grid", "params": "10 10 1", "scale": 1.5,
+//				"output": "out/a", "formats": "iqp,svg"}, ...]}
+//
+//		<batch><job><generator>grid</generator><params>10 10 1</params>...</job>...</batch>
+//
+//	Recognized fields are name, generator, params (split like a command line), scale,
+//	rotation, offsetx, offsety, clipwidth, clipheight, output (file name without type),
+//	formats (comma separated, default iqp), and cache (0 to skip the stitch cache).
+//
+//	Jobs are independent and coarse, so they are spread over a compute pool of their own, one
+//	job per task, and the stages inside each job fork onto the same pool, so a long job late
+//	in the manifest still gets every core once the short ones are gone.  Each job has its own
+//	render session, since a thread waiting inside one job can pick up another, and every job
+//	runs inside its own try, so one bad job is reported without disturbing the others.
+//
+
+#include "batch.hpp"
+#include "quilt.hpp"
+#include "quilter.h"
+#include "TinyXML.hpp"
+#include "computepool.hpp"
+#include "loadedfile.hpp"
+#include "json.hpp"
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+
+typedef struct BatchJob
+{
+	std::string name;
+	std::string generator;
+	std::string params;
+	std::string output;
+	std::string formats = "iqp";
+	StitchTransform_t transform;
+	StitchClip_t clip;
+	bool useCache = true;
+
+	// Results
+	bool succeeded = false;
+	std::string error;
+	size_t points = 0;
+	int outputs = 0;
+	double seconds = 0;
+} BatchJob_t;
+
+typedef struct ManifestContext
+{// Used while walking the manifest
+	std::vector<BatchJob_t> *jobs;
+	std::vector<BatchJob_t> open;		// One per element we are inside of, completed at its end
+} ManifestContext_t;
+
+static bool ManifestHandler( void* context, const keywordPair_t* keywordList, char* parameters, char* contentValue)
+{
+	ManifestContext_t* mc = (ManifestContext_t*) context;
+	if( parameters == nullptr)
+	{// End of an element, it was a job if it named a generator
+		if( !mc->open.back().generator.empty())
+			mc->jobs->push_back( mc->open.back());
+		mc->open.pop_back();
+		return true;
+	}
+	if( contentValue == nullptr)
+	{// Start of an element that contains others
+		mc->open.emplace_back();
+		return true;
+	}
+	if( mc->open.empty())
+		return true;	// A lone value at the top, not inside any job
+	BatchJob_t &job = mc->open.back();
+	const char* key = keywordList->keyword;
+	const char* value = Sanitize( contentValue);
+	if( strcasecmp( key, "name") == 0) job.name = value;
+	else if( strcasecmp( key, "generator") == 0) job.generator = value;
+	else if( strcasecmp( key, "params") == 0) job.params = value;
+	else if( strcasecmp( key, "output") == 0) job.output = value;
+	else if( strcasecmp( key, "formats") == 0) job.formats = value;
+	else if( strcasecmp( key, "scale") == 0) job.transform.scale = xatof( value);
+	else if( strcasecmp( key, "rotation") == 0) job.transform.rotation = xatof( value);
+	else if( strcasecmp( key, "offsetx") == 0) job.transform.offsetX = xatof( value);
+	else if( strcasecmp( key, "offsety") == 0) job.transform.offsetY = xatof( value);
+	else if( strcasecmp( key, "clipwidth") == 0) job.clip.width = xatof( value);
+	else if( strcasecmp( key, "clipheight") == 0) job.clip.height = xatof( value);
+	else if( strcasecmp( key, "cache") == 0) job.useCache = xatoi( value) != 0;
+	return true;
+}
+
+static void RunBatchJob( BatchJob_t &job, RenderSession &session)
+{// Throws on any failure, the caller records it
+	if( job.output.empty())
+		sraise( "Batch jobs need an output name", nullptr);
+	std::string params = job.params;
+	std::vector<char*> argv( params.length() / 2 + 2);
+	int argc = 0;
+	SplitCommandLine( &params[ 0], &argc, argv.data(), argv.size());
+
+	RenderRequest_t request;
+	request.generator = job.generator.c_str();
+	request.argc = argc;
+	request.argv = argv.data();
+	request.transform = job.transform;
+	request.clip = job.clip;
+	request.outputName = job.output.c_str();
+	request.useCache = job.useCache;
+
+	std::string formats = job.formats;
+	char* save = nullptr;
+	for( char* format = strtok_r( &formats[ 0], ", ", &save); format; format = strtok_r( nullptr, ", ", &save))
+	{// Every output reuses the geometry from the first
+		request.format = format;
+		RenderReport_t report;
+		RunRender( request, session, report);
+		job.points = report.points;
+		++job.outputs;
+	}
+	if( job.outputs == 0)
+		sraise( "Batch job has no output formats", nullptr);
+}
+
+int BatchCmd( CommandProc* cur)
+{
+	int threadCount = 0;
+	const char* reportName = nullptr;
+	const char* strOpts = "r";
+	const char** strValues[] = { &reportName};
+	const char* intOpts = "t";
+	int* intValues[] = { &threadCount};
+	static const char* helps[] =
+	{
+		"Write a report of every job to this file, JSON if it ends in .json, otherwise XML.",
+		"Worker threads, 0 for one per core.",
+		"Manifest file, JSON or XML, of render jobs to run in parallel."
+	};
+
+	int paramIndex = GetAllOpts(
+		cur->iArgc, cur->iArgv,
+		nullptr, nullptr,
+		strOpts, strValues,
+		nullptr, nullptr,
+		intOpts, intValues,
+		nullptr, nullptr,
+		"S", helps);
+
+	const char* manifestName = cur->iArgv[ paramIndex];
+	std::vector<BatchJob_t> jobs;
+	{// XML streams straight out of the mapping, JSON is parsed in place, in a private copy of it
+		LoadedFile manifest( manifestName);
+		ManifestContext_t context = { &jobs, {}};
+		const char* start = manifest.Data();
+		while( *start > 0 && *start <= ' ')
+			++start;
+		if( *start == '<')
+		{
+			TinyXmlStream stream( &context, ManifestHandler);
+			stream.Feed( start, manifest.Size() - (start - manifest.Data()));
+			stream.Finish();
+		}
+		else
+		{
+			manifest.Load( manifestName, LoadedFile::kWritable);
+			TinyXml tree;
+			tree.InitializeFromJSON( manifest.Data());
+			tree.IterateOverCcontent( &context, ManifestHandler);
+		}
+	}
+	if( jobs.empty())
+		sraise( "Manifest has no jobs, each job needs a generator", "str file", manifestName, nullptr);
+
+	if( threadCount <= 0)
+		threadCount = (int) std::thread::hardware_concurrency();
+	GetDefaultValue( StitchCacheMegabytes);		// Defaults are filled in lazily, do it before there are threads
+
+	auto start = std::chrono::steady_clock::now();
+	ComputePool pool( threadCount);
+	pool.Enter( [&]()
+	{// Jobs, and the stages inside them, all share this pool
+		pool.ParallelFor( 0, jobs.size(), 1, [&]( size_t first, size_t last)
+		{
+			for( size_t j = first; j < last; ++j)
+			{
+				BatchJob_t &job = jobs[ j];
+				auto jobStart = std::chrono::steady_clock::now();
+				RenderSession session;
+				try
+				{
+					RunBatchJob( job, session);
+					job.succeeded = true;
+				}
+				catch( std::exception& err)
+				{
+					job.error = err.what();
+				}
+				catch( ...)
+				{
+					job.error = "Don't know why it failed";
+				}
+				job.seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - jobStart).count();
+			}
+		});
+	});
+	double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count();
+
+	int failures = 0;
+	size_t points = 0;
+	int outputs = 0;
+	double busy = 0;
+	for( size_t j = 0; j < jobs.size(); ++j)
+	{// Report failures as they appear in the manifest
+		const BatchJob_t &job = jobs[ j];
+		busy += job.seconds;
+		if( job.succeeded)
+		{
+			points += job.points;
+			outputs += job.outputs;
+			continue;
+		}
+		++failures;
+		printf( "Job %zu %s failed: %s\n", j+1, job.name.c_str(), job.error.c_str());
+	}
+	printf( "%zu jobs, %zu succeeded, %d failed, %d outputs, %zu points\n",
+		jobs.size(), jobs.size() - failures, failures, outputs, points);
+	printf( "%.2f seconds on %d threads, %.2f seconds of work, %.1f jobs per second\n",
+		elapsed, threadCount, busy, jobs.size() / elapsed);
+
+	size_t nameLength = reportName ? strlen( reportName) : 0;
+	if( nameLength > 5 && strcasecmp( reportName + nameLength - 5, ".json") == 0)
+	{// Everything about every job, written as it goes
+		FILE* reportFile = fopen( reportName, "w");
+		if( reportFile == nullptr) TestMsg( -1, reportName);
+		try
+		{
+			JsonWriter report( reportFile, 2);
+			report.BeginObject();
+			report.Key( "manifest").String( manifestName);
+			report.Key( "seconds").Number( elapsed, 3);
+			report.Key( "threads").Int( threadCount);
+			report.Key( "jobs").BeginArray();
+			for( size_t j = 0; j < jobs.size(); ++j)
+			{
+				const BatchJob_t &job = jobs[ j];
+				report.BeginObject();
+				report.Key( "index").Unsigned( j+1);
+				report.Key( "name").String( job.name.data(), job.name.length());
+				report.Key( "status").String( job.succeeded ? "ok" : "failed");
+				if( !job.succeeded)
+					report.Key( "error").String( job.error.data(), job.error.length());
+				report.Key( "points").Unsigned( job.points);
+				report.Key( "outputs").Int( job.outputs);
+				report.Key( "seconds").Number( job.seconds, 3);
+				report.EndObject();
+			}
+			report.EndArray().EndObject();
+			report.Flush();
+		}
+		catch( ...)
+		{
+			fclose( reportFile);
+			throw;
+		}
+		fclose( reportFile);
+	}
+	else if( reportName)
+	{// Everything about every job
+		XmlScope report( "batch");
+		report.WriteATag( "manifest", manifestName);
+		report.PrintfATag( "seconds", "%.3f", elapsed);
+		report.PrintfATag( "threads", "%d", threadCount);
+		for( size_t j = 0; j < jobs.size(); ++j)
+		{
+			const BatchJob_t &job = jobs[ j];
+			XmlScope jobTag( report, "job");
+			jobTag.PrintfATag( "index", "%zu", j+1);
+			jobTag.WriteATag( "name", job.name.c_str());
+			jobTag.WriteATag( "status", job.succeeded ? "ok" : "failed");
+			if( !job.succeeded)
+				jobTag.WriteATag( "error", job.error.c_str());
+			jobTag.PrintfATag( "points", "%zu", job.points);
+			jobTag.PrintfATag( "outputs", "%d", job.outputs);
+			jobTag.PrintfATag( "seconds", "%.3f", job.seconds);
+		}
+		report.CloseTag();
+		FILE* reportFile = fopen( reportName, "w");
+		if( reportFile == nullptr) TestMsg( -1, reportName);
+		fwrite( report.s().str().c_str(), 1, report.s().str().length(), reportFile);
+		fclose( reportFile);
+	}
+	return cur->iFromCommandLine ? 2 : 0;
+}
@@ -0,0 +1,15 @@
+//
+//  batch.hpp
+//  quilter
+//
+//  Runs many render jobs from a JSON or XML manifest in parallel.
+//
+
+#ifndef batch_hpp
+#define batch_hpp
+
+#include "ConsoleThings.h"
+
+int BatchCmd( CommandProc* cur);
+
+#endif /* batch_hpp */
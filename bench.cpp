@@ -0,0 +1,593 @@
+//
+//  bench.cpp
+//  quilter
+//
+//	Benchmarks and stress tests, and the old ways of doing things they compare against.
+//
+
+#include "bench.hpp"
+#include <math.h>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include "quilter.h"
+#include "quilt.hpp"
+#include "computepool.hpp"
+#include "loadedfile.hpp"
+#include "TinyXML.hpp"
+#include "json.hpp"
+
+class StressActivity : public AsyncHelper
+{// Does nothing but note how many signals it has seen
+public:
+	std::atomic<uint64_t> iPosted{ 0};		// Bumped before each signal
+	uint64_t iSeen = 0;						// iPosted when Execute last ran
+
+	void Startup() override
+	{
+	}
+	void Execute() override
+	{
+		iSeen = iPosted.load( std::memory_order_acquire);
+	}
+	void Shutdown() override
+	{
+	}
+};
+
+static void StressReadyQueue( int activityCount, int threadCount, int rounds)
+{// Every thread signals every activity, over and over, while this thread runs them
+	ReadyQueue queue;
+	std::vector<StressActivity> stress( activityCount);
+	StressActivity done;		// Signalled once by the last thread to finish
+	for( int a = 0; a < activityCount; ++a)
+		snprintf( stress[ a].iDescription, sizeof( stress[ a].iDescription), "Stress %d", a+1);
+	std::atomic<int> running( threadCount);
+	auto producer = [&]( int t)
+	{
+		for( int r = 0; r < rounds; ++r)
+		{// Each thread starts at a different place so they collide on different activities
+			for( int k = 0; k < activityCount; ++k)
+			{
+				StressActivity &a = stress[ (k + (size_t) t * activityCount / threadCount) % activityCount];
+				a.iPosted.fetch_add( 1, std::memory_order_release);
+				queue.Signal( &a);
+			}
+		}
+		if( --running == 0)
+			queue.Signal( &done);
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for( int t = 0; t < threadCount; ++t)
+		threads.emplace_back( producer, t);
+	uint64_t runs = 0;
+	for(;;)
+	{// Everything signalled before done was queued before it
+		AsyncHelper* ready = queue.Wait();
+		if( ready == &done)
+			break;
+		ready->Execute();
+		++runs;
+	}
+	double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count();
+	for( std::thread &t : threads)
+		t.join();
+
+	int lost = 0;
+	for( StressActivity &a : stress)
+	{// The last signal to each one must have been followed by a run
+		if( a.iSeen != a.iPosted.load())
+			++lost;
+	}
+	uint64_t signals = (uint64_t) activityCount * threadCount * rounds;
+	printf( "%d activities, %d threads, %llu signals, %llu runs, %llu coalesced\n",
+		activityCount, threadCount, (unsigned long long) signals, (unsigned long long) runs, (unsigned long long) (signals - runs));
+	printf( "%.3f seconds, %.1f million signals per second, %d lost wakeups\n",
+		elapsed, signals / elapsed / 1e6, lost);
+	if( lost)
+		xraise( "Ready queue lost wakeups", "int lost", lost, nullptr);
+}
+
+static void StressTimerWheel( int timerCount)
+{// Runs on simulated time, so every timer must go off on exactly the right tick, and cancelled ones never
+	ReadyQueue queue;
+	TimerWheel wheel( queue);
+	StressActivity owner;
+	std::vector<Timer_t> timers( timerCount);
+	std::vector<uint64_t> first( timerCount);
+	uint64_t random = 88172645463325252ULL;
+	auto next = [&]()
+	{// xorshift, the same every time
+		random ^= random << 13;
+		random ^= random >> 7;
+		random ^= random << 17;
+		return random;
+	};
+	const uint64_t horizon = (uint64_t) 1 << 26;		// Past what the top level reaches
+
+	auto start = std::chrono::steady_clock::now();
+	for( int t = 0; t < timerCount; ++t)
+	{// Mostly spread out, some very soon, some periodic
+		timers[ t].iOwner = &owner;
+		first[ t] = next() % (t % 4 == 0 ? 256 : horizon);
+		wheel.ScheduleTicks( timers[ t], first[ t], t % 8 == 0 ? 1000 + next() % 100000 : 0);
+	}
+	double scheduleTime = std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count();
+	int cancelled = 0;
+	for( int t = 1; t < timerCount; t += 5)
+	{
+		wheel.Cancel( timers[ t]);
+		++cancelled;
+	}
+
+	start = std::chrono::steady_clock::now();
+	uint64_t fired = 0;
+	uint64_t now = 0;
+	while( now < horizon)
+	{// Uneven steps, like a main loop that sleeps and gets woken early
+		now = std::min( now + 1 + next() % 5000, horizon);
+		fired += wheel.Advance( now);
+	}
+	double advanceTime = std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count();
+
+	int wrong = 0;
+	for( int t = 0; t < timerCount; ++t)
+	{
+		const Timer_t &timer = timers[ t];
+		int expected = 1;
+		uint64_t last = first[ t];
+		if( t % 5 == 1)
+			expected = 0;
+		else if( timer.iPeriod)
+		{// Every period from the first until the end
+			expected = (int) ((horizon - first[ t]) / timer.iPeriod) + 1;
+			last = first[ t] + (expected - 1) * timer.iPeriod;
+		}
+		if( timer.iFireCount != expected || (expected && timer.iFiredAt != last))
+			++wrong;
+	}
+	printf( "%d timers, %d cancelled, %llu fired over %.1f simulated hours\n",
+		timerCount, cancelled, (unsigned long long) fired, horizon / 3600000.0);
+	printf( "%.0f ns to schedule each, %.3f seconds to run them all, %d wrong\n",
+		scheduleTime * 1e9 / std::max( timerCount, 1), advanceTime, wrong);
+	if( wrong)
+		xraise( "Timer wheel fired timers at the wrong time", "int wrong", wrong, nullptr);
+}
+
+class MutexSemaphore
+{// JeffSemaphore as it was before it had a fast path, only kept to compare against
+	unsigned long iCurrentCount = 0;
+	pthread_mutex_t iMutex;
+	pthread_cond_t iCond;
+public:
+	MutexSemaphore()
+	{
+		pthread_mutex_init( &iMutex, nullptr);
+		pthread_cond_init( &iCond, nullptr);
+	}
+	~MutexSemaphore()
+	{
+		pthread_cond_destroy( &iCond);
+		pthread_mutex_destroy( &iMutex);
+	}
+	bool Decrement()
+	{
+		pthread_mutex_lock( &iMutex);
+		while( iCurrentCount == 0)
+			pthread_cond_wait( &iCond, &iMutex);
+		iCurrentCount--;
+		pthread_mutex_unlock( &iMutex);
+		return true;
+	}
+	bool Increment( unsigned long count = 1)
+	{
+		pthread_mutex_lock( &iMutex);
+		iCurrentCount += count;
+		if( iCurrentCount == 1)
+			pthread_cond_signal( &iCond);
+		else
+			pthread_cond_broadcast( &iCond);
+		pthread_mutex_unlock( &iMutex);
+		return true;
+	}
+};
+
+template <class Semaphore> static void BenchmarkSemaphore( const char* name, int threadCount, int rounds)
+{// Same three workloads for each kind of semaphore, in millions of operations per second
+	double results[ 3];
+	{// Uncontended, one thread posting and taking
+		Semaphore sema;
+		auto start = std::chrono::steady_clock::now();
+		for( int r = 0; r < rounds; ++r)
+		{
+			sema.Increment();
+			sema.Decrement();
+		}
+		results[ 0] = 2.0 * rounds / std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count() / 1e6;
+	}
+	{// Contended, half the threads posting and half taking, all on one semaphore
+		Semaphore sema;
+		int pairs = std::max( threadCount / 2, 1);
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		for( int p = 0; p < pairs; ++p)
+		{
+			threads.emplace_back( [&]() { for( int r = 0; r < rounds; ++r) sema.Increment(); });
+			threads.emplace_back( [&]() { for( int r = 0; r < rounds; ++r) sema.Decrement(); });
+		}
+		for( std::thread &t : threads)
+			t.join();
+		results[ 1] = 2.0 * rounds * pairs / std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count() / 1e6;
+	}
+	{// Ping pong, every operation has to wake the other thread
+		Semaphore ping, pong;
+		int handoffs = std::max( rounds / 100, 1);
+		auto start = std::chrono::steady_clock::now();
+		std::thread other( [&]()
+		{
+			for( int r = 0; r < handoffs; ++r)
+			{
+				ping.Decrement();
+				pong.Increment();
+			}
+		});
+		for( int r = 0; r < handoffs; ++r)
+		{
+			ping.Increment();
+			pong.Decrement();
+		}
+		other.join();
+		results[ 2] = 2.0 * handoffs / std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count() / 1e6;
+	}
+	printf( "%-16s %12.2f %12.2f %12.3f\n", name, results[ 0], results[ 1], results[ 2]);
+}
+
+static void BenchmarkSemaphores( int threadCount)
+{// Millions of increments and decrements per second
+	printf( "%-16s %12s %12s %12s\n", "", "Uncontended", "Contended", "Ping pong");
+	BenchmarkSemaphore<MutexSemaphore>( "Mutex and cond", threadCount, 1000000);
+	BenchmarkSemaphore<JeffSemaphore>( "JeffSemaphore", threadCount, 1000000);
+}
+
+static long long ForkJoinFibonacci( ComputePool &pool, int n)
+{// Nothing but forks and joins, to see what a task costs
+	if( n < 2)
+		return n;
+	long long a = 0, b = 0;
+	pool.Invoke( [&]() { a = ForkJoinFibonacci( pool, n-1); }, [&]() { b = ForkJoinFibonacci( pool, n-2); });
+	return a + b;
+}
+
+static void BenchmarkComputePool( int maxThreads)
+{// The render stages and fork/join overhead on pools of 1 through maxThreads, checked against 1
+	StitchPath path( 4000000);
+	uint32_t seed = 2463534242u;
+	float x = 0, y = 0;
+	for( StitchPoint_t &p : path)
+	{// Random walk, jumping now and then
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		x = fminf( fmaxf( x + (float) ((int) (seed & 255) - 128) / 256.0f, -50), 50);
+		y = fminf( fmaxf( y + (float) ((int) ((seed >> 8) & 255) - 128) / 256.0f, -50), 50);
+		p = { x, y, (seed >> 16) % 500 == 0};
+	}
+	path[ 0].jump = 1;
+	StitchTransform_t transform;
+	transform.scale = 1.1;
+	transform.rotation = 30;
+	StitchClip_t clip;
+	clip.width = 60;
+	clip.height = 40;
+
+	StitchPath referenceClip;
+	std::vector<float> referenceDensity;
+	double baseline[ 4] = {};
+	printf( "%zu points, seconds and speedup over one thread\n", path.size());
+	printf( "%7s %16s %16s %16s %16s\n", "Threads", "Fork/join", "Transform", "Clip", "Density");
+	for( int threads = 1; threads <= maxThreads; ++threads)
+	{
+		ComputePool pool( threads);
+		StitchPath transformed, clipped;
+		DensityGrid_t grid;
+		double seconds[ 4];
+		pool.Enter( [&]()
+		{
+			auto start = std::chrono::steady_clock::now();
+			long long fibonacci = ForkJoinFibonacci( pool, 27);
+			auto end = std::chrono::steady_clock::now();
+			seconds[ 0] = std::chrono::duration<double>( end - start).count();
+			if( fibonacci != 196418)
+				xraise( "Fork/join lost work", "int threads", threads, nullptr);
+
+			start = end;
+			TransformStitches( path, transform, transformed);
+			end = std::chrono::steady_clock::now();
+			seconds[ 1] = std::chrono::duration<double>( end - start).count();
+
+			start = end;
+			ClipStitches( transformed, clip, clipped);
+			end = std::chrono::steady_clock::now();
+			seconds[ 2] = std::chrono::duration<double>( end - start).count();
+
+			start = end;
+			ComputeStitchDensity( transformed, 0.25, grid);
+			end = std::chrono::steady_clock::now();
+			seconds[ 3] = std::chrono::duration<double>( end - start).count();
+		});
+		if( threads == 1)
+		{
+			referenceClip = clipped;
+			referenceDensity = grid.inches;
+			for( int b = 0; b < 4; ++b)
+				baseline[ b] = seconds[ b];
+		}
+		else
+		{// Same answers as doing it all on one thread
+			if( clipped.size() != referenceClip.size() ||
+				memcmp( clipped.data(), referenceClip.data(), clipped.size() * sizeof( StitchPoint_t)) != 0)
+				xraise( "Parallel clip differs from serial", "int threads", threads, nullptr);
+			if( grid.inches.size() != referenceDensity.size())
+				xraise( "Parallel density grid differs from serial", "int threads", threads, nullptr);
+			for( size_t c = 0; c < referenceDensity.size(); ++c)
+			{// Sums come out in a different order
+				if( fabsf( grid.inches[ c] - referenceDensity[ c]) > 1e-3f * fmaxf( 1.0f, referenceDensity[ c]))
+					xraise( "Parallel density differs from serial", "int threads", threads, nullptr);
+			}
+		}
+		printf( "%7d", threads);
+		for( int b = 0; b < 4; ++b)
+			printf( "   %7.3f %5.2fx", seconds[ b], baseline[ b] / seconds[ b]);
+		printf( "\n");
+	}
+}
+
+/*
+		How ReadFile used to do it, a page at a time, kept to compare against
+*/
+static size_t ReadFileByPages( FILE *fp, char **buf)
+{
+	static const size_t readBufSize = 4096;
+
+	size_t readBufAllocation = 0;
+	char* b = nullptr;
+	size_t readLen = 0;
+	size_t readSoFar = 0;
+	while( readBufAllocation == readSoFar)
+	{
+		readBufAllocation += readBufSize;
+		b = (char*) realloc( b, readBufAllocation + 1);
+		readLen = fread( &b[ readSoFar], 1, readBufSize, fp);
+		readSoFar += readLen;
+	}
+	b[ readSoFar] = 0;
+	*buf = b;
+	return readSoFar;
+}
+
+static void BenchmarkLoadFile( const char* filename)
+{// Each way of getting a whole file into memory, reading every page the way a parser would
+	static const char* names[] =
+	{
+		"4K realloc",
+		"Doubling",
+		"Mapped",
+		"Mapped, written"
+	};
+	for( int way = 0; way < 4; ++way)
+	{
+		auto start = std::chrono::steady_clock::now();
+		size_t size = 0;
+		unsigned sum = 0;
+		LoadedFile loaded;
+		char* data = nullptr;
+		if( way < 2)
+		{// Buffered
+			FILE* f = fopen( filename, "rb");
+			if( f == nullptr) TestMsg( -1, filename);
+			size = way == 0 ? ReadFileByPages( f, &data) : ReadFile( f, &data);
+			fclose( f);
+		}
+		else
+		{
+			loaded.Load( filename, way == 3 ? LoadedFile::kWritable : LoadedFile::kReadOnly);
+			data = loaded.Data();
+			size = loaded.Size();
+		}
+		for( size_t b = 0; b < size; b += 4096)
+		{// Touch every page, and dirty them when the parser would
+			sum += (unsigned char) data[ b];
+			if( way == 3)
+				data[ b] = ' ';
+		}
+		double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count();
+		printf( "%-16s %10.1f ms %10.1f MB/s%s (%u)\n", names[ way], seconds * 1000.0, size / seconds / 1e6,
+			way >= 2 && !loaded.Mapped() ? ", not mapped" : "", sum & 0xFF);
+		if( way < 2)
+			free( data);
+	}
+}
+
+static bool CountContent( void* context, const keywordPair_t* /*keywordList*/, char* /*parameters*/, char* /*contentValue*/)
+{
+	++*(size_t*) context;
+	return true;
+}
+
+static void BenchmarkXml( const char* filename)
+{// The whole document as a tree, then the same streamed, from memory and from the file
+	LoadedFile original( filename);
+	double seconds[ 3] = {};
+	size_t callbacks[ 3] = {};
+	size_t nodes = 0;
+	size_t deepest = 0;
+	for( int way = 0; way < 3; ++way)
+	{
+		auto start = std::chrono::steady_clock::now();
+		if( way == 0)
+		{// Initialize wants its own copy to edit
+			LoadedFile copy( filename, LoadedFile::kWritable);
+			TinyXml tree;
+			tree.Initialize( copy.Data());
+			tree.IterateOverCcontent( &callbacks[ way], CountContent);
+			nodes = tree.NodeCount();
+		}
+		else if( way == 1)
+		{
+			TinyXmlStream stream( &callbacks[ way], CountContent);
+			stream.Feed( original.Data(), original.Size());
+			stream.Finish();
+			deepest = stream.Deepest();
+		}
+		else
+		{
+			FILE* f = fopen( filename, "rb");
+			if( f == nullptr) TestMsg( -1, filename);
+			StreamXmlFile( f, &callbacks[ way], CountContent);
+			fclose( f);
+		}
+		seconds[ way] = std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count();
+	}
+	static const char* names[] = { "Tree", "Stream", "Stream file"};
+	for( int way = 0; way < 3; ++way)
+		printf( "%-12s %10.1f ms %8.1f MB/s %10zu callbacks\n", names[ way], seconds[ way] * 1000.0,
+			original.Size() / seconds[ way] / 1e6, callbacks[ way]);
+	printf( "Tree held %zu elements, the stream at most %zu\n", nodes, deepest);
+}
+
+static size_t ReadAllJson( const JsonValue &value)
+{// Reads every value as its type, returns how many
+	switch( value.Type())
+	{
+	case kJsonArray:
+	case kJsonObject:
+		{
+			size_t count = 1;
+			for( JsonValue item = value.First(); item.Valid(); item = item.Next())
+				count += ReadAllJson( item);
+			return count;
+		}
+	case kJsonString:
+		value.String();
+		break;
+	case kJsonNumber:
+		value.Double();
+		break;
+	case kJsonBool:
+		value.Bool();
+		break;
+	default:
+		break;
+	}
+	return 1;
+}
+
+static void BenchmarkJson( const char* filename)
+{// Just finding the tokens, then reading every value, then the tree the json command writes out
+	LoadedFile original( filename);
+	double seconds[ 3] = {};
+	size_t values[ 3] = {};
+	for( int way = 0; way < 3; ++way)
+	{
+		auto start = std::chrono::steady_clock::now();
+		if( way < 2)
+		{
+			JsonDocument document;
+			document.Parse( original.Data(), original.Size());
+			values[ way] = way == 0 ? document.TokenCount() : ReadAllJson( document.Root());
+		}
+		else
+		{// InitializeFromJSON wants its own copy to edit
+			LoadedFile copy( filename, LoadedFile::kWritable);
+			TinyXml tree;
+			tree.InitializeFromJSON( copy.Data());
+			values[ way] = tree.NodeCount();
+		}
+		seconds[ way] = std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count();
+	}
+	static const char* names[] = { "Index", "Read all", "Tree"};
+	static const char* counted[] = { "tokens", "values", "elements"};
+	for( int way = 0; way < 3; ++way)
+		printf( "%-12s %10.1f ms %8.1f MB/s %10zu %s\n", names[ way], seconds[ way] * 1000.0,
+			original.Size() / seconds[ way] / 1e6, values[ way], counted[ way]);
+}
+
+static void BenchmarkSiblings( int siblings)
+{// One flat element with up to this many children, at three sizes, time per child should stay flat
+	printf( "%-12s %10s %12s %12s\n", "Siblings", "Parse", "Per sibling", "Last index");
+	const int sizes[] = { siblings / 100, siblings / 10, siblings};
+	for( int size : sizes)
+	{
+		if( size < 4)
+			continue;
+		std::string document = "<svg>\n";
+		for( int s = 0; s < size; ++s)
+			document += s % 4 == 3 ? "<g id=\"x\"/>\n" : "<path d=\"M0 0L1 1\"/>\n";
+		document += "</svg>\n";
+		std::vector<char> copy( document.begin(), document.end());	// Initialize edits it
+		copy.push_back( 0);
+		auto start = std::chrono::steady_clock::now();
+		TinyXml tree;
+		tree.Initialize( copy.data());
+		double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count();
+		int paths = size - size / 4;
+		char* parameters = nullptr;
+		bool found = tree.InquireByKeyword( &parameters, nullptr, "svg", 0, "path", paths - 1, nullptr);
+		printf( "%-12d %10.1f ms %9.1f ns %12s\n", size, seconds * 1000.0, seconds / size * 1e9,
+			found ? "right" : "wrong");
+	}
+}
+
+
+int BenchCmd( CommandProc* cur)
+{
+	int threadCount = 8;
+	int rounds = 100;
+	const char* intOpts = "nt";
+	int* intValues[] = { &rounds, &threadCount};
+	static const char* helps[] =
+	{
+		"Times each thread signals each activity in the queue test.",
+		"Threads signalling at once in the queue test.",
+		"What to run, queue, timers, semaphore, pool, load, xml, siblings, or json.",
+		"How many activities, timers, threads, or siblings, or the file to load or parse."
+	};
+
+	int paramIndex = GetAllOpts(
+		cur->iArgc, cur->iArgv,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		intOpts, intValues,
+		nullptr, nullptr,
+		"SS", helps);
+
+	const char* what = cur->iArgv[ paramIndex];
+	const char* param = cur->iArgv[ paramIndex + 1];
+	if( strcasecmp( what, "queue") == 0)
+	{// Stress test, like 1000 activities
+		if( threadCount < 1 || rounds < 1)
+			sraise( "Queue test needs at least one thread and one round", nullptr);
+		StressReadyQueue( xatoi( param), threadCount, rounds);
+	}
+	else if( strcasecmp( what, "timers") == 0)
+		StressTimerWheel( xatoi( param));		// Like 100000
+	else if( strcasecmp( what, "semaphore") == 0)
+		BenchmarkSemaphores( xatoi( param));
+	else if( strcasecmp( what, "pool") == 0)
+		BenchmarkComputePool( xatoi( param));
+	else if( strcasecmp( what, "load") == 0)
+		BenchmarkLoadFile( param);
+	else if( strcasecmp( what, "xml") == 0)
+		BenchmarkXml( param);
+	else if( strcasecmp( what, "siblings") == 0)
+		BenchmarkSiblings( xatoi( param));		// Like 1000000
+	else if( strcasecmp( what, "json") == 0)
+		BenchmarkJson( param);
+	else
+		sraise( "Benchmark must be queue, timers, semaphore, pool, load, xml, siblings, or json", "str what", what, nullptr);
+	return cur->iFromCommandLine ? 2 : 0;
+}
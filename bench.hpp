@@ -0,0 +1,15 @@
+//
+//  bench.hpp
+//  quilter
+//
+//  Benchmarks and stress tests.
+//
+
+#ifndef bench_hpp
+#define bench_hpp
+
+#include "ConsoleThings.h"
+
+int BenchCmd( CommandProc* cur);
+
+#endif /* bench_hpp */
@@ -0,0 +1,257 @@
+//
+//  bytescan.hpp
+//  quilter
+//
+//  Finding the next interesting byte 16 at a time, for the readers and parsers.
+//
+
+#ifndef bytescan_hpp
+#define bytescan_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+#if defined( __SSE2__) || defined( _M_X64) || defined( _M_AMD64)
+#include <emmintrin.h>
+#define BYTESCAN_SSE2 1
+#elif defined( __ARM_NEON) || defined( _M_ARM64)
+#include <arm_neon.h>
+#define BYTESCAN_NEON 1
+#endif
+#if defined( _MSC_VER)
+#include <intrin.h>
+#endif
+
+/*
+		Each kernel compares 16 bytes at once, SSE2 on Intel, NEON on Apple silicon, and
+		finishes the last few bytes one at a time, so it never reads past end.  Everything
+		else gets the plain loop.
+*/
+#if defined( __clang__) || defined( __GNUC__)
+#define BYTESCAN_NO_ASAN __attribute__(( no_sanitize_address))
+#else
+#define BYTESCAN_NO_ASAN
+#endif
+inline unsigned FirstSetBit( uint64_t bits)
+{// Bits must not be zero
+#if defined( _MSC_VER)
+	unsigned long index;
+	_BitScanForward64( &index, bits);
+	return (unsigned) index;
+#else
+	return (unsigned) __builtin_ctzll( bits);
+#endif
+}
+
+inline unsigned CountSetBits( uint64_t bits)
+{
+#if defined( _MSC_VER)
+	return (unsigned) __popcnt64( bits);
+#else
+	return (unsigned) __builtin_popcountll( bits);
+#endif
+}
+
+inline const char* FindEither( const char* pos, const char* end, char a, char b)
+{// First a or b from pos, or end if there isn't one
+#if BYTESCAN_SSE2
+	const __m128i wantA = _mm_set1_epi8( a);
+	const __m128i wantB = _mm_set1_epi8( b);
+	for( ; end - pos >= 16; pos += 16)
+	{
+		__m128i bytes = _mm_loadu_si128( (const __m128i*) pos);
+		int hits = _mm_movemask_epi8( _mm_or_si128( _mm_cmpeq_epi8( bytes, wantA), _mm_cmpeq_epi8( bytes, wantB)));
+		if( hits != 0)
+			return pos + FirstSetBit( (unsigned) hits);
+	}
+#elif BYTESCAN_NEON
+	const uint8x16_t wantA = vdupq_n_u8( (uint8_t) a);
+	const uint8x16_t wantB = vdupq_n_u8( (uint8_t) b);
+	for( ; end - pos >= 16; pos += 16)
+	{
+		uint8x16_t bytes = vld1q_u8( (const uint8_t*) pos);
+		uint8x16_t hits = vorrq_u8( vceqq_u8( bytes, wantA), vceqq_u8( bytes, wantB));
+		uint64_t nibbles = vget_lane_u64( vreinterpret_u64_u8( vshrn_n_u16( vreinterpretq_u16_u8( hits), 4)), 0);
+		if( nibbles != 0)
+			return pos + FirstSetBit( nibbles) / 4;	// Four bits for each byte
+	}
+#endif
+	for( ; pos < end; ++pos)
+	{
+		if( *pos == a || *pos == b)
+			break;
+	}
+	return pos;
+}
+
+inline const char* FindLineEnd( const char* pos, const char* end)
+{// First CR or LF, or end
+	return FindEither( pos, end, '\r', '\n');
+}
+
+/*
+		The string kernels are for nul terminated text where the end isn't known, like the
+		TinyXml tokenizer's.  They read whole aligned blocks, which can start before pos and
+		run past the nul, but never into the next page, so they can't fault.  The bytes
+		before pos are shifted out of the result, and nothing past the nul is ever returned.
+*/
+#if BYTESCAN_SSE2
+typedef __m128i ByteBlock;
+static const unsigned kBitsPerByte = 1;
+
+BYTESCAN_NO_ASAN inline ByteBlock LoadBlock( const char* aligned)
+{
+	return _mm_load_si128( (const __m128i*) aligned);
+}
+inline ByteBlock BlockEquals( ByteBlock bytes, char c)
+{
+	return _mm_cmpeq_epi8( bytes, _mm_set1_epi8( c));
+}
+inline ByteBlock BlockOr( ByteBlock x, ByteBlock y)
+{
+	return _mm_or_si128( x, y);
+}
+inline ByteBlock BlockAboveSpace( ByteBlock bytes)
+{// Same as *pos > ' ', which depends on whether char is signed
+#if CHAR_MIN < 0
+	return _mm_cmpgt_epi8( bytes, _mm_set1_epi8( ' '));
+#else
+	const __m128i pastSpace = _mm_set1_epi8( ' ' + 1);
+	return _mm_cmpeq_epi8( _mm_max_epu8( bytes, pastSpace), bytes);
+#endif
+}
+inline uint64_t BlockBits( ByteBlock hits)
+{
+	return (unsigned) _mm_movemask_epi8( hits);
+}
+inline ByteBlock LoadBlockUnaligned( const char* pos)
+{// All 16 bytes must be there
+	return _mm_loadu_si128( (const __m128i*) pos);
+}
+inline ByteBlock BlockFill( char c)
+{
+	return _mm_set1_epi8( c);
+}
+inline uint64_t BlockByteBits( ByteBlock hits)
+{// One bit for each byte, unlike BlockBits on NEON
+	return (unsigned) _mm_movemask_epi8( hits);
+}
+#elif BYTESCAN_NEON
+typedef uint8x16_t ByteBlock;
+static const unsigned kBitsPerByte = 4;
+
+BYTESCAN_NO_ASAN inline ByteBlock LoadBlock( const char* aligned)
+{
+	return vld1q_u8( (const uint8_t*) aligned);
+}
+inline ByteBlock BlockEquals( ByteBlock bytes, char c)
+{
+	return vceqq_u8( bytes, vdupq_n_u8( (uint8_t) c));
+}
+inline ByteBlock BlockOr( ByteBlock x, ByteBlock y)
+{
+	return vorrq_u8( x, y);
+}
+inline ByteBlock BlockAboveSpace( ByteBlock bytes)
+{// Same as *pos > ' ', which depends on whether char is signed
+#if CHAR_MIN < 0
+	return vcgtq_s8( vreinterpretq_s8_u8( bytes), vdupq_n_s8( ' '));
+#else
+	return vcgtq_u8( bytes, vdupq_n_u8( ' '));
+#endif
+}
+inline uint64_t BlockBits( ByteBlock hits)
+{
+	return vget_lane_u64( vreinterpret_u64_u8( vshrn_n_u16( vreinterpretq_u16_u8( hits), 4)), 0);
+}
+inline ByteBlock LoadBlockUnaligned( const char* pos)
+{// All 16 bytes must be there
+	return vld1q_u8( (const uint8_t*) pos);
+}
+inline ByteBlock BlockFill( char c)
+{
+	return vdupq_n_u8( (uint8_t) c);
+}
+inline uint64_t BlockByteBits( ByteBlock hits)
+{// One bit for each byte, unlike BlockBits
+	static const uint8_t kBit[ 16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+	uint8x16_t bits = vandq_u8( hits, vld1q_u8( kBit));
+	return vaddv_u8( vget_low_u8( bits)) | (uint64_t) vaddv_u8( vget_high_u8( bits)) << 8;
+}
+#endif
+
+#if BYTESCAN_SSE2 || BYTESCAN_NEON
+template <class Match> BYTESCAN_NO_ASAN inline const char* ScanString( const char* pos, Match match)
+{// First byte where match's block has bits set, match must include the nul
+	uintptr_t skip = (uintptr_t) pos & 15;
+	const char* block = pos - skip;
+	uint64_t bits = BlockBits( match( LoadBlock( block))) >> (skip * kBitsPerByte);
+	if( bits != 0)
+		return pos + FirstSetBit( bits) / kBitsPerByte;
+	for( ;;)
+	{
+		block += 16;
+		bits = BlockBits( match( LoadBlock( block)));
+		if( bits != 0)
+			return block + FirstSetBit( bits) / kBitsPerByte;
+	}
+}
+#endif
+
+inline const char* FindEitherInString( const char* pos, char a, char b)
+{// First a, b, or the nul
+#if BYTESCAN_SSE2 || BYTESCAN_NEON
+	return ScanString( pos, [a, b]( ByteBlock bytes)
+	{
+		return BlockOr( BlockOr( BlockEquals( bytes, a), BlockEquals( bytes, b)), BlockEquals( bytes, 0));
+	});
+#else
+	while( *pos && *pos != a && *pos != b)
+		++pos;
+	return pos;
+#endif
+}
+
+inline const char* FindAnyInString( const char* pos, char a, char b, char c)
+{// First a, b, c, or the nul
+#if BYTESCAN_SSE2 || BYTESCAN_NEON
+	return ScanString( pos, [a, b, c]( ByteBlock bytes)
+	{
+		ByteBlock hits = BlockOr( BlockEquals( bytes, a), BlockEquals( bytes, b));
+		return BlockOr( BlockOr( hits, BlockEquals( bytes, c)), BlockEquals( bytes, 0));
+	});
+#else
+	while( *pos && *pos != a && *pos != b && *pos != c)
+		++pos;
+	return pos;
+#endif
+}
+
+inline const char* SkipSpaceInString( const char* pos)
+{// First byte above ' ', or the nul
+#if BYTESCAN_SSE2 || BYTESCAN_NEON
+	return ScanString( pos, []( ByteBlock bytes)
+	{
+		return BlockOr( BlockAboveSpace( bytes), BlockEquals( bytes, 0));
+	});
+#else
+	while( *pos && !(*pos > ' '))
+		++pos;
+	return pos;
+#endif
+}
+
+inline char* FindEitherInString( char* pos, char a, char b)
+{
+	return (char*) FindEitherInString( (const char*) pos, a, b);
+}
+inline char* FindAnyInString( char* pos, char a, char b, char c)
+{
+	return (char*) FindAnyInString( (const char*) pos, a, b, c);
+}
+inline char* SkipSpaceInString( char* pos)
+{
+	return (char*) SkipSpaceInString( (const char*) pos);
+}
+
+#endif /* bytescan_hpp */
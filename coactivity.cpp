@@ -0,0 +1,170 @@
+//
+//  coactivity.cpp
+//  quilter
+//
+
+#include "coactivity.hpp"
+
+CoActivity::CoActivity()
+:
+	iWatcher( this)
+{
+}
+
+CoActivity::~CoActivity()
+{
+}
+
+bool CoActivity::Watcher::Readable( int /*fd*/)
+{
+	iOwner->iWoken = true;
+	iOwner->SignalReady();
+	return false;
+}
+
+CoActivity::Await CoActivity::Sleep( double seconds)
+{
+	Await wait( this, kWaitTimer);
+	wait.iSeconds = seconds;
+	return wait;
+}
+
+CoActivity::Await CoActivity::Yield()
+{
+	return Await( this, kWaitReady);
+}
+
+CoActivity::Await CoActivity::Line( std::string &line, FILE* f)
+{
+	Await wait( this, kWaitLine);
+	wait.iLine = &line;
+	wait.iFile = f;
+	return wait;
+}
+
+CoActivity::Await CoActivity::Readable( int fd)
+{
+	Await wait( this, kWaitFile);
+	wait.iFd = fd;
+	return wait;
+}
+
+void CoActivity::Begin( const Await &wait, std::coroutine_handle<> waiting)
+{
+	iWaiting = waiting;
+	iWaitKind = wait.iKind;
+	if( iCancelled)
+	{// Straight back, to raise
+		iWaitKind = kWaitReady;
+		iWoken = true;
+		SignalReady();
+		return;
+	}
+	switch( wait.iKind)
+	{
+	case kWaitReady:
+		iWoken = true;
+		SignalReady();
+		break;
+	case kWaitTimer:
+		iWaitFireCount = iTimer.iFireCount;
+		ScheduleExecute( wait.iSeconds);
+		break;
+	case kWaitLine:
+		iWaitFile = wait.iFile;
+		AsyncGetLine( *wait.iLine, wait.iFile, this);
+		break;
+	case kWaitFile:
+		iWaitFd = wait.iFd;
+		IoReactor::Get().Watch( wait.iFd, &iWatcher);
+		break;
+	case kWaitNone:
+		break;
+	}
+}
+
+bool CoActivity::End( const Await &wait)
+{
+	if( iCancelled)
+		sraise( "Cancelled", nullptr);
+	if( wait.iKind == kWaitLine)
+		return !wait.iLine->empty() || !AsyncGetLineAtEnd( wait.iFile);
+	return true;
+}
+
+bool CoActivity::WaitIsOver()
+{// Execute also runs for things that have nothing to do with the wait
+	if( iCancelled)
+		return true;
+	switch( iWaitKind)
+	{
+	case kWaitReady:
+	case kWaitFile:
+		return iWoken.exchange( false);
+	case kWaitTimer:
+		return iTimer.iFireCount != iWaitFireCount;
+	case kWaitLine:
+		return !AsyncGetLineWaiting( iWaitFile);
+	case kWaitNone:
+		break;
+	}
+	return false;
+}
+
+void CoActivity::Withdraw()
+{
+	CancelExecute();
+	if( iWaitKind == kWaitLine)
+		AsyncGetLineCancel( iWaitFile);
+	else if( iWaitKind == kWaitFile)
+		IoReactor::Get().Unwatch( iWaitFd);
+}
+
+void CoActivity::Startup()
+{// The body starts the next time around the main loop
+	iBody = Run();
+	iWaiting = iBody.iHandle;
+	iWaitKind = kWaitReady;
+	iWoken = true;
+	SignalReady();
+}
+
+void CoActivity::Execute()
+{
+	if( !iWaiting || !WaitIsOver())
+		return;
+	std::coroutine_handle<> waiting = std::exchange( iWaiting, nullptr);
+	iWaitKind = kWaitNone;
+	waiting.resume();
+	if( !iBody.Done())
+		return;
+	iFinished = true;
+	try
+	{
+		iBody.iHandle.promise().Result();
+	}
+	catch( ...)
+	{
+		if( !iCancelled)
+			throw;
+		Printf( "%s cancelled\n", Description());
+	}
+}
+
+void CoActivity::Shutdown()
+{// The frames go now, while everything they refer to is still here
+	Withdraw();
+	iWaitKind = kWaitNone;
+	iWaiting = nullptr;
+	iBody = CoTask<>();
+}
+
+bool CoActivity::Cancel()
+{
+	if( iFinished)
+		return false;
+	iCancelled = true;
+	Withdraw();
+	SignalReady();
+	return true;
+}
@@ -0,0 +1,185 @@
+//
+//  coactivity.hpp
+//  quilter
+//
+//  Activities written as coroutines, resumed by the main loop.
+//
+
+#ifndef coactivity_hpp
+#define coactivity_hpp
+
+#include <stdio.h>
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <string>
+#include <utility>
+#include "quilter.h"
+#include "ioreactor.hpp"
+
+/*
+		CoTask is what coroutines here return.  It starts suspended, and runs when it is
+		co_awaited, coming back to whoever awaited it when it finishes, with its result or
+		with whatever it raised.  An activity's body is a CoTask too, started by the activity.
+*/
+struct CoPromiseBase
+{
+	std::coroutine_handle<> iContinuation;	// Who co_awaited us, null for an activity's body
+	std::exception_ptr iError;
+
+	struct FinalAwaiter
+	{
+		bool await_ready() noexcept { return false; }
+		template <class P> std::coroutine_handle<> await_suspend( std::coroutine_handle<P> done) noexcept
+		{// Straight back to the caller, without growing the stack
+			std::coroutine_handle<> caller = done.promise().iContinuation;
+			return caller ? caller : std::noop_coroutine();
+		}
+		void await_resume() noexcept {}
+	};
+
+	std::suspend_always initial_suspend() noexcept { return {}; }
+	FinalAwaiter final_suspend() noexcept { return {}; }
+	void unhandled_exception() { iError = std::current_exception(); }
+};
+
+template <class T> struct CoPromise : CoPromiseBase
+{
+	T iValue{};
+	void return_value( T value) { iValue = std::move( value); }
+	T Result()
+	{
+		if( iError)
+			std::rethrow_exception( iError);
+		return std::move( iValue);
+	}
+};
+
+template <> struct CoPromise<void> : CoPromiseBase
+{
+	void return_void() {}
+	void Result()
+	{
+		if( iError)
+			std::rethrow_exception( iError);
+	}
+};
+
+template <class T = void> class CoTask
+{
+public:
+	struct promise_type : CoPromise<T>
+	{
+		CoTask get_return_object() { return CoTask( std::coroutine_handle<promise_type>::from_promise( *this)); }
+	};
+	typedef std::coroutine_handle<promise_type> Handle;
+
+	CoTask() {}
+	explicit CoTask( Handle handle) : iHandle( handle) {}
+	CoTask( CoTask&& other) noexcept : iHandle( std::exchange( other.iHandle, nullptr)) {}
+	CoTask& operator=( CoTask&& other) noexcept
+	{
+		if( this != &other)
+		{
+			if( iHandle)
+				iHandle.destroy();
+			iHandle = std::exchange( other.iHandle, nullptr);
+		}
+		return *this;
+	}
+	~CoTask()
+	{
+		if( iHandle)
+			iHandle.destroy();
+	}
+
+	Handle iHandle;
+	bool Done() const { return !iHandle || iHandle.done(); }
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend( std::coroutine_handle<> caller) noexcept
+	{// Runs the sub-task now, it resumes the caller when it finishes
+		iHandle.promise().iContinuation = caller;
+		return iHandle;
+	}
+	T await_resume() { return iHandle.promise().Result(); }
+};
+
+/*
+		Derive from this and write Run instead of Startup, Execute, and Shutdown.  Run, and
+		anything it co_awaits, waits for things by co_awaiting Sleep, Yield, Line, and Readable,
+		and carries on from there when the main loop gets around to it.  Everything runs on
+		the main loop's thread, the only cost is the coroutine frames.  Cancel makes the wait
+		in progress, or the next one, raise, which unwinds Run.
+*/
+class CoActivity : public AsyncHelper
+{
+public:
+	enum WaitKind
+	{
+		kWaitNone = 0,
+		kWaitReady,							// Yield, or Readable once the watcher fires
+		kWaitTimer,
+		kWaitLine,
+		kWaitFile
+	};
+
+	class Await
+	{// What the waits return, co_await it right away
+	public:
+		CoActivity* iActivity;
+		WaitKind iKind;
+		double iSeconds = 0;
+		std::string* iLine = nullptr;
+		FILE* iFile = nullptr;
+		int iFd = -1;
+
+		Await( CoActivity* activity, WaitKind kind) : iActivity( activity), iKind( kind) {}
+		bool await_ready() const noexcept { return false; }
+		void await_suspend( std::coroutine_handle<> waiting) { iActivity->Begin( *this, waiting); }
+		bool await_resume() { return iActivity->End( *this); }
+	};
+
+	CoActivity();
+	~CoActivity() override;
+
+	virtual CoTask<> Run() = 0;
+
+	Await Sleep( double seconds);
+	Await Yield();							// Lets everything else that is ready run first
+	Await Line( std::string &line, FILE* f);	// True with the next line, however long, false at the end
+	Await Readable( int fd);				// Until fd can be read without blocking
+
+	void Startup() override;
+	void Execute() override;
+	void Shutdown() override;
+	bool Cancel() override;
+
+protected:
+	bool iCancelled = false;
+
+private:
+	class Watcher : public IoWatcher
+	{
+	public:
+		CoActivity* iOwner;
+		Watcher( CoActivity* owner) : iOwner( owner) {}
+		bool Readable( int fd) override;
+	};
+
+	CoTask<> iBody;
+	std::coroutine_handle<> iWaiting;		// Innermost coroutine, resumed when the wait is over
+	WaitKind iWaitKind = kWaitNone;
+	int iWaitFireCount = 0;					// Timer's count when we started waiting on it
+	FILE* iWaitFile = nullptr;
+	int iWaitFd = -1;
+	std::atomic<bool> iWoken{ false};
+	Watcher iWatcher;
+
+	void Begin( const Await &wait, std::coroutine_handle<> waiting);
+	bool End( const Await &wait);
+	bool WaitIsOver();
+	void Withdraw();						// Stops whatever we are waiting for from telling us
+};
+
+#endif /* coactivity_hpp */
@@ -0,0 +1,242 @@
+//
+//  computepool.cpp
+//  quilter
+//
+
+#include "computepool.hpp"
+
+static thread_local ComputePool* tPool = nullptr;		// Pool this thread is working in
+static thread_local TaskDeque* tDeque = nullptr;		// Its deque in that pool
+
+void ComputeTask::Execute()
+{
+	try
+	{
+		Run();
+	}
+	catch( ...)
+	{// Join raises it on the thread that forked us
+		iError = std::current_exception();
+	}
+	iDone.store( true, std::memory_order_release);
+}
+
+/*
+		The fences are the ones from Lê, Pop, Cohen, and Zappa Nardelli, "Correct and Efficient
+		Work-Stealing for Weak Memory Models".
+*/
+bool TaskDeque::Push( ComputeTask* task)
+{
+	int64_t b = iBottom.load( std::memory_order_relaxed);
+	int64_t t = iTop.load( std::memory_order_acquire);
+	if( b - t >= kCapacity)
+		return false;
+	iTasks[ b & (kCapacity-1)].store( task, std::memory_order_relaxed);
+	std::atomic_thread_fence( std::memory_order_release);
+	iBottom.store( b + 1, std::memory_order_relaxed);
+	return true;
+}
+
+ComputeTask* TaskDeque::Pop()
+{
+	int64_t b = iBottom.load( std::memory_order_relaxed) - 1;
+	iBottom.store( b, std::memory_order_relaxed);
+	std::atomic_thread_fence( std::memory_order_seq_cst);
+	int64_t t = iTop.load( std::memory_order_relaxed);
+	if( t > b)
+	{// Empty
+		iBottom.store( b + 1, std::memory_order_relaxed);
+		return nullptr;
+	}
+	ComputeTask* task = iTasks[ b & (kCapacity-1)].load( std::memory_order_relaxed);
+	if( t == b)
+	{// Last one, thieves may be after it too
+		if( !iTop.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			task = nullptr;
+		iBottom.store( b + 1, std::memory_order_relaxed);
+	}
+	return task;
+}
+
+ComputeTask* TaskDeque::Steal()
+{
+	int64_t t = iTop.load( std::memory_order_acquire);
+	std::atomic_thread_fence( std::memory_order_seq_cst);
+	int64_t b = iBottom.load( std::memory_order_acquire);
+	if( t >= b)
+		return nullptr;
+	ComputeTask* task = iTasks[ t & (kCapacity-1)].load( std::memory_order_relaxed);
+	if( !iTop.compare_exchange_strong( t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+		return nullptr;
+	return task;
+}
+
+ComputePool::ComputePool( int threads)
+{
+	if( threads <= 0)
+		threads = (int) std::thread::hardware_concurrency();
+	if( threads <= 0)
+		threads = 1;
+	iWorkerCount = threads - 1;				// The thread that forks does its share while it joins
+	iDeques = new TaskDeque[ iWorkerCount + kGuests];
+	for( int g = 0; g < kGuests; ++g)
+		iGuestBusy[ g] = false;
+	for( int w = 0; w < iWorkerCount; ++w)
+		iWorkers.emplace_back( &ComputePool::WorkerMain, this, w);
+}
+
+ComputePool::~ComputePool()
+{
+	iStopping = true;
+	iWake.Increment( iWorkerCount);
+	for( std::thread &worker : iWorkers)
+		worker.join();
+	delete[] iDeques;
+}
+
+ComputePool& ComputePool::Shared()
+{
+	static ComputePool shared;
+	return shared;
+}
+
+ComputePool& ComputePool::Current()
+{
+	return tPool ? *tPool : Shared();
+}
+
+int ComputePool::Slot() const
+{
+	if( tPool != this || !tDeque)
+		return -1;
+	return (int) (tDeque - iDeques);
+}
+
+size_t ComputePool::GrainFor( size_t count, size_t minimum) const
+{// Four pieces per thread leaves room to even out
+	size_t grain = count / (Threads() * 4);
+	return grain < minimum ? minimum : grain;
+}
+
+ComputePool::Guest::Guest( ComputePool &pool)
+:
+	iPool( pool), iSavedDeque( tDeque), iSavedPool( tPool)
+{
+	if( tPool == &pool)
+	{// Already in, a worker or a guest that is forking again
+		iDeque = tDeque;
+		return;
+	}
+	if( pool.iWorkerCount == 0)
+		return;
+	for( int g = 0; g < kGuests; ++g)
+	{
+		bool busy = false;
+		if( pool.iGuestBusy[ g].load( std::memory_order_relaxed) ||
+			!pool.iGuestBusy[ g].compare_exchange_strong( busy, true, std::memory_order_acquire))
+			continue;
+		iClaimed = g;
+		iDeque = &pool.iDeques[ pool.iWorkerCount + g];
+		tPool = &pool;
+		tDeque = iDeque;
+		return;
+	}
+}
+
+ComputePool::Guest::~Guest()
+{
+	if( iClaimed < 0)
+		return;
+	tPool = iSavedPool;
+	tDeque = iSavedDeque;
+	iPool.iGuestBusy[ iClaimed].store( false, std::memory_order_release);
+}
+
+bool ComputePool::Fork( ComputeTask &task)
+{
+	if( !tDeque->Push( &task))
+		return false;
+	int sleepers = iSleepers.load();
+	while( sleepers > 0 && !iSleepers.compare_exchange_weak( sleepers, sleepers - 1))
+		;
+	if( sleepers > 0)
+		iWake.Increment();			// We took one sleeper off the count, so it's ours to wake
+	return true;
+}
+
+void ComputePool::Join( ComputeTask &task)
+{
+	int self = (int) (tDeque - iDeques);
+	uint32_t seed = (uint32_t) (uintptr_t) &task | 1;
+	while( !task.iDone.load( std::memory_order_acquire))
+	{// Until then, do anything that needs doing
+		ComputeTask* other = Find( self, seed);
+		if( other)
+			other->Execute();
+		else
+			std::this_thread::yield();	// Whoever stole it is still running it
+	}
+	if( task.iError)
+		std::rethrow_exception( task.iError);
+}
+
+ComputeTask* ComputePool::Find( int self, uint32_t &seed)
+{
+	ComputeTask* task = iDeques[ self].Pop();
+	if( task)
+		return task;
+	int slots = Slots();
+	seed ^= seed << 13;					// Xorshift for a random first victim
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	int first = (int) (seed % slots);
+	for( int i = 0; i < slots; ++i)
+	{
+		int victim = first + i < slots ? first + i : first + i - slots;
+		if( victim == self)
+			continue;
+		if( victim >= iWorkerCount && !iGuestBusy[ victim - iWorkerCount].load( std::memory_order_relaxed))
+			continue;
+		task = iDeques[ victim].Steal();
+		if( task)
+			return task;
+	}
+	return nullptr;
+}
+
+void ComputePool::WorkerMain( int index)
+{
+	tPool = this;
+	tDeque = &iDeques[ index];
+	uint32_t seed = 2463534242u + index * 7919;
+	int idle = 0;
+	while( !iStopping.load( std::memory_order_relaxed))
+	{
+		ComputeTask* task = Find( index, seed);
+		if( task)
+		{
+			task->Execute();
+			idle = 0;
+			continue;
+		}
+		if( ++idle < 64)
+		{// Work often shows up again right away
+			std::this_thread::yield();
+			continue;
+		}
+		idle = 0;
+		iSleepers.fetch_add( 1);
+		task = Find( index, seed);		// Anything forked before it could see us is found here
+		if( task)
+		{// Take ourselves back off the count, unless a fork already did, then eat its wakeup
+			int sleepers = iSleepers.load();
+			while( sleepers > 0 && !iSleepers.compare_exchange_weak( sleepers, sleepers - 1))
+				;
+			if( sleepers == 0)
+				iWake.Decrement();
+			task->Execute();
+			continue;
+		}
+		iWake.Decrement();
+	}
+}
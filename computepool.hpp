@@ -0,0 +1,158 @@
+//
+//  computepool.hpp
+//  quilter
+//
+//  Work-stealing fork/join pool for the compute-heavy stages.
+//
+
+#ifndef computepool_hpp
+#define computepool_hpp
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+#include <exception>
+#include <thread>
+#include <vector>
+#include "JeffSema.h"
+
+class ComputeTask
+{// Lives on the stack of the thread that forks it, so nothing is allocated per task
+public:
+	std::atomic<bool> iDone{ false};
+	std::exception_ptr iError;				// Raised again by Join
+
+	virtual ~ComputeTask() {}
+	virtual void Run() = 0;
+	void Execute();							// Run, keeping whatever it raises, then mark done
+};
+
+template <class F> class FunctionTask : public ComputeTask
+{
+	F& iFunction;
+public:
+	FunctionTask( F& function) : iFunction( function) {}
+	void Run() override { iFunction(); }
+};
+
+/*
+		Chase-Lev deque, the owner pushes and pops at the bottom, thieves take from the top.
+		It never grows, a fork that finds it full just runs the task in place, and since forks
+		split work in half, it only gets as deep as the recursion does.
+*/
+class TaskDeque
+{
+public:
+	static const int64_t kCapacity = 1024;
+
+	bool Push( ComputeTask* task);			// Owner only, false when full
+	ComputeTask* Pop();						// Owner only, newest first
+	ComputeTask* Steal();					// Anyone, oldest first, nullptr if empty or it lost a race
+
+private:
+	alignas( 64) std::atomic<int64_t> iTop{ 0};
+	alignas( 64) std::atomic<int64_t> iBottom{ 0};
+	std::atomic<ComputeTask*> iTasks[ kCapacity];
+};
+
+/*
+		Every worker has its own deque.  Forked tasks go on the forking thread's deque, and a
+		thread waiting to join runs its own newest tasks, then steals the oldest from others,
+		so the biggest pieces of work are the ones that move between cores.  Threads from
+		outside the pool, the main loop, a background render, borrow one of a few guest deques
+		for as long as they are inside the pool, and help out until their work is done.
+		Idle workers spin briefly, then sleep until someone forks.
+*/
+class ComputePool
+{
+public:
+	static const int kGuests = 16;			// Outside threads in the pool at once, more just run serially
+
+	ComputePool( int threads = 0);			// Including the calling thread, 0 for one per core
+	~ComputePool();
+
+	static ComputePool& Shared();			// The one everything uses, one thread per core
+	static ComputePool& Current();			// The pool this thread works for, or the shared one
+
+	int Threads() const { return iWorkerCount + 1; }
+	int Slots() const { return iWorkerCount + kGuests; }
+	int Slot() const;						// Which deque this thread is using, -1 if outside the pool
+
+	template <class A, class B> void Invoke( A a, B b)
+	{// Both at once, returns when both are done, raises what either raised
+		Guest guest( *this);
+		if( !guest.iDeque)
+		{// No room for us, or no one to help
+			a();
+			b();
+			return;
+		}
+		FunctionTask<A> task( a);
+		bool forked = Fork( task);
+		try
+		{
+			b();
+		}
+		catch( ...)
+		{// The fork is on our stack, so it must finish before we leave
+			if( forked)
+				Join( task);
+			throw;
+		}
+		if( !forked)
+			a();
+		else
+			Join( task);
+	}
+
+	template <class Body> void ParallelFor( size_t begin, size_t end, size_t grain, const Body &body)
+	{// body( first, last) over pieces of no more than grain, split in halves
+		if( grain == 0)
+			grain = 1;
+		if( end - begin <= grain || iWorkerCount == 0)
+		{
+			if( begin < end)
+				body( begin, end);
+			return;
+		}
+		size_t middle = begin + (end - begin) / 2;
+		Invoke( [&]() { ParallelFor( middle, end, grain, body); },
+				[&]() { ParallelFor( begin, middle, grain, body); });
+	}
+
+	template <class F> void Enter( F f)
+	{// Runs f here, with anything it forks, or ParallelFor's through Current, going to this pool
+		Guest guest( *this);
+		f();
+	}
+
+	size_t GrainFor( size_t count, size_t minimum) const;	// Several pieces per thread, none smaller than minimum
+
+private:
+	class Guest
+	{// Makes sure the calling thread has a deque of this pool for as long as it is in scope
+		ComputePool &iPool;
+		int iClaimed = -1;
+		TaskDeque* iSavedDeque;
+		ComputePool* iSavedPool;
+	public:
+		TaskDeque* iDeque = nullptr;
+		Guest( ComputePool &pool);
+		~Guest();
+	};
+
+	int iWorkerCount;
+	TaskDeque* iDeques;						// Workers, then guests
+	std::atomic<bool> iGuestBusy[ kGuests];
+	std::vector<std::thread> iWorkers;
+	std::atomic<bool> iStopping{ false};
+	std::atomic<int> iSleepers{ 0};
+	JeffSemaphore iWake;
+
+	bool Fork( ComputeTask &task);			// False if it has to run in place
+	void Join( ComputeTask &task);			// Works on other things until it's done
+	ComputeTask* Find( int self, uint32_t &seed);	// Ours first, then anyone's
+	void WorkerMain( int index);
+};
+
+#endif /* computepool_hpp */
@@ -0,0 +1,341 @@
+//
+//  controlsocket.cpp
+//  quilter
+//
+//	A listener activity accepts connections on a Unix-domain socket, and each connection becomes
+//	its own session activity.  A session reads command lines and runs them just like the command
+//	line does, each followed by a prompt so the client knows the command is done.  Commands run
+//	one at a time on the main loop, but each session has its own output and its own render
+//	session.  While a command runs, stdout and stderr go to the session's own temporary file, and
+//	from there to the client over a non-blocking socket, as fast as the client reads it, so a
+//	client that stops reading holds up nobody but itself.  Once it has kOutputBacklog unread, its
+//	session stops taking commands until it catches up.  Background activities that print while
+//	a session's command runs end up in that session's output.  Sending exit closes that session,
+//	not quilter.
+//
+//		quilter> control
+//		$ printf 'render -f svg -o star grid 10 10 1\n' | nc -U ~/Library/Application\ Support/Quilter/control.sock
+//
+
+#include "controlsocket.hpp"
+#include "quilter.h"
+#include "ioreactor.hpp"
+#include "quilt.hpp"
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#if MACCODE
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#if MACCODE
+static int sessionCount = 0;
+static const off_t kOutputBacklog = 1 << 20;	// Unread output that stops a session taking commands
+
+class CapturedOutput
+{// Sends stdout and stderr to a session's output file while a command runs
+	int iSaved[ 2];
+public:
+	CapturedOutput( int fd)
+	{
+		fflush( stdout);
+		fflush( stderr);
+		iSaved[ 0] = dup( STDOUT_FILENO);
+		iSaved[ 1] = dup( STDERR_FILENO);
+		dup2( fd, STDOUT_FILENO);
+		dup2( fd, STDERR_FILENO);
+	}
+	~CapturedOutput()
+	{
+		fflush( stdout);
+		fflush( stderr);
+		dup2( iSaved[ 0], STDOUT_FILENO);
+		dup2( iSaved[ 1], STDERR_FILENO);
+		close( iSaved[ 0]);
+		close( iSaved[ 1]);
+	}
+};
+
+class ControlSession : public AsyncHelper
+{// One connected client
+public:
+	int iSocket;
+	int iWriteSocket = -1;			// The same connection, so room to write is watched apart from input
+	FILE* iOutput = nullptr;		// What its commands printed
+	off_t iCaptured = 0;			// Bytes in iOutput
+	off_t iSent = 0;				// Of those, already sent
+	ActivityWatcher iWatcher;
+	ActivityWatcher iWriteWatcher;
+	LineAssembler iPending;			// Read, but not a whole line yet
+	RenderSession iRenderSession;
+	bool iHungUp = false;			// Nothing more to read
+	bool iDone = false;				// Takes no more commands, finishes once its output is sent
+	bool iGone = false;				// Can't be sent to any more
+
+	ControlSession( int fd)
+	:
+		iSocket( fd),
+		iWatcher( this),
+		iWriteWatcher( this)
+	{
+		snprintf( iDescription, sizeof( iDescription), "Control session %d", ++sessionCount);
+	}
+
+	void Startup() override
+	{
+		iOutput = tmpfile();
+		Test( iOutput);
+		iWriteSocket = dup( iSocket);
+		if( iWriteSocket < 0) TestMsg( -1, "Control session");
+		TestMsg( fcntl( iSocket, F_SETFL, fcntl( iSocket, F_GETFL) | O_NONBLOCK), "fcntl");
+		IoReactor::Get().Watch( iSocket, &iWatcher);
+	}
+
+	void Execute() override
+	{// Input has arrived, or there is room to send more output
+		SendOutput();
+		if( !iDone && !iGone)
+			RunCommands();
+		SendOutput();
+		if( iGone || (iDone && iSent == iCaptured))
+		{
+			iFinished = true;
+			return;
+		}
+		if( iSent < iCaptured)
+			IoReactor::Get().Watch( iWriteSocket, &iWriteWatcher, true);
+	}
+
+	void RunCommands()
+	{
+		static const size_t kChunk = 4096;
+		if( !iHungUp)
+		{
+			ssize_t got = read( iSocket, iPending.Room( kChunk), kChunk);
+			if( got > 0)
+				iPending.Added( got);
+			else if( got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+				iHungUp = true;
+		}
+		std::string_view line;
+		while( !iDone && iCaptured - iSent < kOutputBacklog && iPending.NextLine( line))
+			RunLine( line);		// Each whole line, run where it sits in the buffer
+		if( iDone || iCaptured - iSent >= kOutputBacklog)
+			return;				// Carries on once the client reads some, the write watch brings us back
+		if( iHungUp)
+		{// The last command may not have a line end
+			if( iPending.TakeRest( line))
+				RunLine( line);
+			iDone = true;
+			return;
+		}
+		IoReactor::Get().Watch( iSocket, &iWatcher);
+	}
+
+	void RunLine( std::string_view line)
+	{
+		int result;
+		{
+			CapturedOutput output( fileno( iOutput));
+			RenderSession* interactive = UseRenderSession( &iRenderSession);
+			result = DispatchCommandLine( (char*) line.data());
+			UseRenderSession( interactive);
+			if( result != 2)
+				printf( "Quilter>");
+		}
+		struct stat st;
+		if( fstat( fileno( iOutput), &st) == 0)
+			iCaptured = st.st_size;
+		if( result == 2)
+			iDone = true;		// Client is done with us
+	}
+
+	void SendOutput()
+	{// Whatever the connection takes without waiting
+		char chunk[ 65536];
+		while( !iGone && iSent < iCaptured)
+		{
+			size_t length = (size_t) std::min( (off_t) sizeof( chunk), iCaptured - iSent);
+			ssize_t got = pread( fileno( iOutput), chunk, length, iSent);
+			if( got <= 0)
+				TestMsg( -1, "Reading control session output");
+			ssize_t sent = write( iSocket, chunk, got);
+			if( sent < 0 && errno == EINTR)
+				continue;
+			if( sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return;
+			if( sent < 0)
+				iGone = true;	// Client hung up without reading it all
+			else
+				iSent += sent;
+		}
+		if( iSent > 0 && iSent == iCaptured)
+		{// All sent, start the file over
+			TestMsg( ftruncate( fileno( iOutput), 0), "Control session output");
+			lseek( fileno( iOutput), 0, SEEK_SET);
+			iSent = iCaptured = 0;
+		}
+	}
+
+	void Shutdown() override
+	{
+		IoReactor::Get().Unwatch( iSocket);
+		if( iWriteSocket >= 0)
+			IoReactor::Get().Unwatch( iWriteSocket);
+	}
+
+	~ControlSession()
+	{
+		close( iSocket);
+		if( iWriteSocket >= 0)
+			close( iWriteSocket);
+		if( iOutput)
+			fclose( iOutput);
+	}
+};
+
+class ControlListener : public AsyncHelper
+{// Accepts connections, each gets its own session
+public:
+	int iSocket = -1;
+	std::string iPath;
+	ActivityWatcher iWatcher;
+
+	ControlListener( const std::string &path)
+	:
+		iPath( path),
+		iWatcher( this)
+	{
+		snprintf( iDescription, sizeof( iDescription), "Control socket %s", iPath.c_str());
+	}
+
+	void Startup() override
+	{
+		struct sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+		if( iPath.length() >= sizeof( address.sun_path))
+			sraise( "Control socket path is too long", "str path", iPath.c_str(), nullptr);
+		strcpy( address.sun_path, iPath.c_str());
+		signal( SIGPIPE, SIG_IGN);		// A client that hangs up early gets an error, not us killed
+		struct stat st;
+		if( lstat( iPath.c_str(), &st) == 0)
+		{// Left over from before, but only ever remove a socket
+			if( !S_ISSOCK( st.st_mode))
+				sraise( "Control socket path is already something other than a socket", "str path", iPath.c_str(), nullptr);
+			unlink( iPath.c_str());
+		}
+		iSocket = socket( AF_UNIX, SOCK_STREAM, 0);
+		if( iSocket < 0) TestMsg( -1, "Creating control socket");
+		TestMsg( bind( iSocket, (struct sockaddr*) &address, sizeof( address)), iPath.c_str());
+		TestMsg( listen( iSocket, 16), iPath.c_str());
+		TestMsg( fcntl( iSocket, F_SETFL, fcntl( iSocket, F_GETFL) | O_NONBLOCK), "fcntl");
+		IoReactor::Get().Watch( iSocket, &iWatcher);
+	}
+
+	void Execute() override
+	{
+		for(;;)
+		{// Everyone who is waiting
+			int client = accept( iSocket, nullptr, nullptr);
+			if( client < 0)
+				break;
+			ControlSession* session = new ControlSession( client);
+			try
+			{
+				session->Startup();
+			}
+			catch( ...)
+			{
+				delete session;
+				throw;
+			}
+			AddActivity( session);
+		}
+		IoReactor::Get().Watch( iSocket, &iWatcher);
+	}
+
+	void Shutdown() override
+	{
+		IoReactor::Get().Unwatch( iSocket);
+	}
+
+	~ControlListener()
+	{
+		if( iSocket >= 0)
+		{
+			close( iSocket);
+			unlink( iPath.c_str());
+		}
+	}
+};
+
+static ControlListener* listener = nullptr;
+#endif
+
+int ControlCmd( CommandProc* cur)
+{
+	bool stop = false;
+	const char* path = nullptr;
+	const char* boolOpts = "s";
+	bool* boolValues[] = { &stop};
+	const char* strOpts = "p";
+	const char** strValues[] = { &path};
+	static const char* helps[] =
+	{
+		"Stop listening, sessions already connected carry on.",
+		"Socket path, default is control.sock in the Quilter settings folder.",
+		"Listens on a local socket for command lines from other processes."
+	};
+
+	GetAllOpts(
+		cur->iArgc, cur->iArgv,
+		boolOpts, boolValues,
+		strOpts, strValues,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		"", helps);
+
+#if MACCODE
+	if( stop)
+	{
+		if( listener == nullptr)
+			sraise( "Not listening for control connections", nullptr);
+		RetireActivity( listener);
+		listener = nullptr;
+		return cur->iFromCommandLine ? 2 : 0;
+	}
+	if( listener)
+		sraise( "Already listening", "str path", listener->iPath.c_str(), nullptr);
+	std::string socketPath;
+	if( path)
+		socketPath = path;
+	else
+	{// Next to the stitch cache
+		std::filesystem::path folder = std::filesystem::path( SettingsPath()) / "Quilter";
+		std::filesystem::create_directories( folder);
+		socketPath = (folder / "control.sock").string();
+	}
+	ControlListener* newListener = new ControlListener( socketPath);
+	try
+	{
+		newListener->Startup();
+	}
+	catch( ...)
+	{
+		delete newListener;
+		throw;
+	}
+	AddActivity( newListener);
+	listener = newListener;
+	printf( "Listening on %s\n", socketPath.c_str());
+	return 0;		// Keep running, even from the command line, that's the point
+#else
+	sraise( "Control sockets are not available on Windows yet", nullptr);
+	return 0;
+#endif
+}
@@ -0,0 +1,15 @@
+//
+//  controlsocket.hpp
+//  quilter
+//
+//  Lets other processes run commands in this one, over a local socket.
+//
+
+#ifndef controlsocket_hpp
+#define controlsocket_hpp
+
+#include "ConsoleThings.h"
+
+int ControlCmd( CommandProc* cur);
+
+#endif /* controlsocket_hpp */
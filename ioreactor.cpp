@@ -0,0 +1,223 @@
+//
+//  ioreactor.cpp
+//  quilter
+//
+//	A single thread waits for input, or room to write, on everything being watched, and tells
+//	the watcher.
+//	Watchers are normally ActivityWatchers, which put their activity in the ready queue, so
+//	the reading itself happens in the main loop, and nothing wakes up while nothing arrives.
+//
+
+#include "ioreactor.hpp"
+#include <thread>
+#include <sys/stat.h>
+#if MACCODE
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+#endif
+#if WINCODE
+#include <io.h>
+#include <vector>
+
+static const DWORD kPeekInterval = 10;		// Milliseconds between looks at pipes, which can't be waited on
+#endif
+
+IoWatcher::~IoWatcher()
+{
+}
+
+IoReactor& IoReactor::Get()
+{
+	static IoReactor* sReactor = new IoReactor();	// Never deleted, the thread runs until we exit
+	return *sReactor;
+}
+
+IoReactor::IoReactor()
+{
+#if MACCODE
+#if defined(__linux__)
+	iQueue = epoll_create1( EPOLL_CLOEXEC);
+#else
+	iQueue = kqueue();
+#endif
+	if( iQueue < 0) TestMsg( -1, "Creating the I/O reactor");
+#endif
+#if WINCODE
+	Test( iWake = CreateEvent( nullptr, FALSE, FALSE, nullptr));
+#endif
+	std::thread( &IoReactor::Run, this).detach();
+}
+
+void IoReactor::Watch( int fd, IoWatcher* watcher, bool forWriting)
+{
+	struct stat st;
+	if( fstat( fd, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG)
+	{// Might block, so wait for it
+		std::lock_guard<std::recursive_mutex> hold( iLock);
+		iWatchers[ fd] = watcher;
+		iWriting[ fd] = forWriting;
+		if( Arm( fd))
+			return;
+		iWatchers.erase( fd);
+		iWriting.erase( fd);
+	}
+	while( watcher->Readable( fd))
+		;		// Never blocks, so there is nothing to wait for
+}
+
+void IoReactor::Unwatch( int fd)
+{
+	std::lock_guard<std::recursive_mutex> hold( iLock);
+	if( iWatchers.erase( fd) == 0)
+		return;
+	bool writing = iWriting[ fd];
+	iWriting.erase( fd);
+#if MACCODE
+#if defined(__linux__)
+	(void) writing;
+	epoll_ctl( iQueue, EPOLL_CTL_DEL, fd, nullptr);		// Fails harmlessly if it already fired
+#else
+	struct kevent change;
+	EV_SET( &change, fd, writing ? EVFILT_WRITE : EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+	kevent( iQueue, &change, 1, nullptr, 0, nullptr);
+#endif
+#endif
+#if WINCODE
+	(void) writing;
+	iArmed.erase( fd);
+	SetEvent( iWake);
+#endif
+}
+
+bool IoReactor::Arm( int fd)
+{// With iLock held, tell the watcher once when fd is ready, false if it is something we can't wait on
+	bool writing = iWriting[ fd];
+#if MACCODE
+#if defined(__linux__)
+	struct epoll_event ev = {};
+	ev.events = (writing ? EPOLLOUT : EPOLLIN) | EPOLLONESHOT;
+	ev.data.fd = fd;
+	int status = epoll_ctl( iQueue, EPOLL_CTL_MOD, fd, &ev);
+	if( status != 0 && errno == ENOENT)
+		status = epoll_ctl( iQueue, EPOLL_CTL_ADD, fd, &ev);	// First time for this descriptor
+	if( status != 0 && errno == EPERM)
+		return false;		// Like /dev/null, always readable
+	TestMsg( status, writing ? "Watching for room to write" : "Watching for input");
+#else
+	struct kevent change;
+	EV_SET( &change, fd, writing ? EVFILT_WRITE : EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, nullptr);
+	if( kevent( iQueue, &change, 1, nullptr, 0, nullptr) != 0)
+		return false;	// Some devices can't be watched, they don't block either
+#endif
+#endif
+#if WINCODE
+	if( writing)
+		return false;		// Handles only signal input, and our writes don't wait
+	HANDLE handle = (HANDLE) _get_osfhandle( fd);
+	DWORD mode;
+	if( handle != INVALID_HANDLE_VALUE && GetConsoleMode( handle, &mode))
+		iArmed[ fd] = true;		// Console input is signalled when there is some
+	else if( handle != INVALID_HANDLE_VALUE && GetFileType( handle) == FILE_TYPE_PIPE)
+		iArmed[ fd] = false;	// Reads as signalled whether or not there is anything in it
+	else
+		return false;
+	SetEvent( iWake);
+#endif
+	return true;
+}
+
+void IoReactor::Run()
+{
+	for(;;)
+	{
+		int ready[ 16];
+		int count = 0;
+#if MACCODE
+#if defined(__linux__)
+		struct epoll_event events[ CountItems( ready)];
+		count = epoll_wait( iQueue, events, CountItems( events), -1);
+		for( int e = 0; e < count; ++e)
+			ready[ e] = events[ e].data.fd;
+#else
+		struct kevent events[ CountItems( ready)];
+		count = kevent( iQueue, nullptr, 0, events, CountItems( events), nullptr);
+		for( int e = 0; e < count; ++e)
+			ready[ e] = (int) events[ e].ident;
+#endif
+		if( count < 0)
+		{// Only a signal should get us here
+			if( errno != EINTR)
+				printf( "I/O reactor failed: %s\n", strerror( errno));
+			continue;
+		}
+#endif
+#if WINCODE
+		std::vector<HANDLE> handles( 1, iWake);
+		std::vector<int> fds( 1, -1);
+		std::vector<int> pipes;
+		{// Everything armed, up to the limit of one wait
+			std::lock_guard<std::recursive_mutex> hold( iLock);
+			for( auto &armed : iArmed)
+			{
+				if( !armed.second)
+					pipes.push_back( armed.first);
+				else if( handles.size() < MAXIMUM_WAIT_OBJECTS)
+				{
+					handles.push_back( (HANDLE) _get_osfhandle( armed.first));
+					fds.push_back( armed.first);
+				}
+			}
+		}
+		for( int fd : pipes)
+		{// Ready when there is something in it, or it is broken and the read will say so
+			DWORD available = 0;
+			if( count < CountItems( ready) &&
+				(!PeekNamedPipe( (HANDLE) _get_osfhandle( fd), nullptr, 0, nullptr, &available, nullptr) || available > 0))
+				ready[ count++] = fd;
+		}
+		if( count == 0)
+		{
+			DWORD which = WaitForMultipleObjects( (DWORD) handles.size(), handles.data(), FALSE,
+				pipes.empty() ? INFINITE : kPeekInterval);
+			if( which == WAIT_FAILED)
+			{// Some handle has gone bad, drop it instead of failing on it every time around
+				std::lock_guard<std::recursive_mutex> hold( iLock);
+				for( size_t h = 1; h < handles.size(); ++h)
+				{
+					if( WaitForSingleObject( handles[ h], 0) != WAIT_FAILED)
+						continue;
+					printf( "I/O reactor can't wait on descriptor %d, error %lu\n", fds[ h], (unsigned long) GetLastError());
+					iArmed.erase( fds[ h]);
+					if( count < CountItems( ready))
+						ready[ count++] = fds[ h];		// Its read will fail too, and say why
+				}
+			}
+			else if( which > WAIT_OBJECT_0 && which < WAIT_OBJECT_0 + handles.size())
+				ready[ count++] = fds[ which - WAIT_OBJECT_0];
+			// Otherwise woken to pick up changes, or time to look at the pipes again
+		}
+#endif
+		for( int e = 0; e < count; ++e)
+		{// Tell each watcher, unless it stopped watching while we waited
+			std::lock_guard<std::recursive_mutex> hold( iLock);
+			auto found = iWatchers.find( ready[ e]);
+			if( found == iWatchers.end())
+				continue;
+#if WINCODE
+			iArmed.erase( ready[ e]);
+#endif
+			try
+			{
+				if( found->second->Readable( ready[ e]))
+					Arm( ready[ e]);
+			}
+			catch( std::exception& err)
+			{
+				DisplayException( err);
+			}
+		}
+	}
+}
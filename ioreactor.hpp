@@ -0,0 +1,69 @@
+//
+//  ioreactor.hpp
+//  quilter
+//
+//  One thread waits on every file descriptor we read from, instead of a thread per read.
+//
+
+#ifndef ioreactor_hpp
+#define ioreactor_hpp
+
+#include <map>
+#include <mutex>
+#include "ConsoleThings.h"
+#include "quilter.h"
+
+class IoWatcher
+{// Told when its file descriptor can be read without blocking, or written if it was watched for writing
+public:
+	virtual ~IoWatcher();
+	virtual bool Readable( int fd) = 0;		// On the reactor thread, return true to keep watching
+};
+
+class ActivityWatcher : public IoWatcher
+{// Runs an activity's Execute when there is something to read, the activity reads it and watches again
+public:
+	AsyncHelper* iOwner;
+	ActivityWatcher( AsyncHelper* owner)
+	:
+		iOwner( owner)
+	{
+	}
+	bool Readable( int /*fd*/) override
+	{
+		iOwner->SignalReady();
+		return false;
+	}
+};
+
+/*
+		Watching is one shot, a watcher is told once, then not again until it asks.  That way
+		nothing is told twice about the same data while the main loop gets around to reading it.
+		Regular files and devices that can't be waited on never block, so they are reported as
+		ready right away, on the calling thread.  epoll on Linux, kqueue on the Mac, and on
+		Windows, a wait on console handles, with pipes peeked at while it waits.
+*/
+class IoReactor
+{
+private:
+	std::recursive_mutex iLock;					// Held while a watcher is being told
+	std::map<int, IoWatcher*> iWatchers;		// Everything that has been watched and not unwatched
+	std::map<int, bool> iWriting;				// True for those waiting for room to write rather than input
+#if MACCODE
+	int iQueue = -1;							// epoll or kqueue descriptor
+#endif
+#if WINCODE
+	HANDLE iWake = nullptr;						// Set to rebuild the list of handles
+	std::map<int, bool> iArmed;					// True to wait on the handle, false for a pipe to peek at
+#endif
+	IoReactor();
+	bool Arm( int fd);
+	void Run();
+
+public:
+	static IoReactor& Get();					// Started on first use, runs until exit
+	void Watch( int fd, IoWatcher* watcher, bool forWriting = false);	// A descriptor is watched one way, dup it to watch both
+	void Unwatch( int fd);						// Once this returns, the watcher won't be called
+};
+
+#endif /* ioreactor_hpp */
@@ -0,0 +1,866 @@
+//
+//  json.cpp
+//  quilter
+//
+
+#include "json.hpp"
+#include "bytescan.hpp"
+#include <errno.h>
+#include <math.h>
+#include <string.h>
+#include <cmath>
+
+/*
+		Finding the tokens
+
+		Each 64 byte chunk becomes a bit mask for each kind of character that matters.  A
+		backslash escapes the byte after it, unless it is itself escaped, and escaped quotes
+		don't count.  The prefix xor of the quotes that are left is set everywhere inside a
+		string, from the open quote up to, but not including, the close quote, so the structural
+		characters outside strings are just a mask away.  A number or literal starts at any
+		byte outside a string that isn't whitespace, structural, or a quote, where the byte
+		before it wasn't part of one.  Everything that carries over from one chunk to the next
+		is a bit or a mask.
+*/
+typedef struct ChunkMasks
+{
+	uint64_t backslash = 0;
+	uint64_t quote = 0;
+	uint64_t structural = 0;			// { } [ ] : ,
+	uint64_t space = 0;
+} ChunkMasks_t;
+
+static void ClassifyChunk( const char* chunk, ChunkMasks_t &masks)
+{
+#if BYTESCAN_SSE2 || BYTESCAN_NEON
+	for( int b = 0; b < 4; ++b)
+	{
+		ByteBlock bytes = LoadBlockUnaligned( chunk + 16*b);
+		int shift = 16*b;
+		masks.backslash |= BlockByteBits( BlockEquals( bytes, '\\')) << shift;
+		masks.quote |= BlockByteBits( BlockEquals( bytes, '"')) << shift;
+		ByteBlock structural = BlockOr( BlockEquals( bytes, ':'), BlockEquals( bytes, ','));
+		ByteBlock lower = BlockOr( bytes, BlockFill( 0x20));	// '[' and ']' become '{' and '}'
+		structural = BlockOr( structural, BlockOr( BlockEquals( lower, '{'), BlockEquals( lower, '}')));
+		masks.structural |= BlockByteBits( structural) << shift;
+		ByteBlock space = BlockOr( BlockEquals( bytes, ' '), BlockEquals( bytes, '\n'));
+		space = BlockOr( space, BlockOr( BlockEquals( bytes, '\r'), BlockEquals( bytes, '\t')));
+		masks.space |= BlockByteBits( space) << shift;
+	}
+#else
+	for( int b = 0; b < 64; ++b)
+	{
+		uint64_t bit = (uint64_t) 1 << b;
+		switch( chunk[ b])
+		{
+		case '\\': masks.backslash |= bit; break;
+		case '"': masks.quote |= bit; break;
+		case '{': case '}': case '[': case ']': case ':': case ',': masks.structural |= bit; break;
+		case ' ': case '\n': case '\r': case '\t': masks.space |= bit; break;
+		}
+	}
+#endif
+}
+
+static inline uint64_t PrefixXor( uint64_t bits)
+{// Each bit becomes the xor of itself and every bit below it
+	bits ^= bits << 1;
+	bits ^= bits << 2;
+	bits ^= bits << 4;
+	bits ^= bits << 8;
+	bits ^= bits << 16;
+	bits ^= bits << 32;
+	return bits;
+}
+
+void JsonDocument::Fail( const char* message, size_t offset) const
+{
+	sraise( message, "int64 offset", (int64) offset, nullptr);
+}
+
+void JsonDocument::Parse( const char* data, size_t length)
+{
+	iData = data;
+	iLength = length;
+	iTokens.clear();
+	iMatch.clear();
+	if( length >= UINT32_MAX)
+		Fail( "JSON over 4GB", length);
+	FindTokens();
+	CheckGrammar();
+}
+
+void JsonDocument::FindTokens()
+{
+	iTokens.reserve( iLength / 4 + 16);		// Only the part used is ever touched
+	uint64_t escapeCarry = 0;			// Bit 0 set when the last chunk ended with a backslash that escapes
+	uint64_t stringCarry = 0;			// All ones when the last chunk ended inside a string
+	uint64_t atomCarry = 0;				// Bit 0 set when the last chunk ended inside a number or literal
+	char padded[ 64];
+	for( size_t base = 0; base < iLength; base += 64)
+	{
+		const char* chunk = iData + base;
+		if( iLength - base < 64)
+		{// The last one, spaces after the end don't start anything
+			memset( padded, ' ', sizeof( padded));
+			memcpy( padded, chunk, iLength - base);
+			chunk = padded;
+		}
+		ChunkMasks_t masks;
+		ClassifyChunk( chunk, masks);
+
+		uint64_t escaped = escapeCarry;
+		uint64_t backslashes = masks.backslash & ~escapeCarry;
+		escapeCarry = 0;
+		while( backslashes)
+		{// Rare enough to take one at a time
+			uint64_t backslash = backslashes & (0 - backslashes);
+			uint64_t next = backslash << 1;
+			if( next == 0)
+				escapeCarry = 1;		// Escapes the first byte of the next chunk
+			escaped |= next;
+			backslashes &= ~(backslash | next);
+		}
+		uint64_t quotes = masks.quote & ~escaped;
+		uint64_t inString = PrefixXor( quotes) ^ stringCarry;
+		stringCarry = (uint64_t) ((int64_t) inString >> 63);
+		uint64_t atoms = ~(masks.structural | masks.space | masks.quote | inString);
+		uint64_t tokens = (masks.structural & ~inString) | (quotes & inString) | (atoms & ~(atoms << 1 | atomCarry));
+		atomCarry = atoms >> 63;
+
+		size_t count = iTokens.size();
+		iTokens.resize( count + CountSetBits( tokens));
+		uint32_t* into = iTokens.data() + count;
+		for( ; tokens; tokens &= tokens - 1)
+			*into++ = (uint32_t) (base + FirstSetBit( tokens));
+	}
+	if( stringCarry)
+		Fail( "JSON string never ends", iLength);
+}
+
+/*
+		The grammar, over just the tokens.  Every open bracket is paired with its close here,
+		and the literals are checked, but numbers and strings wait until they are read.
+*/
+static const char* NumberEnd( const char* pos)
+{// Past a number as JSON writes them, or nullptr if it isn't one
+	if( *pos == '-')
+		++pos;
+	if( *pos == '0')
+		++pos;
+	else if( *pos >= '1' && *pos <= '9')
+		while( *pos >= '0' && *pos <= '9') ++pos;
+	else
+		return nullptr;
+	if( *pos == '.')
+	{
+		if( *++pos < '0' || *pos > '9')
+			return nullptr;
+		while( *pos >= '0' && *pos <= '9') ++pos;
+	}
+	if( *pos == 'e' || *pos == 'E')
+	{
+		if( *++pos == '+' || *pos == '-')
+			++pos;
+		if( *pos < '0' || *pos > '9')
+			return nullptr;
+		while( *pos >= '0' && *pos <= '9') ++pos;
+	}
+	return pos;
+}
+
+void JsonDocument::CheckGrammar()
+{
+	enum Expecting
+	{
+		kValue = 0,
+		kValueOrClose,						// Just after '['
+		kKeyOrClose,						// Just after '{'
+		kKey,
+		kColon,
+		kCommaOrClose,
+		kNothing							// The top value is done
+	};
+	iMatch.assign( iTokens.size(), 0);
+	std::vector<uint32_t> open;
+	Expecting expecting = kValue;
+	for( uint32_t token = 0; token < (uint32_t) iTokens.size(); ++token)
+	{
+		size_t offset = iTokens[ token];
+		char c = iData[ offset];
+		bool closed = false;
+		switch( expecting)
+		{
+		case kValue:
+		case kValueOrClose:
+			if( c == ']' && expecting == kValueOrClose)
+				closed = true;
+			else if( c == '{' || c == '[')
+			{
+				open.push_back( token);
+				expecting = c == '{' ? kKeyOrClose : kValueOrClose;
+			}
+			else if( c == '"')
+				expecting = open.empty() ? kNothing : kCommaOrClose;
+			else if( c == '-' || (c >= '0' && c <= '9'))
+			{
+				if( NumberEnd( iData + offset) != JsonValue( this, token).AtomEnd())
+					Fail( "Badly formed JSON number", offset);
+				expecting = open.empty() ? kNothing : kCommaOrClose;
+			}
+			else
+			{
+				JsonValue literal( this, token);
+				std::string_view text = literal.Text();
+				if( text != "true" && text != "false" && text != "null")
+					Fail( "Expected a JSON value", offset);
+				expecting = open.empty() ? kNothing : kCommaOrClose;
+			}
+			break;
+		case kKeyOrClose:
+		case kKey:
+			if( c == '}' && expecting == kKeyOrClose)
+				closed = true;
+			else if( c == '"')
+				expecting = kColon;
+			else
+				Fail( "Expected a quoted JSON key", offset);
+			break;
+		case kColon:
+			if( c != ':')
+				Fail( "Expected ':' after the JSON key", offset);
+			expecting = kValue;
+			break;
+		case kCommaOrClose:
+			{
+				char opener = iData[ iTokens[ open.back()]];
+				if( c == ',')
+					expecting = opener == '{' ? kKey : kValue;
+				else if( c == (opener == '{' ? '}' : ']'))
+					closed = true;
+				else
+					Fail( opener == '{' ? "Expected ',' or '}'" : "Expected ',' or ']'", offset);
+			}
+			break;
+		case kNothing:
+			Fail( "More after the end of the JSON", offset);
+		}
+		if( closed)
+		{
+			iMatch[ open.back()] = token;
+			open.pop_back();
+			expecting = open.empty() ? kNothing : kCommaOrClose;
+		}
+	}
+	if( expecting != kNothing)
+		Fail( iTokens.empty() ? "No JSON in it" : "JSON ends early", iLength);
+}
+
+JsonValue JsonDocument::Root() const
+{
+	return JsonValue( this, 0);
+}
+
+/*
+		Reading values
+*/
+JsonValue JsonValue::At( uint32_t token) const
+{
+	return JsonValue( iDocument, token);
+}
+
+JsonType JsonValue::Type() const
+{
+	switch( iDocument->iData[ Offset()])
+	{
+	case '{': return kJsonObject;
+	case '[': return kJsonArray;
+	case '"': return kJsonString;
+	case 't': case 'f': return kJsonBool;
+	case 'n': return kJsonNull;
+	default: return kJsonNumber;
+	}
+}
+
+bool JsonValue::IsNull() const
+{
+	return Type() == kJsonNull;
+}
+
+void JsonValue::Expect( JsonType type, const char* what) const
+{
+	if( Type() != type)
+		iDocument->Fail( what, Offset());
+}
+
+uint32_t JsonValue::After() const
+{
+	char c = iDocument->iData[ Offset()];
+	return (c == '{' || c == '[' ? iDocument->iMatch[ iToken] : iToken) + 1;
+}
+
+const char* JsonValue::StringEnd() const
+{
+	const char* pos = iDocument->iData + Offset() + 1;
+	const char* end = iDocument->iData + iDocument->iLength;
+	for( ;;)
+	{// It was checked to end when the tokens were found
+		pos = FindEither( pos, end, '"', '\\');
+		if( *pos == '"')
+			return pos;
+		pos += 2;
+	}
+}
+
+const char* JsonValue::AtomEnd() const
+{
+	const char* pos = iDocument->iData + Offset();
+	const char* end = iDocument->iData + iDocument->iLength;
+	for( ; pos < end; ++pos)
+	{
+		char c = *pos;
+		if( c == ',' || c == ']' || c == '}' || c == ':' || c == '[' || c == '{' || c == '"' || c <= ' ')
+			break;
+	}
+	return pos;
+}
+
+std::string_view JsonValue::Text() const
+{
+	const char* start = iDocument->iData + Offset();
+	switch( Type())
+	{
+	case kJsonObject:
+	case kJsonArray:
+		return std::string_view( start, 1);
+	case kJsonString:
+		return std::string_view( start, StringEnd() + 1 - start);
+	default:
+		return std::string_view( start, AtomEnd() - start);
+	}
+}
+
+bool JsonValue::Bool() const
+{
+	Expect( kJsonBool, "JSON value isn't true or false");
+	return iDocument->iData[ Offset()] == 't';
+}
+
+double JsonValue::Double() const
+{
+	Expect( kJsonNumber, "JSON value isn't a number");
+	const char* start = iDocument->iData + Offset();
+	return strtod( start, nullptr);		// Checked when it was parsed
+}
+
+int64 JsonValue::Int64() const
+{
+	Expect( kJsonNumber, "JSON value isn't a number");
+	const char* start = iDocument->iData + Offset();
+	const char* end = AtomEnd();
+	for( const char* pos = start; pos < end; ++pos)
+	{
+		if( *pos == '.' || *pos == 'e' || *pos == 'E')
+			iDocument->Fail( "JSON number isn't a whole number", Offset());
+	}
+	errno = 0;
+	int64 value = strtoll( start, nullptr, 10);
+	if( errno == ERANGE)
+		iDocument->Fail( "JSON number is too big", Offset());
+	return value;
+}
+
+std::string JsonValue::String() const
+{
+	Expect( kJsonString, "JSON value isn't a string");
+	const char* start = iDocument->iData + Offset() + 1;
+	const char* end = StringEnd();
+	std::string value( end - start, 0);
+	value.resize( JsonUnescape( &value[ 0], start, end) - &value[ 0]);
+	return value;
+}
+
+bool JsonValue::Equals( const char* text) const
+{
+	if( Type() != kJsonString)
+		return false;
+	const char* start = iDocument->iData + Offset() + 1;
+	const char* end = StringEnd();
+	if( FindEither( start, end, '\\', '\\') == end)
+	{// Nothing to unescape, the usual case for keys
+		size_t length = end - start;
+		return strncmp( start, text, length) == 0 && text[ length] == 0;
+	}
+	return String() == text;
+}
+
+size_t JsonValue::Count() const
+{
+	size_t count = 0;
+	for( JsonValue item = First(); item.Valid(); item = item.Next())
+		++count;
+	return count;
+}
+
+JsonValue JsonValue::First() const
+{
+	JsonType type = Type();
+	if( type != kJsonArray && type != kJsonObject)
+		iDocument->Fail( "JSON value isn't an array or object", Offset());
+	if( iDocument->iMatch[ iToken] == iToken + 1)
+		return JsonValue();		// Empty
+	return At( type == kJsonObject ? iToken + 3 : iToken + 1);	// Past the key and colon
+}
+
+JsonValue JsonValue::Next() const
+{
+	uint32_t after = After();
+	if( after >= iDocument->iTokens.size() || iDocument->iData[ iDocument->iTokens[ after]] != ',')
+		return JsonValue();		// The close
+	bool member = iToken > 0 && iDocument->iData[ iDocument->iTokens[ iToken - 1]] == ':';
+	return At( member ? after + 3 : after + 1);
+}
+
+JsonValue JsonValue::Key() const
+{
+	if( iToken < 2 || iDocument->iData[ iDocument->iTokens[ iToken - 1]] != ':')
+		iDocument->Fail( "JSON value isn't in an object", Offset());
+	return At( iToken - 2);
+}
+
+JsonValue JsonValue::operator[]( size_t index) const
+{
+	Expect( kJsonArray, "JSON value isn't an array");
+	JsonValue item = First();
+	for( ; item.Valid() && index > 0; --index)
+		item = item.Next();
+	return item;
+}
+
+JsonValue JsonValue::operator[]( const char* key) const
+{
+	Expect( kJsonObject, "JSON value isn't an object");
+	for( JsonValue item = First(); item.Valid(); item = item.Next())
+	{
+		if( item.Key().Equals( key))
+			return item;
+	}
+	return JsonValue();
+}
+
+/*
+		Escapes
+*/
+static unsigned HexDigits( const char* pos, const char* end)
+{// The four after \u
+	if( end - pos < 4)
+		sraise( "JSON \\u escape is too short", nullptr);
+	unsigned value = 0;
+	for( int d = 0; d < 4; ++d)
+	{
+		char c = pos[ d];
+		value <<= 4;
+		if( c >= '0' && c <= '9') value |= c - '0';
+		else if( c >= 'a' && c <= 'f') value |= c - 'a' + 10;
+		else if( c >= 'A' && c <= 'F') value |= c - 'A' + 10;
+		else sraise( "JSON \\u escape isn't hex", nullptr);
+	}
+	return value;
+}
+
+char* JsonUnescape( char* into, const char* from, const char* end)
+{
+	while( from < end)
+	{
+		const char* backslash = FindEither( from, end, '\\', '\\');
+		size_t run = backslash - from;
+		bool control = false;
+		for( size_t b = 0; b < run; ++b)
+			control |= (unsigned char) from[ b] < ' ';
+		if( control)
+			sraise( "JSON strings can't hold control characters", nullptr);
+		if( into != from)
+			memmove( into, from, run);
+		into += run;
+		from = backslash;
+		if( from == end)
+			break;
+		if( end - from < 2)
+			sraise( "JSON string ends in a backslash", nullptr);
+		char escape = from[ 1];
+		from += 2;
+		switch( escape)
+		{
+		case '"': *into++ = '"'; break;
+		case '\\': *into++ = '\\'; break;
+		case '/': *into++ = '/'; break;
+		case 'b': *into++ = '\b'; break;
+		case 'f': *into++ = '\f'; break;
+		case 'n': *into++ = '\n'; break;
+		case 'r': *into++ = '\r'; break;
+		case 't': *into++ = '\t'; break;
+		case 'u':
+			{
+				unsigned code = HexDigits( from, end);
+				from += 4;
+				if( code >= 0xDC00 && code <= 0xDFFF)
+					sraise( "JSON \\u escape is half a surrogate pair", nullptr);
+				if( code >= 0xD800 && code <= 0xDBFF)
+				{// Needs the low half right after it
+					if( end - from < 6 || from[ 0] != '\\' || from[ 1] != 'u')
+						sraise( "JSON \\u escape is half a surrogate pair", nullptr);
+					unsigned low = HexDigits( from + 2, end);
+					if( low < 0xDC00 || low > 0xDFFF)
+						sraise( "JSON \\u escape is half a surrogate pair", nullptr);
+					from += 6;
+					code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+				}
+				if( code < 0x80)
+					*into++ = (char) code;
+				else if( code < 0x800)
+				{
+					*into++ = (char) (0xC0 | code >> 6);
+					*into++ = (char) (0x80 | (code & 0x3F));
+				}
+				else if( code < 0x10000)
+				{
+					*into++ = (char) (0xE0 | code >> 12);
+					*into++ = (char) (0x80 | (code >> 6 & 0x3F));
+					*into++ = (char) (0x80 | (code & 0x3F));
+				}
+				else
+				{
+					*into++ = (char) (0xF0 | code >> 18);
+					*into++ = (char) (0x80 | (code >> 12 & 0x3F));
+					*into++ = (char) (0x80 | (code >> 6 & 0x3F));
+					*into++ = (char) (0x80 | (code & 0x3F));
+				}
+			}
+			break;
+		default:
+			sraise( "Unknown JSON escape", "int code", (int) (unsigned char) escape, nullptr);
+		}
+	}
+	return into;
+}
+
+/*
+		Writing
+
+		Every key, value, and container goes through BeforeValue, which puts down the comma and
+		the line break or space ahead of it, unless it follows a key.  Integers are built right
+		in the buffer, two digits at a time from the end.  Strings go out in runs between the
+		bytes that need escaping.
+*/
+static const char kDigitPairs[] =
+	"00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+	"40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static const uint64_t kPowersOfTen[] =
+{
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static const char kEscapes[ 128] =
+{// What goes after the backslash, u for \u00XX, 0 for bytes that go out as they are
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u', 'u',
+	'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+	0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+JsonWriter::JsonWriter( FILE* output, int lineDepth) : iOutput( output), iLineDepth( lineDepth)
+{
+	iBuffer.resize( kBufferSize);
+}
+
+JsonWriter::~JsonWriter()
+{
+	try
+	{// Call Flush first to hear about errors
+		WriteBuffer();
+		fflush( iOutput);
+	}
+	catch( ...)
+	{
+	}
+}
+
+void JsonWriter::WriteBuffer()
+{
+	size_t length = iUsed;
+	iUsed = 0;
+	if( length != 0 && fwrite( &iBuffer[ 0], 1, length, iOutput) != length)
+		TestMsg( -1, "Writing JSON");		// Errors out with errno
+}
+
+void JsonWriter::Flush()
+{
+	WriteBuffer();
+	if( fflush( iOutput) != 0)
+		TestMsg( -1, "Writing JSON");
+}
+
+void JsonWriter::Put( const char* text, size_t length)
+{
+	while( length > 0)
+	{// Pieces that fit
+		size_t room = kBufferSize - iUsed;
+		if( room == 0)
+		{
+			WriteBuffer();
+			room = kBufferSize;
+		}
+		size_t piece = length < room ? length : room;
+		memcpy( &iBuffer[ iUsed], text, piece);
+		iUsed += piece;
+		text += piece;
+		length -= piece;
+	}
+}
+
+void JsonWriter::PutDigits( uint64_t value)
+{
+	char* end = Room( 20) + 20;				// Most digits a uint64_t has
+	char* pos = end;
+	while( value >= 100)
+	{
+		unsigned pair = (unsigned) (value % 100) * 2;
+		value /= 100;
+		*--pos = kDigitPairs[ pair + 1];
+		*--pos = kDigitPairs[ pair];
+	}
+	if( value >= 10)
+	{
+		*--pos = kDigitPairs[ value * 2 + 1];
+		*--pos = kDigitPairs[ value * 2];
+	}
+	else
+		*--pos = (char) ('0' + value);
+	size_t length = end - pos;
+	memmove( &iBuffer[ iUsed], pos, length);
+	iUsed += length;
+}
+
+void JsonWriter::BeforeValue()
+{
+	if( iAfterKey)
+	{
+		iAfterKey = false;
+		return;
+	}
+	if( iDepth == 0)
+		return;
+	if( iNeedComma)
+		Put( ',');
+	if( iDepth <= iLineDepth)
+	{// Its own line, indented a tab for each container it is in
+		char* pos = Room( iDepth + 1);
+		*pos = '\n';
+		memset( pos + 1, '\t', iDepth);
+		iUsed += iDepth + 1;
+	}
+	else if( iNeedComma)
+		Put( ' ');
+}
+
+void JsonWriter::AfterValue()
+{
+	iNeedComma = true;
+	if( iDepth == 0)
+		Put( '\n');
+}
+
+void JsonWriter::Open( char bracket)
+{
+	BeforeValue();
+	Put( bracket);
+	++iDepth;
+	iNeedComma = false;
+}
+
+void JsonWriter::Close( char bracket)
+{
+	if( iDepth == 0 || iAfterKey)
+		sraise( "JSON writer closed a container that isn't open, or right after a key", nullptr);
+	if( iNeedComma && iDepth <= iLineDepth)
+	{// Back out to the indentation of the open
+		char* pos = Room( iDepth);
+		*pos = '\n';
+		memset( pos + 1, '\t', iDepth - 1);
+		iUsed += iDepth;
+	}
+	Put( bracket);
+	--iDepth;
+	AfterValue();
+}
+
+JsonWriter& JsonWriter::BeginObject()
+{
+	Open( '{');
+	return *this;
+}
+
+JsonWriter& JsonWriter::EndObject()
+{
+	Close( '}');
+	return *this;
+}
+
+JsonWriter& JsonWriter::BeginArray()
+{
+	Open( '[');
+	return *this;
+}
+
+JsonWriter& JsonWriter::EndArray()
+{
+	Close( ']');
+	return *this;
+}
+
+JsonWriter& JsonWriter::Key( const char* key)
+{
+	if( iDepth == 0 || iAfterKey)
+		sraise( "JSON writer has a key outside an object, or two in a row", "str key", key, nullptr);
+	String( key);
+	Put( ':');
+	Put( ' ');
+	iAfterKey = true;
+	return *this;
+}
+
+JsonWriter& JsonWriter::String( const char* text)
+{
+	return String( text, strlen( text));
+}
+
+JsonWriter& JsonWriter::String( const char* text, size_t length)
+{
+	BeforeValue();
+	Put( '"');
+	const char* end = text + length;
+	while( text < end)
+	{
+		const char* run = text;
+		while( text < end && ((unsigned char) *text >= 128 || kEscapes[ (unsigned char) *text] == 0))
+			++text;
+		Put( run, text - run);
+		if( text == end)
+			break;
+		unsigned char c = (unsigned char) *text++;
+		char* pos = Room( 6);
+		pos[ 0] = '\\';
+		pos[ 1] = kEscapes[ c];
+		if( pos[ 1] != 'u')
+		{
+			iUsed += 2;
+			continue;
+		}
+		static const char hex[] = "0123456789abcdef";
+		pos[ 2] = '0';
+		pos[ 3] = '0';
+		pos[ 4] = hex[ c >> 4];
+		pos[ 5] = hex[ c & 15];
+		iUsed += 6;
+	}
+	Put( '"');
+	AfterValue();
+	return *this;
+}
+
+JsonWriter& JsonWriter::Int( int64 value)
+{
+	BeforeValue();
+	if( value < 0)
+		Put( '-');
+	PutDigits( value < 0 ? 0 - (uint64_t) value : (uint64_t) value);
+	AfterValue();
+	return *this;
+}
+
+JsonWriter& JsonWriter::Unsigned( uint64_t value)
+{
+	BeforeValue();
+	PutDigits( value);
+	AfterValue();
+	return *this;
+}
+
+JsonWriter& JsonWriter::Number( double value)
+{
+	if( !std::isfinite( value))
+		return Null();
+	if( value == floor( value) && fabs( value) < 9007199254740992.0)
+		return Int( (int64) value);			// Whole, and exact, up to 2^53
+	BeforeValue();
+	char* pos = Room( 32);
+	int length = snprintf( pos, 32, "%.15g", value);
+	if( strtod( pos, nullptr) != value)
+		length = snprintf( pos, 32, "%.17g", value);	// Always enough
+	iUsed += length;
+	AfterValue();
+	return *this;
+}
+
+JsonWriter& JsonWriter::Number( double value, int decimals)
+{
+	if( !std::isfinite( value))
+		return Null();
+	if( decimals < 0)
+		decimals = 0;
+	if( decimals > 9)
+		decimals = 9;
+	double scaled = fabs( value) * kPowersOfTen[ decimals];
+	if( scaled >= 1e13)
+	{// Too big to round exactly as an integer
+		BeforeValue();
+		char* pos = Room( 350);				// Covers DBL_MAX with every decimal
+		iUsed += snprintf( pos, 350, "%.*f", decimals, value);
+		AfterValue();
+		return *this;
+	}
+	uint64_t units = (uint64_t) (scaled + 0.5);
+	BeforeValue();
+	if( value < 0 && units != 0)
+		Put( '-');
+	PutDigits( units / kPowersOfTen[ decimals]);
+	if( decimals > 0)
+	{// Fraction, with its leading zeros
+		char* pos = Room( decimals + 1);
+		*pos = '.';
+		uint64_t fraction = units % kPowersOfTen[ decimals];
+		for( int d = decimals; d > 0; --d)
+		{
+			pos[ d] = (char) ('0' + fraction % 10);
+			fraction /= 10;
+		}
+		iUsed += decimals + 1;
+	}
+	AfterValue();
+	return *this;
+}
+
+JsonWriter& JsonWriter::Bool( bool value)
+{
+	BeforeValue();
+	if( value)
+		Put( "true", 4);
+	else
+		Put( "false", 5);
+	AfterValue();
+	return *this;
+}
+
+JsonWriter& JsonWriter::Null()
+{
+	BeforeValue();
+	Put( "null", 4);
+	AfterValue();
+	return *this;
+}
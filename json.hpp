@@ -0,0 +1,185 @@
+//
+//  json.hpp
+//  quilter
+//
+//  JSON documents, indexed all at once and read on demand, and written as they are built.
+//
+
+#ifndef json_hpp
+#define json_hpp
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "xraise.h"
+
+/*
+		Parse finds every token in one pass, 64 bytes at a time, the way simdjson's first stage
+		does: the brackets, braces, colons, and commas outside strings, and where each string,
+		number, and literal starts.  A second pass over just those checks the grammar, and
+		pairs each open bracket with its close, so a value of any size is skipped in one step,
+		and checks that each number is written the way JSON writes them.  Nothing is converted
+		until it is asked for, numbers when they're read as numbers, and strings, escapes and
+		all, when they're read as strings.  Errors raise, with the offset.
+
+		The document reads the text where it is, which must stay put, and be nul terminated,
+		as a LoadedFile is.  Up to 4GB.
+*/
+enum JsonType
+{
+	kJsonNull = 0,
+	kJsonBool,
+	kJsonNumber,
+	kJsonString,
+	kJsonArray,
+	kJsonObject
+};
+
+class JsonDocument;
+
+class JsonValue
+{// A place in a document, cheap to copy, good as long as the document is
+public:
+	JsonValue() {}
+
+	inline bool Valid() const
+	{// False past the end of an array or object, or for a member that isn't there
+		return iDocument != nullptr;
+	}
+	JsonType Type() const;
+	bool IsNull() const;
+
+	bool Bool() const;						// These raise if it isn't that type
+	double Double() const;
+	int64 Int64() const;					// Also raises if it has a fraction or doesn't fit
+	std::string String() const;				// Unescaped, as UTF-8
+	bool Equals( const char* text) const;	// A string that unescapes to text
+	std::string_view Text() const;			// Exactly as written, strings with their quotes, containers only their first character
+
+	size_t Count() const;					// Elements, or members
+	JsonValue First() const;				// First element, or first member's value
+	JsonValue Next() const;					// Next element or member value after this one
+	JsonValue Key() const;					// Of a member's value, a string
+	JsonValue operator[]( size_t index) const;
+	JsonValue operator[]( const char* key) const;	// First member with that key
+
+	inline size_t Offset() const;			// Of its first character in the text
+
+private:
+	friend class JsonDocument;
+	const JsonDocument* iDocument = nullptr;
+	uint32_t iToken = 0;
+
+	JsonValue( const JsonDocument* document, uint32_t token) : iDocument( document), iToken( token) {}
+	JsonValue At( uint32_t token) const;
+	uint32_t After() const;					// Token past the whole value
+	const char* StringEnd() const;			// The closing quote
+	const char* AtomEnd() const;			// Past the number or literal
+	void Expect( JsonType type, const char* what) const;
+};
+
+class JsonDocument
+{
+public:
+	void Parse( const char* data, size_t length);	// Raises if it isn't one well formed JSON value
+	JsonValue Root() const;
+	inline size_t TokenCount() const
+	{
+		return iTokens.size();
+	}
+	inline const char* Data() const
+	{
+		return iData;
+	}
+
+private:
+	friend class JsonValue;
+	const char* iData = nullptr;
+	size_t iLength = 0;
+	std::vector<uint32_t> iTokens;			// Offset of each token, in order
+	std::vector<uint32_t> iMatch;			// For an open bracket's token, its close's token
+
+	void FindTokens();
+	void CheckGrammar();
+	void Fail( const char* message, size_t offset) const;
+};
+
+inline size_t JsonValue::Offset() const
+{
+	return iDocument->iTokens[ iToken];
+}
+
+//		Unescapes the inside of a string, from just past the open quote to the close quote, into,
+//		which can be from itself, as it never grows.  Returns the end of what it wrote.
+char* JsonUnescape( char* into, const char* from, const char* end);
+
+/*
+		JsonWriter streams a document out as it is built, through a buffer of its own, so a
+		result of any size, like every stitch of a pattern, goes out in a fixed amount of
+		memory.  It puts in the commas, colons, and indentation, and escapes strings.  Integers,
+		and numbers with a fixed count of decimals, are formatted without printf, and round
+		the way printf does, but for the odd exact tie.  JSON has no infinity or NaN, so those
+		come out as null.  Each top level value ends with a newline, so writing several makes
+		JSON lines.
+
+		Containers nested deeper than lineDepth stay on one line, so a dump can have one point
+		per line rather than one number per line.  A lineDepth of 0 puts it all on one line.
+*/
+class JsonWriter
+{
+public:
+	JsonWriter( FILE* output, int lineDepth = INT32_MAX);
+	JsonWriter( const JsonWriter&) = delete;
+	JsonWriter& operator=( const JsonWriter&) = delete;
+	~JsonWriter();								// Flushes, but leaves output open
+
+	JsonWriter& BeginObject();
+	JsonWriter& EndObject();
+	JsonWriter& BeginArray();
+	JsonWriter& EndArray();
+	JsonWriter& Key( const char* key);			// The next value is this member's
+	JsonWriter& String( const char* text);
+	JsonWriter& String( const char* text, size_t length);
+	JsonWriter& Int( int64 value);
+	JsonWriter& Unsigned( uint64_t value);
+	JsonWriter& Number( double value);			// Shortest that reads back the same
+	JsonWriter& Number( double value, int decimals);	// Like %.*f, up to 9 decimals, but never -0
+	JsonWriter& Bool( bool value);
+	JsonWriter& Null();
+
+	void Flush();								// Everything so far goes to output, and is fflush'd
+
+private:
+	static const size_t kBufferSize = 65536;
+	FILE* iOutput;
+	int iLineDepth;
+	int iDepth = 0;							// Containers open
+	bool iNeedComma = false;				// Something is already in the innermost one
+	bool iAfterKey = false;					// The value goes right after the colon
+	std::vector<char> iBuffer;
+	size_t iUsed = 0;
+
+	void BeforeValue();
+	void AfterValue();
+	void Open( char bracket);
+	void Close( char bracket);
+	void WriteBuffer();
+	inline char* Room( size_t length)
+	{// Where length bytes can go, length no more than kBufferSize
+		if( iUsed + length > kBufferSize)
+			WriteBuffer();
+		return &iBuffer[ iUsed];
+	}
+	inline void Put( char c)
+	{
+		*Room( 1) = c;
+		++iUsed;
+	}
+	void Put( const char* text, size_t length);
+	void PutDigits( uint64_t value);
+};
+
+#endif /* json_hpp */
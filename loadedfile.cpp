@@ -0,0 +1,119 @@
+//
+//  loadedfile.cpp
+//  quilter
+//
+
+#include "loadedfile.hpp"
+#include "quilter.h"
+#include "xraise.h"
+#if MACCODE
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#if WINCODE
+#include <io.h>
+#endif
+
+LoadedFile::LoadedFile( const char* filename, Mode mode)
+{
+	Load( filename, mode);
+}
+
+LoadedFile::~LoadedFile()
+{
+	Release();
+}
+
+void LoadedFile::Load( const char* filename, Mode mode)
+{
+	FILE* f = fopen( filename, "rb");
+	if( f == nullptr) TestMsg( -1, filename);		// Errors out with errno
+	try
+	{
+		Load( f, mode);
+	}
+	catch( ...)
+	{
+		fclose( f);
+		throw;
+	}
+	fclose( f);				// A mapping doesn't need it open
+}
+
+void LoadedFile::Load( FILE* f, Mode mode)
+{
+	Release();
+	if( Map( f, mode))
+		return;
+	iSize = ReadFile( f, &iData);
+}
+
+void LoadedFile::Release()
+{
+	if( iMapLength)
+	{
+#if MACCODE
+		munmap( iData, iMapLength);
+#endif
+#if WINCODE
+		UnmapViewOfFile( iData);
+#endif
+	}
+	else
+		free( iData);
+	iData = nullptr;
+	iSize = 0;
+	iMapLength = 0;
+}
+
+bool LoadedFile::Map( FILE* f, Mode mode)
+{
+	if( ftell( f) != 0)
+		return false;		// Someone has read some of it already
+#if MACCODE
+	int fd = fileno( f);
+	struct stat st;
+	if( fstat( fd, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG || st.st_size == 0)
+		return false;
+	size_t size = (size_t) st.st_size;
+	size_t page = (size_t) sysconf( _SC_PAGESIZE);
+	size_t length = (size + 1 + page - 1) / page * page;	// Always room for the nul
+	int protection = mode == kWritable ? PROT_READ | PROT_WRITE : PROT_READ;
+	void* base = mmap( nullptr, length, protection, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if( base == MAP_FAILED)
+		return false;
+	if( mmap( base, size, protection, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+	{// The zeroed pages past the end are what nul terminate it
+		munmap( base, length);
+		return false;
+	}
+	madvise( base, size, MADV_SEQUENTIAL);		// Parsers go front to back
+	iData = (char*) base;
+	iSize = size;
+	iMapLength = length;
+#endif
+#if WINCODE
+	HANDLE file = (HANDLE) _get_osfhandle( _fileno( f));
+	if( file == INVALID_HANDLE_VALUE || GetFileType( file) != FILE_TYPE_DISK)
+		return false;
+	LARGE_INTEGER size;
+	if( !GetFileSizeEx( file, &size) || size.QuadPart == 0)
+		return false;
+	SYSTEM_INFO info;
+	GetSystemInfo( &info);
+	if( size.QuadPart % info.dwPageSize == 0)
+		return false;		// The view ends with the file, no zeroed bytes past the end for the nul
+	HANDLE mapping = CreateFileMappingA( file, nullptr, mode == kWritable ? PAGE_WRITECOPY : PAGE_READONLY, 0, 0, nullptr);
+	if( mapping == nullptr)
+		return false;
+	void* base = MapViewOfFile( mapping, mode == kWritable ? FILE_MAP_COPY : FILE_MAP_READ, 0, 0, 0);
+	CloseHandle( mapping);		// The view keeps the mapping open
+	if( base == nullptr)
+		return false;
+	iData = (char*) base;
+	iSize = (size_t) size.QuadPart;
+	iMapLength = iSize + 1;
+#endif
+	return true;
+}
@@ -0,0 +1,61 @@
+//
+//  loadedfile.hpp
+//  quilter
+//
+//  A whole input file in memory, for the parsers, mapped when it can be.
+//
+
+#ifndef loadedfile_hpp
+#define loadedfile_hpp
+
+#include <stdio.h>
+#include <stddef.h>
+
+/*
+		Regular files are mapped, so loading costs nothing until the parser touches each page.
+		Writable gives a private copy-on-write mapping for the parsers that edit in place, like
+		TinyXml::Initialize, and the file itself never changes.  Pipes, and anything else that
+		can't be mapped, are read into a buffer that doubles as it fills.  Either way the data
+		is nul terminated, and goes away with the LoadedFile.
+*/
+class LoadedFile
+{
+public:
+	enum Mode
+	{
+		kReadOnly = 0,
+		kWritable							// Changes stay in memory
+	};
+
+	LoadedFile() {}
+	LoadedFile( const char* filename, Mode mode = kReadOnly);
+	LoadedFile( const LoadedFile&) = delete;
+	LoadedFile& operator=( const LoadedFile&) = delete;
+	~LoadedFile();
+
+	void Load( const char* filename, Mode mode = kReadOnly);	// Raises if it can't be opened
+	void Load( FILE* f, Mode mode = kReadOnly);				// Maps it if it is a regular file, or reads it to the end
+	void Release();
+
+	inline char* Data() const
+	{// Nul terminated, writable only when loaded kWritable
+		return iData;
+	}
+	inline size_t Size() const
+	{// Not counting the nul
+		return iSize;
+	}
+	inline bool Mapped() const
+	{
+		return iMapLength != 0;
+	}
+
+private:
+	char* iData = nullptr;
+	size_t iSize = 0;
+	size_t iMapLength = 0;					// Non-zero when iData is a mapping rather than malloc'd
+
+	bool Map( FILE* f, Mode mode);			// False if it isn't something we can map
+};
+
+#endif /* loadedfile_hpp */
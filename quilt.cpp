@@ -6,7 +6,22 @@
 //  Copyright © 2025 Jeffrey Lomicka. All rights reserved.
 //
 #include "math.h"
+#include <chrono>
+#include <thread>
 #include "quilt.hpp"
+#include "quilter.h"
+#include "stitchcache.hpp"
+#include "computepool.hpp"
+#include "loadedfile.hpp"
+#include "json.hpp"
+#include <memory>
+#if MACCODE
+#include <unistd.h>
+#endif
+#if WINCODE
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 static bool IsSame( double f1, double f2)
 {// Compare floats for equality, more or less, in inches
@@ -25,6 +40,10 @@ protected:
 	double iScaleFactor = 1.0;		// Scale from UI, needs to be set in constructor
 
 public:
+	virtual ~draw()
+	{
+	}
+
 	void ResetWihtoutJumpStitch()
 	{// Used between objects two avoid generating a jump stitch to subsequent object (I.E., from graph paper)
 		sOldx = MAXFLOAT;
@@ -35,14 +54,26 @@ public:
 	virtual void OpenFile( const char* filename) = 0;
 	// Positions and distances are all in INCHES
 	virtual void SewLine( double x1, double y1, double x2, double y2) = 0;
+	virtual void Flush()
+	{// Whatever has been sewn so far goes out, for output that something is reading as we go
+	}
 	virtual void CloseFile() = 0;
 };
 
+/*
+		IQP files have the pair count up front.  When the output can't seek, a pipe, the count
+		is left as kIqpCountUnknown, and the pairs run to the end of the file.
+*/
+static const float kIqpJumpMarker = 11000.0f;		// An 11000,11000 pair marks the next point as the end of a jump
+static const int kIqpCountUnknown = 0x7FFFFFFC;
+
 class drawIQP : public draw
 {
 	FILE* iqpFile = NULL;
-	long iqpPairCountPos = 0;
+	long iqpPairCountPos = -1;		// Where the count goes, -1 if we can't go back there
 	int iqpPairCount = 0;
+	float iPairs[ 2*4096];			// Written a block at a time
+	int iBuffered = 0;
 
 public:
 	void WriteInt( int i)
@@ -50,10 +81,19 @@ public:
 		fwrite( &i, 4, 1, iqpFile);
 	}
 
-	void WriteFloat( double d)
+	void WritePair( double x, double y)
+	{
+		if( iBuffered == CountItems( iPairs))
+			FlushPairs();
+		iPairs[ iBuffered++] = (float) x;
+		iPairs[ iBuffered++] = (float) y;
+		iqpPairCount++;
+	}
+
+	void FlushPairs()
 	{
-		float f = (float) d;
-		fwrite( &f, 4, 1, iqpFile);
+		fwrite( iPairs, sizeof( float), iBuffered, iqpFile);
+		iBuffered = 0;
 	}
 
 	virtual const char* fileType() override
@@ -63,10 +103,21 @@ public:
 
 	virtual void OpenFile( const char* name) override
 	{// Name needs to be given without file type for now
-		char scrap[ 256];
-		snprintf( scrap, CountItems( scrap), "%s%s", name, fileType());
-		iqpFile = fopen( scrap, "wb");
-		Test( iqpFile);
+		if( name && name[0])
+		{
+			char scrap[ 256];
+			snprintf( scrap, CountItems( scrap), "%s%s", name, fileType());
+			iqpFile = fopen( scrap, "wb");
+			Test( iqpFile);
+		}
+		else
+		{// Standard output, often a pipe
+			iqpFile = stdout;
+#if WINCODE
+			_setmode( _fileno( stdout), _O_BINARY);
+#endif
+			name = "";
+		}
 		fwrite( "StitchV2        ", 16, 1, iqpFile);
 		WriteInt( 0);
 		WriteInt( 0);
@@ -74,20 +125,32 @@ public:
 		WriteInt( strli( name));
 		fwrite( name, strlen( name), 1, iqpFile);
 		WriteInt( 7);
-		iqpPairCountPos = ftell( iqpFile);
-		WriteInt( 0);
+		iqpPairCountPos = ftell( iqpFile);		// -1 for a pipe
+		WriteInt( kIqpCountUnknown);
+	}
+
+	virtual void Flush() override
+	{
+		FlushPairs();
+		fflush( iqpFile);
 	}
 
 	virtual void CloseFile() override
 	{
 		if( iqpFile)
 		{
-			fseek( iqpFile, iqpPairCountPos, SEEK_SET);
-			WriteInt( iqpPairCount*4);
-			fseek( iqpFile, 0, SEEK_END);
-			fclose( iqpFile);
+			FlushPairs();
+			if( iqpPairCountPos >= 0 && fseek( iqpFile, iqpPairCountPos, SEEK_SET) == 0)
+			{// We can go back, so readers that believe the count get the real one
+				WriteInt( iqpPairCount*4);
+				fseek( iqpFile, 0, SEEK_END);
+			}
+			if( iqpFile != stdout)
+				fclose( iqpFile);
+			else
+				fflush( iqpFile);
 			iqpFile = NULL;
-			iqpPairCountPos = 0;
+			iqpPairCountPos = -1;
 			iqpPairCount = 0;
 		}
 	}
@@ -107,16 +170,14 @@ public:
 
 		if( needJump)
 		{
-			WriteFloat( 11000.0);
-			WriteFloat( 11000.0);
-			iqpPairCount++;
-			WriteFloat( x1);
-			WriteFloat( y1);
-			iqpPairCount++;
-		}
-		WriteFloat( x2);
-		WriteFloat( y2);
-		iqpPairCount++;
+			WritePair( kIqpJumpMarker, kIqpJumpMarker);
+			WritePair( x1, y1);
+		}
+		else if( needMove)
+		{// Very first line, it has to start somewhere
+			WritePair( x1, y1);
+		}
+		WritePair( x2, y2);
 	}
 
 };
@@ -146,6 +207,11 @@ public:
 		fprintf( svgFile, "<svg width=\"1800\" height=\"1800\"><g id=\"Quilting\"><path d=\"\n");
 	}
 
+	virtual void Flush() override
+	{
+		fflush( svgFile);
+	}
+
 	virtual void CloseFile() override
 	{
 		fprintf( svgFile, "\" stroke=\"black\" stroke-width=\"1\" fill=\"none\" /></g>SVG not available.</svg>\n");
@@ -223,6 +289,11 @@ public:
 		fprintf( psFile, "%%!PS\n");
 	}
 
+	virtual void Flush() override
+	{
+		fflush( psFile);
+	}
+
 	virtual void CloseFile() override
 	{
 		fprintf( psFile, "showpage\n");
@@ -299,3 +370,1639 @@ public:
 	}
 
 };
+
+/*
+		Every stitch as JSON, one point to a line, with "jump": true on a point that is reached
+		without sewing.  It goes out through a JsonWriter as it is sewn, so a pattern of any
+		size takes the same memory.
+
+			{"points": [{"x": 0.0000, "y": 1.2500}, ...], "count": 1234}
+*/
+class drawJSON : public draw
+{
+	FILE* jsonFile = stdout;
+	std::unique_ptr<JsonWriter> iWriter;
+	size_t iCount = 0;
+	static const int kDecimals = 4;		// A ten thousandth of an inch, better than an IQP float holds
+
+	void WritePoint( double x, double y, bool jump)
+	{
+		iWriter->BeginObject().Key( "x").Number( x, kDecimals).Key( "y").Number( y, kDecimals);
+		if( jump)
+			iWriter->Key( "jump").Bool( true);
+		iWriter->EndObject();
+		++iCount;
+	}
+
+public:
+	virtual const char* fileType() override
+	{
+		return ".json";
+	}
+
+	virtual void OpenFile( const char* name) override
+	{// Name needs to be given without file type for now
+		if( name && name[0])
+		{// Default to stdout if no name given
+			char scrap[ 256];
+			snprintf( scrap, CountItems( scrap), "%s%s", name, fileType());
+			jsonFile = fopen( scrap, "w");
+			Test( jsonFile);
+		}
+		iWriter.reset( new JsonWriter( jsonFile, 2));
+		iWriter->BeginObject().Key( "points").BeginArray();
+		iCount = 0;
+	}
+
+	virtual void Flush() override
+	{
+		iWriter->Flush();
+	}
+
+	virtual void CloseFile() override
+	{
+		if( iWriter)
+		{
+			iWriter->EndArray().Key( "count").Unsigned( iCount).EndObject();
+			iWriter->Flush();
+			iWriter.reset();
+		}
+		if( jsonFile != stdout)
+		{// If we went to a file, close it
+			fclose( jsonFile);
+			jsonFile = stdout;
+		}
+	}
+
+	virtual void SewLine( double x1, double y1, double x2, double y2) override
+	{
+		bool needMove = !IsSame(sOldx, x1) || !IsSame( sOldy, y1);
+		bool needJump = needMove && sOldx != MAXFLOAT;
+		sOldx = x2;
+		sOldy = y2;
+
+		double sf = iScaleFactor;
+		if( needMove)
+			WritePoint( x1 * sf, y1 * sf, needJump);
+		WritePoint( x2 * sf, y2 * sf, false);
+	}
+};
+
+/*
+		Reads an .iqp file, the inverse of drawIQP.  An 11000,11000 pair marks the next
+		point as the target of a jump.
+*/
+void ReadIQPFile( const char* filename, StitchPath &path)
+{
+	LoadedFile iqpFile( filename);
+	const char* buf = iqpFile.Data();
+	size_t len = iqpFile.Size();
+
+	size_t pos = 0;
+	auto readInt = [&]()
+	{// Pulls the next 4 byte integer from the header
+		int i = 0;
+		if( pos + 4 > len)
+			xraise( "IQP file header is truncated", "str file", filename, nullptr);
+		memcpy( &i, &buf[ pos], 4);
+		pos += 4;
+		return i;
+	};
+	if( len < 16 || strncmp( buf, "StitchV2", 8) != 0)
+		xraise( "Not an IQP file", "str file", filename, nullptr);
+	pos = 16;
+	readInt();
+	readInt();
+	readInt();
+	int nameLength = readInt();
+	if( nameLength < 0 || pos + nameLength > len)
+		xraise( "IQP file header is truncated", "str file", filename, nullptr);
+	pos += nameLength;
+	readInt();
+	int countField = readInt();
+	size_t pairsPresent = (len - pos) / 8;
+	size_t pairCount = countField < 0 || countField == kIqpCountUnknown ? pairsPresent : (size_t) countField / 4;
+	if( pairCount > pairsPresent)
+		pairCount = pairsPresent;
+
+	path.reserve( path.size() + pairCount);
+	bool nextIsJump = true;		// The first point is always reached without sewing
+	for( size_t p = 0; p < pairCount; ++p, pos += 8)
+	{// Each x,y pair
+		StitchPoint_t point;
+		memcpy( &point.x, &buf[ pos], 4);
+		memcpy( &point.y, &buf[ pos+4], 4);
+		if( point.x == kIqpJumpMarker && point.y == kIqpJumpMarker)
+		{// Next point is the end of a jump
+			nextIsJump = true;
+			continue;
+		}
+		point.jump = nextIsJump;
+		nextIsJump = false;
+		path.push_back( point);
+	}
+}
+
+/*
+		Sew time simulator
+
+		Each sewn row gets a look-ahead velocity plan: the head stops at both ends of the row,
+		slows for corners according to the junction deviation, and never changes speed faster
+		than the acceleration allows.  A backward pass limits each point by what can still be
+		stopped for ahead, and the forward pass limits it by what can be reached from behind
+		while summing trapezoidal segment times.  Everything is linear in the number of points.
+*/
+static double TrapezoidTime( double d, double v0, double v1, double vmax, double a)
+{// Seconds to travel d inches from speed v0 to speed v1, given both are reachable within d
+	if( d <= 0)
+		return 0;
+	double accelDistance = (vmax*vmax - v0*v0) / (2*a);
+	double decelDistance = (vmax*vmax - v1*v1) / (2*a);
+	if( accelDistance + decelDistance <= d)
+	{// Reaches full speed and cruises
+		return (vmax - v0)/a + (vmax - v1)/a + (d - accelDistance - decelDistance)/vmax;
+	}
+	double peak = sqrt( (2*a*d + v0*v0 + v1*v1) / 2);	// Never gets to full speed
+	return (peak - v0)/a + (peak - v1)/a;
+}
+
+static inline double Distance( const StitchPoint_t &p1, const StitchPoint_t &p2)
+{
+	double dx = p2.x - p1.x;
+	double dy = p2.y - p1.y;
+	return sqrt( dx*dx + dy*dy);
+}
+
+void SimulateSewTime( const StitchPath &path, const MachineModel_t &machine, SimulationResult_t &result, bool wantRows)
+{
+	result = SimulationResult_t();
+	size_t n = path.size();
+	if( n == 0)
+		return;
+	if( machine.acceleration <= 0 || machine.maxSpeed <= 0 || machine.jumpSpeed <= 0
+		|| machine.stitchesPerInch <= 0 || machine.maxStitchRate <= 0)
+		xraise( "Machine speeds, acceleration, and stitch rates must be positive", nullptr);
+
+	double a = machine.acceleration;
+	double vmax = machine.maxSpeed;
+	double regulatorLimit = machine.maxStitchRate / 60.0 / machine.stitchesPerInch;
+	if( regulatorLimit < vmax)
+		vmax = regulatorLimit;		// Regulator can't place stitches any faster than this
+	double vmax2 = vmax*vmax;
+	std::vector<double> v2( n);		// Speed squared allowed at each point
+
+//		Corner limits, zero at the ends of every row
+
+	double ux = 0, uy = 0;			// Direction of the last non-zero segment in this row
+	bool haveDirection = false;
+	for( size_t i = 0; i < n; ++i)
+	{// For each point, limit the speed through it
+		if( path[ i].jump)
+			haveDirection = false;
+		if( i+1 == n || path[ i+1].jump)
+		{// Last point of a row
+			v2[ i] = 0;
+			continue;
+		}
+		double d = Distance( path[ i], path[ i+1]);
+		v2[ i] = path[ i].jump ? 0 : vmax2;
+		if( d == 0)
+			continue;	// Repeated point, the corner is judged at the next real segment
+		double wx = (path[ i+1].x - path[ i].x) / d;
+		double wy = (path[ i+1].y - path[ i].y) / d;
+		if( haveDirection && !path[ i].jump)
+		{// A real corner, junction deviation limits the speed
+			double cosTheta = -(ux*wx + uy*wy);
+			double sinHalfTheta = sqrt( fmax( 0.0, 0.5*(1.0 - cosTheta)));
+			if( sinHalfTheta < 0.999999)
+			{// Not straight ahead
+				double junction2 = a * machine.junctionDeviation * sinHalfTheta / (1.0 - sinHalfTheta);
+				if( junction2 < v2[ i])
+					v2[ i] = junction2;
+			}
+		}
+		ux = wx;
+		uy = wy;
+		haveDirection = true;
+	}
+
+//		Backward pass, we must be able to slow down for what is ahead
+
+	for( size_t i = n-1; i-- > 0;)
+	{
+		if( path[ i+1].jump)
+			continue;
+		double reachable = v2[ i+1] + 2*a*Distance( path[ i], path[ i+1]);
+		if( reachable < v2[ i])
+			v2[ i] = reachable;
+	}
+
+//		Forward pass, limit by what we can reach from behind and add up the time
+
+	SimulatedRow_t row;
+	auto closeRow = [&]()
+	{// Finishes the row ending at the current point
+		if( row.sewnLength > 0)
+			row.sewTime += 2 * machine.tieOffPenalty;
+		result.sewTime += row.sewTime;
+		result.sewnLength += row.sewnLength;
+		result.stitches += row.stitches;
+		if( wantRows)
+			result.rows.push_back( row);
+	};
+	for( size_t i = 1; i < n; ++i)
+	{// For each segment, sewn or jumped
+		double d = Distance( path[ i-1], path[ i]);
+		if( path[ i].jump)
+		{// Jump to a new row, the head is stopped at both ends
+			row.pointCount = i - row.firstPoint;
+			closeRow();
+			row = SimulatedRow_t();
+			row.firstPoint = i;
+			row.jumpLength = d;
+			row.jumpTime = TrapezoidTime( d, 0, 0, machine.jumpSpeed, a) + machine.jumpPenalty;
+			result.jumpLength += d;
+			result.jumpTime += row.jumpTime;
+			++result.jumps;
+			continue;
+		}
+		double reachable = v2[ i-1] + 2*a*d;
+		if( reachable < v2[ i])
+			v2[ i] = reachable;
+		row.sewTime += TrapezoidTime( d, sqrt( v2[ i-1]), sqrt( v2[ i]), vmax, a);
+		row.sewnLength += d;
+		row.stitches += d * machine.stitchesPerInch;
+	}
+	row.pointCount = n - row.firstPoint;
+	closeRow();
+	result.totalTime = result.sewTime + result.jumpTime;
+}
+
+static const char* FormatSeconds( double seconds, char* buf, size_t len)
+{// Seconds as h:mm:ss.s
+	int hours = (int) (seconds / 3600);
+	seconds -= hours * 3600.0;
+	int minutes = (int) (seconds / 60);
+	seconds -= minutes * 60.0;
+	snprintf( buf, len, "%d:%02d:%04.1f", hours, minutes, seconds);
+	return buf;
+}
+
+static double BenchmarkSimulation( const StitchPath &path, const MachineModel_t &machine)
+{// Points per second over repeated runs without the row breakdown, the way an optimizer would call it
+	const int repeats = 20;
+	SimulationResult_t result;
+	auto start = std::chrono::steady_clock::now();
+	for( int r = 0; r < repeats; ++r)
+		SimulateSewTime( path, machine, result, false);
+	double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count();
+	return path.size() * (double) repeats / elapsed;
+}
+
+int SimulateCmd( CommandProc* cur)
+{
+	MachineModel_t machine;
+	bool showRows = false;
+	bool benchmark = false;
+	bool json = false;
+	const char* boolOpts = "rbe";
+	bool* boolValues[] = { &showRows, &benchmark, &json};
+	const char* floatOpts = "sgaimdjt";
+	double* floatValues[] =
+	{
+		&machine.maxSpeed,
+		&machine.jumpSpeed,
+		&machine.acceleration,
+		&machine.stitchesPerInch,
+		&machine.maxStitchRate,
+		&machine.junctionDeviation,
+		&machine.jumpPenalty,
+		&machine.tieOffPenalty
+	};
+	static const char* helps[] =
+	{
+		"Show the breakdown for each row.",
+		"Benchmark, repeat the simulation and report points per second.",
+		"Emit the report as JSON.",
+		"Maximum sewing speed, inches per second.",
+		"Maximum jump speed, inches per second.",
+		"Acceleration, inches per second per second.",
+		"Stitch regulator setting, stitches per inch.",
+		"Maximum stitch rate, stitches per minute.",
+		"Junction deviation, inches, smaller slows more for corners.",
+		"Jump penalty, seconds per jump for trimming and restarting.",
+		"Tie-off penalty, seconds for each tie-off, two per row.",
+		"IQP file to simulate. Estimates sew time."
+	};
+
+	int paramIndex = GetAllOpts(
+		cur->iArgc, cur->iArgv,
+		boolOpts, boolValues,
+		nullptr, nullptr,
+		floatOpts, floatValues,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		"S", helps);
+
+	StitchPath path;
+	ReadIQPFile( cur->iArgv[ paramIndex], path);
+	SimulationResult_t result;
+	SimulateSewTime( path, machine, result, showRows);
+
+	if( json)
+	{// Rows go out as they are written, one to a line
+		JsonWriter out( stdout, 2);
+		out.BeginObject();
+		out.Key( "points").Unsigned( path.size());
+		out.Key( "rows").Int( result.jumps + 1);
+		out.Key( "jumps").Int( result.jumps);
+		out.Key( "sewnInches").Number( result.sewnLength, 2);
+		out.Key( "stitches").Number( result.stitches, 0);
+		out.Key( "jumpInches").Number( result.jumpLength, 2);
+		out.Key( "sewSeconds").Number( result.sewTime, 2);
+		out.Key( "jumpSeconds").Number( result.jumpTime, 2);
+		out.Key( "totalSeconds").Number( result.totalTime, 2);
+		if( showRows)
+		{
+			out.Key( "rowBreakdown").BeginArray();
+			for( const SimulatedRow_t &row : result.rows)
+			{
+				out.BeginObject();
+				out.Key( "firstPoint").Unsigned( row.firstPoint).Key( "points").Unsigned( row.pointCount);
+				out.Key( "sewnInches").Number( row.sewnLength, 2).Key( "stitches").Number( row.stitches, 0);
+				out.Key( "sewSeconds").Number( row.sewTime, 2);
+				out.Key( "jumpInches").Number( row.jumpLength, 2).Key( "jumpSeconds").Number( row.jumpTime, 2);
+				out.EndObject();
+			}
+			out.EndArray();
+		}
+		if( benchmark)
+			out.Key( "pointsPerSecond").Number( BenchmarkSimulation( path, machine), 0);
+		out.EndObject();
+		out.Flush();
+		return cur->iFromCommandLine ? 2 : 0;
+	}
+
+	char t1[ 32], t2[ 32], t3[ 32];
+	if( showRows) for( size_t r = 0; r < result.rows.size(); ++r)
+	{// Per-row breakdown
+		const SimulatedRow_t &row = result.rows[ r];
+		printf( "Row %zu: %zu points, %.1f in, %.0f stitches, sew %s, jump %.1f in %s\n",
+			r+1, row.pointCount, row.sewnLength, row.stitches,
+			FormatSeconds( row.sewTime, t1, sizeof( t1)),
+			row.jumpLength, FormatSeconds( row.jumpTime, t2, sizeof( t2)));
+	}
+	printf( "%zu points in %d rows with %d jumps\n", path.size(), result.jumps + 1, result.jumps);
+	printf( "Sewn %.1f in (%.1f yd of top thread), %.0f stitches, jumped %.1f in\n",
+		result.sewnLength, result.sewnLength / 36.0, result.stitches, result.jumpLength);
+	printf( "Sew time %s, jump time %s, total %s\n",
+		FormatSeconds( result.sewTime, t1, sizeof( t1)),
+		FormatSeconds( result.jumpTime, t2, sizeof( t2)),
+		FormatSeconds( result.totalTime, t3, sizeof( t3)));
+
+	if( benchmark)
+		printf( "Simulated %.2f million points per second\n", BenchmarkSimulation( path, machine) / 1e6);
+	return cur->iFromCommandLine ? 2 : 0;
+}
+
+/*
+		Stitch density
+
+		Each sewn segment is walked cell by cell across the grid (Amanatides and Woo), adding the
+		length that falls inside each cell.  Slices of the path each fill a private grid on the
+		compute pool, and the grids are summed at the end, so there is no locking in the inner loop.
+*/
+static void AccumulateDensity( const StitchPath &path, size_t first, size_t last, DensityGrid_t &grid, float* cells)
+{// Adds segments ending at points first through last-1
+	double inverseCell = 1.0 / grid.cellSize;
+	for( size_t i = first < 1 ? 1 : first; i < last; ++i)
+	{
+		if( path[ i].jump)
+			continue;	// No thread is sewn on a jump
+		double length = Distance( path[ i-1], path[ i]);
+		if( length == 0)
+			continue;
+		double gx0 = (path[ i-1].x - grid.minX) * inverseCell;
+		double gy0 = (path[ i-1].y - grid.minY) * inverseCell;
+		double dx = (path[ i].x - grid.minX) * inverseCell - gx0;
+		double dy = (path[ i].y - grid.minY) * inverseCell - gy0;
+		int column = (int) gx0;
+		int row = (int) gy0;
+		int stepX = dx > 0 ? 1 : -1;
+		int stepY = dy > 0 ? 1 : -1;
+		double tDeltaX = dx != 0 ? fabs( 1.0 / dx) : HUGE_VAL;
+		double tDeltaY = dy != 0 ? fabs( 1.0 / dy) : HUGE_VAL;
+		double tMaxX = dx != 0 ? ((column + (stepX > 0)) - gx0) / dx : HUGE_VAL;
+		double tMaxY = dy != 0 ? ((row + (stepY > 0)) - gy0) / dy : HUGE_VAL;
+		double t = 0;
+		for(;;)
+		{// For each cell the segment crosses
+			double tNext = fmin( fmin( tMaxX, tMaxY), 1.0);
+			int c = column < 0 ? 0 : column >= grid.columns ? grid.columns-1 : column;
+			int r = row < 0 ? 0 : row >= grid.rows ? grid.rows-1 : row;
+			cells[ (size_t) r*grid.columns + c] += (float) ((tNext - t) * length);
+			if( tNext >= 1.0)
+				break;
+			t = tNext;
+			if( tMaxX < tMaxY)
+			{
+				column += stepX;
+				tMaxX += tDeltaX;
+			}
+			else
+			{
+				row += stepY;
+				tMaxY += tDeltaY;
+			}
+		}
+	}
+}
+
+void ComputeStitchDensity( const StitchPath &path, double cellSize, DensityGrid_t &grid, int threadCount)
+{
+	if( cellSize <= 0)
+		xraise( "Density cell size must be positive", nullptr);
+	grid = DensityGrid_t();
+	grid.cellSize = cellSize;
+	if( path.empty())
+		return;
+
+	float minX = path[ 0].x, maxX = path[ 0].x;
+	float minY = path[ 0].y, maxY = path[ 0].y;
+	for( const StitchPoint_t &p : path)
+	{// Bounding box
+		minX = fminf( minX, p.x);
+		maxX = fmaxf( maxX, p.x);
+		minY = fminf( minY, p.y);
+		maxY = fmaxf( maxY, p.y);
+	}
+	grid.minX = minX;
+	grid.minY = minY;
+	double columns = floor( ((double) maxX - minX) / cellSize) + 1;
+	double rows = floor( ((double) maxY - minY) / cellSize) + 1;
+	if( !(columns * rows <= kMaxDensityCells))
+	{// Far flung points or tiny cells would overflow, or take gigabytes, and NaN fails too
+		sraise( "Density grid would be too big, check for stray points or use bigger cells",
+			"int64 columns", (int64) fmin( columns, 1e18), "int64 rows", (int64) fmin( rows, 1e18), nullptr);
+	}
+	grid.columns = (int) columns;
+	grid.rows = (int) rows;
+	size_t cellCount = (size_t) grid.columns * grid.rows;
+	grid.inches.assign( cellCount, 0.0f);
+
+	ComputePool &pool = ComputePool::Current();
+	if( threadCount <= 0)
+		threadCount = pool.Threads();
+	size_t minimumSlice = 65536;	// Not worth a private grid for less than this
+	if( (size_t) threadCount > path.size() / minimumSlice)
+		threadCount = (int) (path.size() / minimumSlice);
+	if( threadCount > kMaxDensityCells / cellCount)
+		threadCount = (int) (kMaxDensityCells / cellCount);	// All the grids together stay under the limit
+	if( threadCount <= 1)
+	{// Small job, do it here
+		AccumulateDensity( path, 0, path.size(), grid, grid.inches.data());
+		return;
+	}
+
+	std::vector<std::vector<float>> partials( threadCount - 1);
+	size_t slice = path.size() / threadCount;
+	pool.ParallelFor( 0, threadCount, 1, [&]( size_t firstSlice, size_t lastSlice)
+	{// Every slice but the first gets a private grid
+		for( size_t t = firstSlice; t < lastSlice; ++t)
+		{
+			size_t first = slice * t;
+			size_t last = t == (size_t) threadCount-1 ? path.size() : first + slice;
+			float* cells = grid.inches.data();
+			if( t > 0)
+			{
+				partials[ t-1].assign( cellCount, 0.0f);
+				cells = partials[ t-1].data();
+			}
+			AccumulateDensity( path, first, last, grid, cells);
+		}
+	});
+	pool.ParallelFor( 0, cellCount, pool.GrainFor( cellCount, 65536), [&]( size_t first, size_t last)
+	{// Merge, each piece of the grid across all the partials
+		float* total = grid.inches.data();
+		for( const std::vector<float> &partial : partials)
+			for( size_t c = first; c < last; ++c)
+				total[ c] += partial[ c];
+	});
+}
+
+/*
+		Heatmap as a binary PPM, one pixel per cell, white through blue up to the density limit,
+		and red beyond it.
+*/
+static void WriteDensityHeatmap( const char* filename, const DensityGrid_t &grid, double maxDensity)
+{
+	FILE* ppm = fopen( filename, "wb");
+	if( ppm == nullptr) TestMsg( -1, filename);
+	fprintf( ppm, "P6\n%d %d\n255\n", grid.columns, grid.rows);
+	std::vector<unsigned char> line( (size_t) grid.columns * 3);
+	for( int row = grid.rows; row-- > 0;)
+	{// Top of the image is the top of the quilt
+		for( int column = 0; column < grid.columns; ++column)
+		{
+			double level = grid.Density( column, row) / maxDensity;
+			unsigned char* pixel = &line[ (size_t) column*3];
+			if( level > 1.0)
+			{// Over the limit
+				pixel[ 0] = 255;
+				pixel[ 1] = 0;
+				pixel[ 2] = 0;
+			}
+			else
+			{
+				unsigned char fade = (unsigned char) (255 * (1.0 - level));
+				pixel[ 0] = fade;
+				pixel[ 1] = fade;
+				pixel[ 2] = 255;
+			}
+		}
+		fwrite( line.data(), 1, line.size(), ppm);
+	}
+	fclose( ppm);
+}
+
+enum RuleKind
+{
+	kRuleDensity = 0,
+	kRuleShortStitch,
+	kRuleLongStitch,
+	kRuleLongJump,
+	kRuleOutOfBounds,
+	kRuleCount
+};
+
+typedef struct RuleViolation
+{
+	size_t index;			// Point index, or cell index for density
+	double x;
+	double y;
+	double value;			// Whatever was measured
+} RuleViolation_t;
+
+int CheckCmd( CommandProc* cur)
+{
+	double cellSize = 0.125;
+	double maxDensity = 30.0;
+	double minStitch = 0.0;
+	double maxStitch = 0.0;
+	double maxJump = 0.0;
+	double quiltWidth = 0.0;
+	double quiltHeight = 0.0;
+	const char* heatmapName = nullptr;
+	int threadCount = 0;
+	int listLimit = 10;
+	bool json = false;
+	const char* boolOpts = "e";
+	bool* boolValues[] = { &json};
+	const char* strOpts = "o";
+	const char** strValues[] = { &heatmapName};
+	const char* floatOpts = "cdnsjxy";
+	double* floatValues[] = { &cellSize, &maxDensity, &minStitch, &maxStitch, &maxJump, &quiltWidth, &quiltHeight};
+	const char* intOpts = "tl";
+	int* intValues[] = { &threadCount, &listLimit};
+	static const char* helps[] =
+	{
+		"Emit the report as JSON.",
+		"Write a density heatmap to this .ppm file.",
+		"Density cell size, inches.",
+		"Maximum thread density, inches per square inch.",
+		"Minimum stitch length, inches, 0 to skip.",
+		"Maximum stitch length, inches, 0 to skip.",
+		"Maximum jump length, inches, 0 to skip.",
+		"Quilt width, inches, centered on the origin, 0 to skip bounds checks.",
+		"Quilt height, inches, centered on the origin, 0 to skip bounds checks.",
+		"Slices for density, 0 for one per pool thread.",
+		"Violations to list of each kind.",
+		"IQP file to check against the design rules."
+	};
+
+	int paramIndex = GetAllOpts(
+		cur->iArgc, cur->iArgv,
+		boolOpts, boolValues,
+		strOpts, strValues,
+		floatOpts, floatValues,
+		intOpts, intValues,
+		nullptr, nullptr,
+		"S", helps);
+
+	auto start = std::chrono::steady_clock::now();
+	StitchPath path;
+	ReadIQPFile( cur->iArgv[ paramIndex], path);
+	DensityGrid_t grid;
+	ComputeStitchDensity( path, cellSize, grid, threadCount);
+
+	std::vector<RuleViolation_t> found[ kRuleCount];
+	size_t counts[ kRuleCount] = {0};
+	auto note = [&]( RuleKind kind, size_t index, double x, double y, double value)
+	{// Count every violation, but only remember the first few
+		if( counts[ kind]++ < (size_t) listLimit)
+			found[ kind].push_back( { index, x, y, value});
+	};
+
+	for( int row = 0; row < grid.rows; ++row) for( int column = 0; column < grid.columns; ++column)
+	{// Density limits
+		double density = grid.Density( column, row);
+		if( density > maxDensity)
+		{// Report the center of the cell
+			note( kRuleDensity, (size_t) row*grid.columns + column,
+				grid.minX + (column + 0.5) * cellSize, grid.minY + (row + 0.5) * cellSize, density);
+		}
+	}
+	for( size_t i = 0; i < path.size(); ++i)
+	{// Stitch, jump, and bounds limits
+		const StitchPoint_t &p = path[ i];
+		if( quiltWidth > 0 && quiltHeight > 0 && (fabs( p.x) > quiltWidth/2 || fabs( p.y) > quiltHeight/2))
+			note( kRuleOutOfBounds, i, p.x, p.y, 0);
+		if( i == 0)
+			continue;
+		double d = Distance( path[ i-1], p);
+		if( p.jump)
+		{
+			if( maxJump > 0 && d > maxJump)
+				note( kRuleLongJump, i, p.x, p.y, d);
+		}
+		else if( minStitch > 0 && d < minStitch)
+			note( kRuleShortStitch, i, p.x, p.y, d);
+		else if( maxStitch > 0 && d > maxStitch)
+			note( kRuleLongStitch, i, p.x, p.y, d);
+	}
+	double elapsed = std::chrono::duration<double>( std::chrono::steady_clock::now() - start).count();
+
+	size_t total = 0;
+	for( int kind = 0; kind < kRuleCount; ++kind)
+		total += counts[ kind];
+	float peak = 0;
+	for( int row = 0; row < grid.rows; ++row) for( int column = 0; column < grid.columns; ++column)
+		peak = fmaxf( peak, grid.Density( column, row));
+
+	if( json)
+	{// Each violation on a line of its own
+		static const char* ruleKeys[ kRuleCount] = { "density", "shortStitch", "longStitch", "longJump", "outOfBounds"};
+		JsonWriter out( stdout, 4);
+		out.BeginObject();
+		out.Key( "points").Unsigned( path.size());
+		out.Key( "columns").Int( grid.columns).Key( "rows").Int( grid.rows);
+		out.Key( "peakDensity").Number( peak, 1);
+		out.Key( "violations").Unsigned( total);
+		out.Key( "checkMs").Number( elapsed * 1000, 1);
+		out.Key( "rules").BeginArray();
+		for( int kind = 0; kind < kRuleCount; ++kind)
+		{
+			out.BeginObject().Key( "rule").String( ruleKeys[ kind]).Key( "count").Unsigned( counts[ kind]);
+			out.Key( "listed").BeginArray();
+			for( const RuleViolation_t &v : found[ kind])
+			{
+				out.BeginObject();
+				if( kind != kRuleDensity)
+					out.Key( "point").Unsigned( v.index);
+				out.Key( "x").Number( v.x, 3).Key( "y").Number( v.y, 3);
+				if( kind == kRuleDensity)
+					out.Key( "density").Number( v.value, 1);
+				else if( kind != kRuleOutOfBounds)
+					out.Key( "length").Number( v.value, 3);
+				out.EndObject();
+			}
+			out.EndArray().EndObject();
+		}
+		out.EndArray().EndObject();
+		out.Flush();
+	}
+	else
+	{
+		static const char* ruleNames[ kRuleCount] =
+		{
+			"Cells over density limit",
+			"Stitches too short",
+			"Stitches too long",
+			"Jumps too long",
+			"Points out of bounds"
+		};
+		for( int kind = 0; kind < kRuleCount; ++kind)
+		{// Summarize each rule
+			if( counts[ kind] == 0)
+				continue;
+			printf( "%s: %zu\n", ruleNames[ kind], counts[ kind]);
+			for( const RuleViolation_t &v : found[ kind])
+			{
+				if( kind == kRuleDensity)
+					printf( "    %.1f in/sq in at %.3f,%.3f\n", v.value, v.x, v.y);
+				else if( kind == kRuleOutOfBounds)
+					printf( "    point %zu at %.3f,%.3f\n", v.index, v.x, v.y);
+				else
+					printf( "    %.3f in ending at point %zu, %.3f,%.3f\n", v.value, v.index, v.x, v.y);
+			}
+		}
+		printf( "%zu points, %d x %d cells, peak density %.1f in/sq in, %zu violations, checked in %.0f ms\n",
+			path.size(), grid.columns, grid.rows, peak, total, elapsed * 1000);
+	}
+
+	if( heatmapName)
+		WriteDensityHeatmap( heatmapName, grid, maxDensity);
+	return cur->iFromCommandLine ? 2 : 0;
+}
+
+static double SteadySeconds()
+{
+	return std::chrono::duration<double>( std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void RenderProgress::Start( int newStage, size_t newTotal)
+{
+	if( cancel.load( std::memory_order_relaxed))
+		sraise( "Render cancelled", nullptr);
+	done = 0;
+	total = newTotal;
+	stageStarted = SteadySeconds();
+	stage = newStage;
+}
+
+void RenderProgress::Update( size_t pointsDone)
+{
+	if( cancel.load( std::memory_order_relaxed))
+		sraise( "Render cancelled", nullptr);
+	done.store( pointsDone, std::memory_order_relaxed);
+}
+
+void RenderProgress::Advance( size_t points)
+{
+	if( cancel.load( std::memory_order_relaxed))
+		sraise( "Render cancelled", nullptr);
+	done.fetch_add( points, std::memory_order_relaxed);
+}
+
+void TransformStitches( const StitchPath &in, const StitchTransform_t &transform, StitchPath &out, RenderProgress_t* progress)
+{
+	double radians = transform.rotation * M_PI / 180.0;
+	double c = cos( radians) * transform.scale;
+	double s = sin( radians) * transform.scale;
+	out.resize( in.size());
+	ComputePool &pool = ComputePool::Current();
+	pool.ParallelFor( 0, in.size(), pool.GrainFor( in.size(), RenderProgress::kStride), [&]( size_t first, size_t last)
+	{
+		for( size_t i = first; i < last; ++i)
+		{
+			if( progress && i > first && (i - first) % RenderProgress::kStride == 0)
+				progress->Advance( RenderProgress::kStride);
+			double x = in[ i].x;
+			double y = in[ i].y;
+			out[ i].x = (float) (x*c - y*s + transform.offsetX);
+			out[ i].y = (float) (x*s + y*c + transform.offsetY);
+			out[ i].jump = in[ i].jump;
+		}
+	});
+}
+
+static bool ClipSegment( double &x0, double &y0, double &x1, double &y1, double halfWidth, double halfHeight, bool &endClipped)
+{// Liang-Barsky against a rectangle centered on the origin, false if nothing is left
+	double t0 = 0, t1 = 1;
+	double dx = x1 - x0, dy = y1 - y0;
+	double p[ 4] = { -dx, dx, -dy, dy};
+	double q[ 4] = { x0 + halfWidth, halfWidth - x0, y0 + halfHeight, halfHeight - y0};
+	for( int edge = 0; edge < 4; ++edge)
+	{
+		if( p[ edge] == 0)
+		{// Parallel to this edge
+			if( q[ edge] < 0)
+				return false;
+			continue;
+		}
+		double t = q[ edge] / p[ edge];
+		if( p[ edge] < 0)
+		{// Entering
+			if( t > t1) return false;
+			if( t > t0) t0 = t;
+		}
+		else
+		{// Leaving
+			if( t < t0) return false;
+			if( t < t1) t1 = t;
+		}
+	}
+	endClipped = t1 < 1;
+	x1 = x0 + t1*dx;
+	y1 = y0 + t1*dy;
+	x0 = x0 + t0*dx;
+	y0 = y0 + t0*dy;
+	return true;
+}
+
+typedef struct ClipPiece
+{// What one slice of the path clips to, put together in order afterwards
+	StitchPath out;
+	bool assumedJump = false;	// The first point out is a jump only because nothing came before it
+	bool touched = false;		// Something in the slice decided whether the next point is a jump
+	bool broken = true;			// What it decided
+} ClipPiece_t;
+
+static void ClipSlice( const StitchPath &in, size_t first, size_t last, double halfWidth, double halfHeight,
+	ClipPiece_t &piece, RenderProgress_t* progress)
+{
+	bool broken = true;		// The next point out has to be reached by a jump
+	bool assumed = true;	// And that is only because we don't know what came before
+	for( size_t i = first; i < last; ++i)
+	{
+		if( progress && i > first && (i - first) % RenderProgress::kStride == 0)
+			progress->Advance( RenderProgress::kStride);
+		if( in[ i].jump)
+		{
+			broken = true;
+			assumed = false;
+			piece.touched = true;
+			continue;
+		}
+		double x0 = in[ i-1].x, y0 = in[ i-1].y;
+		double x1 = in[ i].x, y1 = in[ i].y;
+		bool endClipped = false;
+		if( !ClipSegment( x0, y0, x1, y1, halfWidth, halfHeight, endClipped))
+		{
+			broken = true;
+			assumed = false;
+			piece.touched = true;
+			continue;
+		}
+		if( broken)
+		{
+			if( piece.out.empty())
+				piece.assumedJump = assumed;
+			piece.out.push_back( { (float) x0, (float) y0, 1});
+		}
+		piece.out.push_back( { (float) x1, (float) y1, 0});
+		broken = endClipped;
+		assumed = false;
+		piece.touched = true;
+	}
+	piece.broken = broken;
+}
+
+void ClipStitches( const StitchPath &in, const StitchClip_t &clip, StitchPath &out, RenderProgress_t* progress)
+{// Sewn lines that leave the rectangle are cut, and sewing resumes with a jump where they come back
+	out.clear();
+	if( in.size() < 2)
+		return;
+	double halfWidth = clip.width / 2;
+	double halfHeight = clip.height / 2;
+
+	/*
+			Each slice starts out as if it followed a jump.  When the slice before it actually
+			ended inside the rectangle, that first jump lands on the point already sewn to, and
+			is dropped when the pieces go back together.
+	*/
+	ComputePool &pool = ComputePool::Current();
+	size_t segments = in.size() - 1;
+	size_t grain = pool.GrainFor( segments, 4 * RenderProgress::kStride);
+	std::vector<ClipPiece_t> pieces( (segments + grain - 1) / grain);
+	pool.ParallelFor( 0, pieces.size(), 1, [&]( size_t firstPiece, size_t lastPiece)
+	{
+		for( size_t p = firstPiece; p < lastPiece; ++p)
+		{
+			size_t first = 1 + p * grain;
+			size_t last = first + grain < in.size() ? first + grain : in.size();
+			ClipSlice( in, first, last, halfWidth, halfHeight, pieces[ p], progress);
+		}
+	});
+
+	size_t total = 0;
+	for( const ClipPiece_t &piece : pieces)
+		total += piece.out.size();
+	out.reserve( total);
+	bool broken = true;
+	for( const ClipPiece_t &piece : pieces)
+	{
+		size_t skip = piece.assumedJump && !broken ? 1 : 0;
+		out.insert( out.end(), piece.out.begin() + skip, piece.out.end());
+		if( piece.touched)
+			broken = piece.broken;
+	}
+}
+
+/*
+		Generators, each one fills in a stitch path from its parameters
+*/
+static void GenerateFromIQP( int argc, const char* const argv[], StitchPath &path)
+{
+	if( argc != 1)
+		sraise( "iqp takes one parameter, the file name", nullptr);
+	ReadIQPFile( argv[ 0], path);
+}
+
+static void GenerateGrid( int argc, const char* const argv[], StitchPath &path)
+{// Graph paper, sewn as one serpentine of rows, then one of columns
+	if( argc != 3)
+		sraise( "grid takes three parameters, width, height, and spacing in inches", nullptr);
+	double width = xatof( argv[ 0]);
+	double height = xatof( argv[ 1]);
+	double spacing = xatof( argv[ 2]);
+	if( width <= 0 || height <= 0 || spacing <= 0)
+		sraise( "grid width, height, and spacing must be positive", nullptr);
+	int rows = (int) (height / spacing) + 1;
+	int columns = (int) (width / spacing) + 1;
+	double left = -width/2, bottom = -height/2;
+	path.reserve( path.size() + 2 * (rows + columns));
+	for( int r = 0; r < rows; ++r)
+	{// Left to right, then right to left
+		float y = (float) (bottom + r * spacing);
+		float x1 = (float) (r & 1 ? left + width : left);
+		float x2 = (float) (r & 1 ? left : left + width);
+		path.push_back( { x1, y, r == 0});
+		path.push_back( { x2, y, 0});
+	}
+	for( int c = 0; c < columns; ++c)
+	{// Bottom to top, then top to bottom
+		float x = (float) (left + c * spacing);
+		float y1 = (float) (c & 1 ? bottom + height : bottom);
+		float y2 = (float) (c & 1 ? bottom : bottom + height);
+		path.push_back( { x, y1, c == 0});
+		path.push_back( { x, y2, 0});
+	}
+}
+
+typedef void (*StitchGenerator_t)( int argc, const char* const argv[], StitchPath &path);
+
+static const char* generatorNames[] =
+{
+	"iqp",
+	"grid",
+	nullptr
+};
+static StitchGenerator_t generators[] =
+{
+	GenerateFromIQP,
+	GenerateGrid,
+	nullptr
+};
+
+static draw* NewDrawForFormat( const char* format)
+{// Output backend by name
+	if( strcasecmp( format, "iqp") == 0) return new drawIQP();
+	if( strcasecmp( format, "svg") == 0) return new drawSVG();
+	if( strcasecmp( format, "ps") == 0) return new drawPS();
+	if( strcasecmp( format, "json") == 0) return new drawJSON();
+	sraise( "Output format must be iqp, svg, ps, or json", "str format", format, nullptr);
+	return nullptr;
+}
+
+static void ReplayStitches( const StitchPoint_t* points, size_t count, draw &output, RenderProgress_t* progress)
+{// Feeds a stitch path to an output backend, which works out its own jumps
+	for( size_t i = 1; i < count; ++i)
+	{
+		if( progress && i % RenderProgress::kStride == 0)
+			progress->Update( i);
+		if( !points[ i].jump)
+			output.SewLine( points[ i-1].x, points[ i-1].y, points[ i].x, points[ i].y);
+	}
+}
+
+/*
+		Render pipeline
+
+		Each stage has a key that hashes its own parameters on top of the key of the stage
+		before it, so comparing keys tells exactly which stages a change invalidates.  The
+		session keeps every stage's result, so changing only the scale recomputes the
+		transform and clip from the generated stitches, and changing only the output format
+		just replays the final stitches into the new backend.  The final key is also the
+		stitch cache key.
+*/
+RenderSession::~RenderSession()
+{
+	Clear();
+}
+
+void RenderSession::Clear()
+{
+	for( int stage = 0; stage < kStageCount; ++stage)
+	{
+		iStageValid[ stage] = false;
+		StitchPath().swap( iStage[ stage]);	// Actually release the memory
+	}
+	delete iMapped;
+	iMapped = nullptr;
+	iFinalPoints = nullptr;
+	iFinalCount = 0;
+}
+
+void RunRender( const RenderRequest_t &request, RenderSession &session, RenderReport_t &report)
+{
+	report = RenderReport_t();
+	auto start = std::chrono::steady_clock::now();
+	int g = 0;
+	while( generatorNames[ g] && strcasecmp( generatorNames[ g], request.generator) != 0)
+		++g;
+	if( generatorNames[ g] == nullptr)
+		sraise( "Unknown generator", "str generator", request.generator, nullptr);
+	if( *request.outputName == 0 && strcasecmp( request.format, "iqp") == 0)
+		sraise( "IQP output needs a file name", nullptr);
+	bool clipping = request.clip.width > 0 && request.clip.height > 0;
+
+	uint64_t keys[ kStageCount];
+	StitchCacheKey key;
+	key.Add( generatorNames[ g]);
+	for( int a = 0; a < request.argc; ++a)
+	{// Parameters, and the identity of any file they name
+		key.Add( request.argv[ a]);
+		key.AddFileIdentity( request.argv[ a]);
+	}
+	keys[ kStageGenerate] = key.Value();
+	key.Add( request.transform.scale);
+	key.Add( request.transform.rotation);
+	key.Add( request.transform.offsetX);
+	key.Add( request.transform.offsetY);
+	keys[ kStageTransform] = key.Value();
+	key.Add( clipping ? request.clip.width : 0.0);
+	key.Add( clipping ? request.clip.height : 0.0);
+	keys[ kStageClip] = key.Value();
+
+	int first = 0;		// First stage that has to be recomputed
+	while( first < kStageCount && session.iStageValid[ first] && session.iStageKey[ first] == keys[ first])
+		++first;
+	for( int stage = first; stage < kStageCount; ++stage)
+		session.iStageValid[ stage] = false;
+	RenderProgress_t* progress = request.progress;
+
+	if( first == kStageGenerate && request.useCache)
+	{// Nothing in memory to start from, the final stitches may be on disk
+		if( session.iMapped == nullptr)
+			session.iMapped = new MappedStitchPath();
+		if( StitchCacheLookup( key, *session.iMapped))
+		{// Skip every stage, only the final one is valid
+			StitchPath().swap( session.iStage[ kStageGenerate]);
+			StitchPath().swap( session.iStage[ kStageTransform]);
+			session.iStageKey[ kStageClip] = keys[ kStageClip];
+			session.iStageValid[ kStageClip] = true;
+			session.iFinalPoints = session.iMapped->Points();
+			session.iFinalCount = session.iMapped->Count();
+			report.fromCache = true;
+			first = kStageCount;
+		}
+	}
+	if( first < kStageCount)
+	{// Recompute from here on
+		delete session.iMapped;
+		session.iMapped = nullptr;
+		for( int stage = first; stage < kStageCount; ++stage)
+		{
+			StitchPath &result = session.iStage[ stage];
+			if( progress)
+				progress->Start( stage, stage == kStageGenerate ? 0 : session.iStage[ stage - 1].size());
+			switch( stage)
+			{
+			case kStageGenerate:
+				result.clear();
+				(generators[ g])( request.argc, request.argv, result);
+				break;
+			case kStageTransform:
+				TransformStitches( session.iStage[ kStageGenerate], request.transform, result, progress);
+				break;
+			case kStageClip:
+				if( clipping)
+					ClipStitches( session.iStage[ kStageTransform], request.clip, result, progress);
+				else
+					StitchPath().swap( result);	// Final stitches are the transform's
+				break;
+			}
+			session.iStageKey[ stage] = keys[ stage];
+			session.iStageValid[ stage] = true;
+			report.computed[ stage] = true;
+		}
+		const StitchPath &final = session.iStage[ clipping ? kStageClip : kStageTransform];
+		session.iFinalPoints = final.data();
+		session.iFinalCount = final.size();
+		if( request.useCache)
+			StitchCacheStore( key, session.iFinalPoints, session.iFinalCount);
+	}
+	report.points = session.iFinalCount;
+	auto geometryDone = std::chrono::steady_clock::now();
+	report.geometryTime = std::chrono::duration<double>( geometryDone - start).count();
+
+	if( progress)
+		progress->Start( kStageCount, session.iFinalCount);
+	draw* output = NewDrawForFormat( request.format);
+	try
+	{
+		output->OpenFile( request.outputName);
+		ReplayStitches( session.iFinalPoints, session.iFinalCount, *output, progress);
+		output->CloseFile();
+	}
+	catch( ...)
+	{
+		delete output;
+		throw;
+	}
+	delete output;
+	report.outputTime = std::chrono::duration<double>( std::chrono::steady_clock::now() - geometryDone).count();
+}
+
+static RenderSession sRenderSession;	// The interactive session
+static RenderSession* sCurrentSession = &sRenderSession;
+
+RenderSession* UseRenderSession( RenderSession* session)
+{
+	RenderSession* previous = sCurrentSession;
+	sCurrentSession = session ? session : &sRenderSession;
+	return previous;
+}
+
+/*
+		A render running on its own thread, so the prompt and other activities carry on.  It
+		has its own session, prints progress on a timer, and is cancelled by setting the
+		progress cancel flag, which the render checks as it goes.
+*/
+class BackgroundRender : public AsyncHelper
+{
+public:
+	std::string iGenerator;					// Our own copies of everything the request points to
+	std::vector<std::string> iArgs;
+	std::vector<const char*> iArgv;
+	std::string iFormat;
+	std::string iOutputName;
+	RenderRequest_t iRequest;
+	RenderSession iSession;
+	RenderReport_t iReport;
+	RenderProgress_t iProgress;
+	double iProgressInterval;				// Seconds between progress reports, 0 for none
+	std::thread iThread;
+	std::atomic<bool> iDone{ false};
+	std::string iError;
+	int iNumber;
+	double iStarted;
+
+	BackgroundRender( const RenderRequest_t &request, double progressInterval)
+	:
+		iGenerator( request.generator),
+		iFormat( request.format),
+		iOutputName( request.outputName),
+		iRequest( request),
+		iProgressInterval( progressInterval)
+	{
+		static int sRenderCount = 0;
+		iNumber = ++sRenderCount;
+		for( int a = 0; a < request.argc; ++a)
+			iArgs.push_back( request.argv[ a]);
+		for( std::string &arg : iArgs)
+			iArgv.push_back( arg.c_str());
+		iRequest.generator = iGenerator.c_str();
+		iRequest.argv = iArgv.data();
+		iRequest.format = iFormat.c_str();
+		iRequest.outputName = iOutputName.c_str();
+		iRequest.progress = &iProgress;
+	}
+
+	void Startup() override
+	{
+		GetDefaultValue( StitchCacheMegabytes);		// Defaults are filled in lazily, do it before there are threads
+		iStarted = SteadySeconds();
+		iThread = std::thread( [this]()
+		{
+			try
+			{
+				RunRender( iRequest, iSession, iReport);
+			}
+			catch( std::exception& err)
+			{
+				iError = err.what();
+			}
+			catch( ...)
+			{
+				iError = "Don't know why it failed";
+			}
+			iDone = true;
+			SignalReady();
+		});
+		if( iProgressInterval > 0)
+			ScheduleExecute( iProgressInterval, iProgressInterval);
+	}
+
+	const char* Description() override
+	{// Where it is right now
+		static const char* stageNames[ kStageCount + 1] = { "generate", "transform", "clip", "output"};
+		int stage = iProgress.stage;
+		size_t done = iProgress.done;
+		size_t total = iProgress.total;
+		double elapsed = SteadySeconds() - iProgress.stageStarted;
+		double rate = elapsed > 0 ? done / elapsed : 0;
+		int length = snprintf( iDescription, sizeof( iDescription), "Render %d, %s %s, %s", iNumber,
+			iGenerator.c_str(), iOutputName.empty() ? "to standard output" : iOutputName.c_str(), stageNames[ stage]);
+		if( total > 0 && length < (int) sizeof( iDescription))
+		{// Percent, speed, and time left, for this stage
+			char left[ 32];
+			snprintf( iDescription + length, sizeof( iDescription) - length, " %.0f%%, %.2f million stitches per second, %s left",
+				100.0 * done / total, rate / 1e6, rate > 0 ? FormatSeconds( (total - done) / rate, left, sizeof( left)) : "unknown");
+		}
+		return iDescription;
+	}
+
+	bool Cancel() override
+	{
+		iProgress.cancel = true;
+		return true;
+	}
+
+	void Execute() override
+	{
+		if( !iDone)
+		{// Timer went off
+			Printf( "%s\n", Description());
+			return;
+		}
+		iThread.join();
+		CancelExecute();
+		double elapsed = SteadySeconds() - iStarted;
+		if( iProgress.cancel)
+			Printf( "Render %d cancelled\n", iNumber);
+		else if( !iError.empty())
+			Printf( "Render %d failed: %s\n", iNumber, iError.c_str());
+		else
+			Printf( "Render %d done, %zu points in %.2f seconds\n", iNumber, iReport.points, elapsed);
+		iFinished = true;
+	}
+
+	void Shutdown() override
+	{// Quitting or removed, stop as soon as it can
+		iProgress.cancel = true;
+		if( iThread.joinable())
+			iThread.join();
+	}
+
+	~BackgroundRender()
+	{
+		Shutdown();
+	}
+};
+
+int RenderCmd( CommandProc* cur)
+{
+	RenderRequest_t request;
+	bool background = false;
+	bool jsonReport = false;
+	double progressInterval = 5;
+	const char* boolOpts = "bce";
+	bool* boolValues[] = { &background, &request.useCache, &jsonReport};
+	const char* strOpts = "fo";
+	const char** strValues[] = { &request.format, &request.outputName};
+	const char* floatOpts = "psrxyWH";
+	double* floatValues[] =
+	{
+		&progressInterval,
+		&request.transform.scale,
+		&request.transform.rotation,
+		&request.transform.offsetX,
+		&request.transform.offsetY,
+		&request.clip.width,
+		&request.clip.height
+	};
+	static const char* helps[] =
+	{
+		"Run in the background, see list and cancel.",
+		"Use the stitch cache.",
+		"Emit the report as JSON.",
+		"Output format, iqp, svg, ps, or json.",
+		"Output file name without type, svg, ps, and json default to standard output.",
+		"Seconds between progress reports in the background, 0 for none.",
+		"Scale factor.",
+		"Rotation, degrees counterclockwise.",
+		"Horizontal offset, inches.",
+		"Vertical offset, inches.",
+		"Clip width, inches, centered on the origin, 0 for no clipping.",
+		"Clip height, inches, centered on the origin, 0 for no clipping.",
+		"Generator, iqp <file> or grid <width> <height> <spacing>.",
+		"Generator parameters."
+	};
+
+	int paramIndex = GetAllOpts(
+		cur->iArgc, cur->iArgv,
+		boolOpts, boolValues,
+		strOpts, strValues,
+		floatOpts, floatValues,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		"S.", helps);
+
+	request.generator = cur->iArgv[ paramIndex];
+	request.argc = cur->iArgc - paramIndex - 1;
+	request.argv = &cur->iArgv[ paramIndex + 1];
+	if( background && !cur->iFromCommandLine)
+	{// From the shell there is no prompt to get back to, so it just runs
+		if( *request.outputName == 0)
+			sraise( "Background renders need an output file name", nullptr);
+		BackgroundRender* render = new BackgroundRender( request, progressInterval);
+		render->Startup();
+		AddActivity( render);
+		printf( "Render %d started\n", render->iNumber);
+		return 0;
+	}
+	RenderReport_t report;
+	RunRender( request, *sCurrentSession, report);
+
+	static const char* stageNames[ kStageCount] = { "generate", "transform", "clip"};
+	FILE* output = *request.outputName ? stdout : stderr;	// Don't mix the report into the drawing
+	if( jsonReport)
+	{
+		JsonWriter json( output);
+		json.BeginObject().Key( "points").Unsigned( report.points).Key( "computed").BeginArray();
+		for( int stage = 0; stage < kStageCount; ++stage)
+		{
+			if( report.computed[ stage])
+				json.String( stageNames[ stage]);
+		}
+		json.EndArray().Key( "fromCache").Bool( report.fromCache);
+		json.Key( "geometryMs").Number( report.geometryTime * 1000, 1);
+		json.Key( "outputMs").Number( report.outputTime * 1000, 1).EndObject();
+		json.Flush();
+		return cur->iFromCommandLine ? 2 : 0;
+	}
+	std::string computed;
+	for( int stage = 0; stage < kStageCount; ++stage)
+	{// Which stages actually ran
+		if( !report.computed[ stage])
+			continue;
+		if( !computed.empty())
+			computed += ", ";
+		computed += stageNames[ stage];
+	}
+	if( computed.empty())
+		computed = report.fromCache ? "nothing, from stitch cache" : "nothing, reused";
+	fprintf( output, "Rendered %zu points, computed %s in %.1f ms, output in %.1f ms\n",
+		report.points, computed.c_str(), report.geometryTime * 1000, report.outputTime * 1000);
+	return cur->iFromCommandLine ? 2 : 0;
+}
+
+/*
+		Streaming render
+
+		Points are read into a block of at most kStreamBlock, which goes through the transform
+		and clip stages and out before the next is read.  Each block starts with the last point
+		of the one before it, so the stages see every segment, including the ones that cross
+		from one block to the next.  A block goes out as soon as whatever has arrived is
+		parsed, so a slow writer, like a tablet, sees its points come out as it goes.
+*/
+static const size_t kStreamBlock = 65536;
+
+class StitchSource
+{// Raw points from a file, FIFO, or standard input
+	int iFd;
+	bool iBinary;
+	std::vector<char> iBuffer;
+	size_t iHave = 0;				// Bytes in iBuffer
+	size_t iUsed = 0;				// Bytes already turned into points
+	LineAssembler iLines;			// Text is read straight into it
+	size_t iLineNumber = 0;
+	bool iNextIsJump = true;		// The first point is always reached without sewing
+	bool iAtEnd = false;
+
+	long ReadSome( char* into, size_t room)
+	{// Whatever is available, waiting for at least some, 0 at the end
+		long got;
+		do
+			got = (long) read( iFd, into, room);
+		while( got < 0 && errno == EINTR);
+		if( got < 0)
+			TestMsg( -1, "Reading points");
+		if( got == 0)
+			iAtEnd = true;
+		return got;
+	}
+
+	bool Fill()
+	{// Binary, false at the end
+		if( iAtEnd)
+			return false;
+		if( iUsed > 0)
+		{// A partial pair slides down
+			memmove( iBuffer.data(), iBuffer.data() + iUsed, iHave - iUsed);
+			iHave -= iUsed;
+			iUsed = 0;
+		}
+		iHave += ReadSome( iBuffer.data() + iHave, iBuffer.size() - iHave);
+		return !iAtEnd;
+	}
+
+	bool FillLines()
+	{// Text, false at the end
+		static const size_t kChunk = 65536;
+		if( iAtEnd)
+			return false;
+		iLines.Added( ReadSome( iLines.Room( kChunk), kChunk));
+		return !iAtEnd;
+	}
+
+	void AddPoint( StitchPath &block, double x, double y)
+	{
+		block.push_back( { (float) x, (float) y, iNextIsJump});
+		iNextIsJump = false;
+	}
+
+	void ParseLine( std::string_view line, StitchPath &block)
+	{// x,y or x y, a blank line means the next point is reached by a jump, # starts a comment
+		++iLineNumber;
+		const char* p = line.data();		// Nul terminated where it sits
+		while( *p == ' ' || *p == '\t') ++p;
+		if( *p == 0)
+		{
+			iNextIsJump = true;
+			return;
+		}
+		if( *p == '#')
+			return;
+		char* end;
+		double x = strtod( p, &end);
+		if( end == p)
+			sraise( "Expected x,y", "int line", (int) iLineNumber, "str text", line.data(), nullptr);
+		p = end;
+		while( *p == ' ' || *p == '\t') ++p;
+		if( *p == ',')
+			++p;
+		double y = strtod( p, &end);
+		if( end == p)
+			sraise( "Expected x,y", "int line", (int) iLineNumber, "str text", line.data(), nullptr);
+		AddPoint( block, x, y);
+	}
+
+public:
+	StitchSource( int fd, bool binary)
+	:
+		iFd( fd), iBinary( binary), iBuffer( binary ? 65536 : 0)
+	{
+	}
+
+	size_t Read( StitchPath &block, size_t limit)
+	{// Appends up to limit points, stopping early when no more have arrived yet, 0 at the end
+		size_t start = block.size();
+		if( iBinary)
+		{
+			for(;;)
+			{
+				while( iHave - iUsed >= 8 && block.size() - start < limit)
+				{// Each x,y pair
+					float xy[ 2];
+					memcpy( xy, &iBuffer[ iUsed], 8);
+					iUsed += 8;
+					if( xy[ 0] == kIqpJumpMarker && xy[ 1] == kIqpJumpMarker)
+						iNextIsJump = true;
+					else
+						AddPoint( block, xy[ 0], xy[ 1]);
+				}
+				if( block.size() > start || !Fill())
+					return block.size() - start;	// A partial pair at the very end is dropped
+			}
+		}
+		std::string_view line;
+		for(;;)
+		{
+			while( block.size() - start < limit && iLines.NextLine( line))
+				ParseLine( line, block);
+			if( block.size() > start)
+				return block.size() - start;
+			if( !FillLines())
+			{// The last line may not have a line end
+				if( iLines.TakeRest( line))
+					ParseLine( line, block);
+				return block.size() - start;
+			}
+		}
+	}
+};
+
+void RunStream( const StreamRequest_t &request, StreamReport_t &report)
+{
+	report = StreamReport_t();
+	double started = SteadySeconds();
+	bool clipping = request.clip.width > 0 && request.clip.height > 0;
+	double halfWidth = request.clip.width / 2;
+	double halfHeight = request.clip.height / 2;
+
+	FILE* inputFile = nullptr;
+	int fd = 0;
+	if( strcmp( request.input, "-") != 0)
+	{
+		inputFile = fopen( request.input, "rb");
+		if( inputFile == nullptr) TestMsg( -1, request.input);		// Errors out with errno
+		fd = fileno( inputFile);
+	}
+	else
+	{
+#if WINCODE
+		_setmode( _fileno( stdin), _O_BINARY);
+#endif
+		fd = fileno( stdin);
+	}
+	draw* output = nullptr;
+	try
+	{
+		StitchSource source( fd, request.binary);
+		output = NewDrawForFormat( request.format);
+		output->OpenFile( request.outputName);
+
+		StitchPath raw, moved, final;		// Each holds one block, plus the point carried over
+		bool carried = false;				// raw[ 0] is the last point of the block before
+		StitchPoint_t lastOut = {};			// Last point that went out, starts final
+		bool haveOut = false;
+		bool broken = true;					// Clipping left the next point out needing a jump
+		raw.reserve( kStreamBlock + 1);
+		for(;;)
+		{
+			raw.resize( carried ? 1 : 0);
+			size_t got = source.Read( raw, kStreamBlock);
+			if( got == 0)
+				break;
+			report.pointsIn += got;
+			report.blocks++;
+			TransformStitches( raw, request.transform, moved);
+
+			size_t first = carried ? 1 : 0;	// First point of moved that hasn't gone out
+			final.clear();
+			if( haveOut)
+				final.push_back( lastOut);
+			if( clipping)
+			{// Same as ClipStitches, with the block before as the slice before
+				ClipPiece_t piece;
+				ClipSlice( moved, 1, moved.size(), halfWidth, halfHeight, piece, nullptr);
+				size_t skip = piece.assumedJump && !broken ? 1 : 0;
+				final.insert( final.end(), piece.out.begin() + skip, piece.out.end());
+				if( piece.touched)
+					broken = piece.broken;
+			}
+			else
+				final.insert( final.end(), moved.begin() + first, moved.end());
+			report.pointsOut += final.size() - (haveOut ? 1 : 0);
+			ReplayStitches( final.data(), final.size(), *output, nullptr);
+			output->Flush();
+			if( !final.empty())
+			{
+				lastOut = final.back();
+				haveOut = true;
+			}
+			raw[ 0] = raw.back();
+			carried = true;
+		}
+		output->CloseFile();
+	}
+	catch( ...)
+	{
+		delete output;
+		if( inputFile)
+			fclose( inputFile);
+		throw;
+	}
+	delete output;
+	if( inputFile)
+		fclose( inputFile);
+	report.seconds = SteadySeconds() - started;
+}
+
+int StreamCmd( CommandProc* cur)
+{
+	StreamRequest_t request;
+	const char* boolOpts = "b";
+	bool* boolValues[] = { &request.binary};
+	const char* strOpts = "fo";
+	const char** strValues[] = { &request.format, &request.outputName};
+	const char* floatOpts = "srxyWH";
+	double* floatValues[] =
+	{
+		&request.transform.scale,
+		&request.transform.rotation,
+		&request.transform.offsetX,
+		&request.transform.offsetY,
+		&request.clip.width,
+		&request.clip.height
+	};
+	static const char* helps[] =
+	{
+		"Binary input, float x,y pairs as in an IQP file, 11000,11000 before a jump.",
+		"Output format, iqp, svg, ps, or json.",
+		"Output file name without type, default is standard output.",
+		"Scale factor.",
+		"Rotation, degrees counterclockwise.",
+		"Horizontal offset, inches.",
+		"Vertical offset, inches.",
+		"Clip width, inches, centered on the origin, 0 for no clipping.",
+		"Clip height, inches, centered on the origin, 0 for no clipping.",
+		"Input file or FIFO, - for standard input.  Text input is a line of x,y per point, a blank line before a jump."
+	};
+
+	int paramIndex = GetAllOpts(
+		cur->iArgc, cur->iArgv,
+		boolOpts, boolValues,
+		strOpts, strValues,
+		floatOpts, floatValues,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		"S", helps);
+
+	request.input = cur->iArgv[ paramIndex];
+	if( strcmp( request.input, "-") == 0 && !cur->iFromCommandLine)
+		sraise( "Standard input is only for streams started from the shell", nullptr);
+	if( *request.outputName == 0 && strcasecmp( request.format, "iqp") == 0 && !cur->iFromCommandLine)
+		sraise( "IQP output needs a file name, unless it is going to a pipe from the shell", nullptr);
+	StreamReport_t report;
+	RunStream( request, report);
+
+	FILE* output = *request.outputName ? stdout : stderr;	// Don't mix the report into the drawing
+	fprintf( output, "Streamed %zu points, %zu out, in %zu blocks, %.2f seconds, %.1f million points per minute\n",
+		report.pointsIn, report.pointsOut, report.blocks, report.seconds,
+		report.seconds > 0 ? report.pointsIn / report.seconds * 60 / 1e6 : 0.0);
+	return cur->iFromCommandLine ? 2 : 0;
+}
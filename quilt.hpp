@@ -10,6 +10,208 @@
 #define quilt_hpp
 
 #include <stdio.h>
+#include <vector>
+#include <stdint.h>
+#include <atomic>
 #include "ConsoleThings.h"
 
+/*
+		A stitch path is the in-memory form of a stitch stream.  Positions are in inches,
+		and each point is either sewn to from the point before it, or reached by a jump.
+*/
+typedef struct StitchPoint
+{
+	float x;
+	float y;
+	int jump;			// Non-zero if the needle travels here without sewing (includes the first point)
+} StitchPoint_t;
+
+typedef std::vector<StitchPoint_t> StitchPath;
+
+void ReadIQPFile( const char* filename, StitchPath &path);	// Appends the stitches from an .iqp file
+
+typedef struct StitchTransform
+{// Applied in this order: scale, rotate about the origin, then offset
+	double scale = 1.0;
+	double rotation = 0.0;				// Degrees counterclockwise
+	double offsetX = 0.0;				// Inches
+	double offsetY = 0.0;
+} StitchTransform_t;
+
+typedef struct RenderProgress RenderProgress_t;
+
+void TransformStitches( const StitchPath &in, const StitchTransform_t &transform, StitchPath &out, RenderProgress_t* progress = nullptr);
+
+typedef struct StitchClip
+{// Rectangle centered on the origin, no clipping unless both are positive
+	double width = 0.0;					// Inches
+	double height = 0.0;
+} StitchClip_t;
+
+void ClipStitches( const StitchPath &in, const StitchClip_t &clip, StitchPath &out, RenderProgress_t* progress = nullptr);
+
+/*
+		Machine model for the sew time simulator.  Defaults are a typical stitch-regulated longarm.
+*/
+typedef struct MachineModel
+{
+	double maxSpeed = 15.0;				// Head speed limit while sewing, inches per second
+	double jumpSpeed = 25.0;			// Head speed limit while jumping, inches per second
+	double acceleration = 60.0;			// Inches per second per second, both speeding up and slowing down
+	double stitchesPerInch = 10.0;		// Stitch regulator setting
+	double maxStitchRate = 2400.0;		// Needle limit, stitches per minute
+	double junctionDeviation = 0.02;	// Inches, how tightly the head must follow a corner
+	double jumpPenalty = 4.0;			// Seconds for needle up, trim, and restart on each jump
+	double tieOffPenalty = 1.5;			// Seconds for each tie-off, one at each end of a sewn row
+} MachineModel_t;
+
+typedef struct SimulatedRow
+{// One continuous sewn run, from a jump (or the start) to the next jump (or the end)
+	size_t firstPoint = 0;				// Index into the stitch path
+	size_t pointCount = 0;
+	double sewnLength = 0;				// Inches
+	double stitches = 0;				// Stitches placed by the regulator
+	double sewTime = 0;					// Seconds, including this row's tie-offs
+	double jumpLength = 0;				// Inches travelled by the jump that reached this row
+	double jumpTime = 0;				// Seconds for that jump, including the jump penalty
+} SimulatedRow_t;
+
+typedef struct SimulationResult
+{
+	double totalTime = 0;				// Seconds
+	double sewTime = 0;					// Seconds spent sewing, including tie-offs
+	double jumpTime = 0;				// Seconds spent jumping, including penalties
+	double sewnLength = 0;				// Inches of sewn path, also inches of top thread
+	double jumpLength = 0;				// Inches travelled without sewing
+	double stitches = 0;
+	int jumps = 0;
+	std::vector<SimulatedRow_t> rows;	// Only filled in when requested
+} SimulationResult_t;
+
+//		Fast enough to use as an objective function.  Pass wantRows false to skip the per-row breakdown.
+void SimulateSewTime( const StitchPath &path, const MachineModel_t &machine, SimulationResult_t &result, bool wantRows = true);
+
+/*
+		Design rule checking, thread density is in inches of thread per square inch of quilt
+*/
+typedef struct DensityGrid
+{
+	double minX = 0;					// Lower left corner of cell 0,0 in inches
+	double minY = 0;
+	double cellSize = 0.125;			// Inches on a side
+	int columns = 0;
+	int rows = 0;
+	std::vector<float> inches;			// Inches of thread sewn in each cell, row major from minY
+
+	inline float Density( int column, int row) const
+	{// Inches per square inch
+		return (float) (inches[ (size_t) row*columns + column] / (cellSize * cellSize));
+	}
+} DensityGrid_t;
+
+//		Bins every sewn segment by the length that falls in each cell, in up to threadCount slices on the compute pool.
+//		Raises, rather than allocating, if the path's bounding box needs more than kMaxDensityCells cells.  Every slice
+//		after the first has a private grid, so there are only as many slices as fit in kMaxDensityCells cells in all.
+static const double kMaxDensityCells = 8388608;		// 32MB of cells, a 150 inch quilt at 1/16 inch cells is under 6M
+void ComputeStitchDensity( const StitchPath &path, double cellSize, DensityGrid_t &grid, int threadCount = 0);
+
+/*
+		Rendering runs a generator and then the transform, clip, and output stages
+*/
+enum RenderStage
+{
+	kStageGenerate = 0,
+	kStageTransform,
+	kStageClip,
+	kStageCount							// Output always runs
+};
+
+struct RenderProgress
+{// Shared between a render on a worker thread and whoever is watching it
+	std::atomic<int> stage{ kStageGenerate};	// kStageCount while writing the output
+	std::atomic<size_t> done{ 0};				// Points through the current stage so far
+	std::atomic<size_t> total{ 0};				// Points the current stage will go through, 0 if unknown
+	std::atomic<double> stageStarted{ 0};		// Seconds on the steady clock
+	std::atomic<bool> cancel{ false};			// Set from any thread, the render raises at its next check
+
+	static const size_t kStride = 16384;		// Points between checks in inner loops
+	void Start( int newStage, size_t newTotal);	// Raises if cancelled
+	void Update( size_t pointsDone);			// Raises if cancelled
+	void Advance( size_t points);				// Same, for stages split across threads
+};
+
+typedef struct RenderRequest
+{
+	const char* generator = nullptr;
+	int argc = 0;						// Generator parameters
+	const char* const* argv = nullptr;
+	StitchTransform_t transform;
+	StitchClip_t clip;
+	const char* format = "svg";			// iqp, svg, ps, or json
+	const char* outputName = "";		// Without file type, empty for standard output
+	bool useCache = true;				// The on-disk stitch cache
+	RenderProgress_t* progress = nullptr;	// Optional, for renders that can be watched and cancelled
+} RenderRequest_t;
+
+typedef struct RenderReport
+{
+	size_t points = 0;
+	bool computed[ kStageCount] = {};	// False when reused from the session
+	bool fromCache = false;				// Final stitches came from the stitch cache
+	double geometryTime = 0;			// Seconds
+	double outputTime = 0;
+} RenderReport_t;
+
+class MappedStitchPath;
+
+class RenderSession
+{// Keeps each stage's result, so the next render only recomputes stages after a change
+public:
+	uint64_t iStageKey[ kStageCount] = {};
+	bool iStageValid[ kStageCount] = {};
+	StitchPath iStage[ kStageCount];
+	MappedStitchPath* iMapped = nullptr;	// Final stitches, when they came from the stitch cache
+	const StitchPoint_t* iFinalPoints = nullptr;
+	size_t iFinalCount = 0;
+
+	~RenderSession();
+	void Clear();
+};
+
+void RunRender( const RenderRequest_t &request, RenderSession &session, RenderReport_t &report);
+
+//		The session the render command uses, the interactive one unless a control session swaps
+//		in its own.  Returns the one it replaces, nullptr goes back to the interactive one.
+RenderSession* UseRenderSession( RenderSession* session);
+
+/*
+		Streaming takes points as they arrive, from standard input or a FIFO, and pushes them
+		through the transform and clip stages and into the output a block at a time, so memory
+		stays the same however many points there are, and the output can be a pipe too.
+*/
+typedef struct StreamRequest
+{
+	const char* input = "-";			// File or FIFO, "-" for standard input
+	bool binary = false;				// Float x,y pairs as in an IQP file, otherwise text lines of x,y
+	StitchTransform_t transform;
+	StitchClip_t clip;
+	const char* format = "iqp";			// iqp, svg, ps, or json
+	const char* outputName = "";		// Without file type, empty for standard output
+} StreamRequest_t;
+
+typedef struct StreamReport
+{
+	size_t pointsIn = 0;
+	size_t pointsOut = 0;				// After clipping
+	size_t blocks = 0;
+	double seconds = 0;
+} StreamReport_t;
+
+void RunStream( const StreamRequest_t &request, StreamReport_t &report);
+
+int SimulateCmd( CommandProc* cur);
+int CheckCmd( CommandProc* cur);
+int RenderCmd( CommandProc* cur);
+int StreamCmd( CommandProc* cur);
+
 #endif /* quilt_hpp */
@@ -1,8 +1,21 @@
 #include "ConsoleThings.h"
 #include <time.h>
 #include <filesystem>
+#include <algorithm>
+#include <thread>
+#include <map>
+#include <mutex>
 #include "TinyXML.hpp"
 #include "quilter.h"
+#include "quilt.hpp"
+#include "stitchcache.hpp"
+#include "batch.hpp"
+#include "bench.hpp"
+#include "ioreactor.hpp"
+#include "controlsocket.hpp"
+#include "coactivity.hpp"
+#include "loadedfile.hpp"
+#include "bytescan.hpp"
 #if MACCODE
 #include <unistd.h>
 #include <sysdir.h>  // for sysdir_start_search_path_enumeration
@@ -101,22 +114,25 @@ std::string ActivityUniqueString()
 }
 
 /*
-		Read entire file in one fell swoop
+		Read entire file in one fell swoop, see LoadedFile for files that can be mapped instead
 */
 size_t ReadFile(FILE *fp, char **buf)
 {// Reads a file into a new (malloc) buffer, returns length read.
-	static const size_t readBufSize = 4096;
-
-	size_t readBufAllocation = 0;	// Total allocation
-	char* b = nullptr;				// Read buffer to return
-	size_t readLen = 0;				// Size of most recent read
+	size_t readBufAllocation = 65536;	// Total allocation, doubles so every byte is copied about once
+	char* b = (char*) malloc( readBufAllocation + 1);	// +1 for terminating nul
+	Test( b);
 	size_t readSoFar = 0;
-	while( readBufAllocation == readSoFar)
+	for(;;)
 	{
-		readBufAllocation += readBufSize;
-		b = (char*) realloc( b, readBufAllocation + 1);	// +1 for terminating nul
-		readLen = fread( &b[ readSoFar], 1, readBufSize, fp);
-		readSoFar += readLen;
+		readSoFar += fread( &b[ readSoFar], 1, readBufAllocation - readSoFar, fp);
+		if( readSoFar < readBufAllocation)
+			break;				// Short only at the end, or on an error
+		readBufAllocation *= 2;
+		char* bigger = (char*) realloc( b, readBufAllocation + 1);
+		if( bigger == nullptr)
+			free( b);
+		Test( bigger);
+		b = bigger;
 	}
 	b[ readSoFar] = 0;	// Terminating nul
 	*buf = b;
@@ -124,27 +140,118 @@ size_t ReadFile(FILE *fp, char **buf)
 		Test( nullptr);
 	return readSoFar;
 }
-/*
-		fgets, but accepts any line terminator
- */
-void FGetLine( char* buffer, size_t len, FILE* f)
+void LineAssembler::Compact()
+{// Mostly handed out, slide the rest down
+	memmove( iData.data(), iData.data() + iStart, iLength - iStart);
+	iLength -= iStart;
+	iScanned -= iStart;
+	iStart = 0;
+}
+
+char* LineAssembler::Room( size_t length)
+{
+	if( iStart > 0 && iStart >= iLength / 2)
+		Compact();
+	if( iData.size() < iLength + length + 1)
+		iData.resize( std::max( iLength + length + 1, iData.size() * 2));
+	return iData.data() + iLength;
+}
+
+void LineAssembler::Added( size_t length)
+{
+	iLength += length;
+}
+
+void LineAssembler::Append( const char* data, size_t length)
+{
+	memcpy( Room( length), data, length);
+	Added( length);
+}
+
+bool LineAssembler::NextLine( std::string_view &line)
 {
-	int pos = 0;
-	while( pos < len)
+	if( iAfterCR && iStart < iLength)
+	{// CR LF split between chunks
+		if( iData[ iStart] == '\n')
+			++iStart;
+		iAfterCR = false;
+	}
+	if( iScanned < iStart)
+		iScanned = iStart;
+	char* base = iData.data();
+	const char* end = FindLineEnd( base + iScanned, base + iLength);
+	if( end == base + iLength)
 	{
-		if( feof( f))
+		iScanned = iLength;
+		return false;
+	}
+	size_t at = end - base;
+	bool cr = base[ at] == '\r';
+	base[ at] = 0;
+	line = std::string_view( base + iStart, at - iStart);
+	iStart = iScanned = at + 1;
+	if( cr)
+	{// The LF of a CR LF may not be here yet
+		if( iStart < iLength)
 		{
-			buffer[0] = 0;
-			break;
+			if( base[ iStart] == '\n')
+				iStart = iScanned = iStart + 1;
 		}
-		int ch = getc( f);
-		if( ch == 10 || ch == 13)
-		{// Allow tetminate on either.  Clients should expect blank lines if input uses crlf.
-			buffer[ pos] = 0;
-			break;
-		}
-		buffer[ pos++] = (char) ch;
+		else
+			iAfterCR = true;
 	}
+	return true;
+}
+
+bool LineAssembler::TakeRest( std::string_view &line)
+{
+	if( iAfterCR && iStart < iLength && iData[ iStart] == '\n')
+		++iStart;
+	iAfterCR = false;
+	if( iData.size() < iLength + 1)
+		iData.resize( iLength + 1);
+	iData[ iLength] = 0;
+	line = std::string_view( iData.data() + iStart, iLength - iStart);
+	iStart = iScanned = iLength;
+	return !line.empty();
+}
+
+bool LineAssembler::NextLine( std::string &line)
+{
+	std::string_view found;
+	if( !NextLine( found))
+		return false;
+	line.assign( found);
+	return true;
+}
+
+bool LineAssembler::TakeRest( std::string &line)
+{
+	std::string_view rest;
+	bool any = TakeRest( rest);
+	line.assign( rest);
+	iStart = iScanned = iLength = 0;
+	return any;
+}
+
+bool LineReader::NextLine( std::string_view &line)
+{
+	static const size_t kChunk = 65536;
+	while( !iLines.NextLine( line))
+	{
+		if( iAtEnd)
+			return iLines.TakeRest( line);
+		long got = (long) read( iFd, iLines.Room( kChunk), kChunk);
+		if( got < 0 && errno == EINTR)
+			continue;
+		if( got < 0)
+			TestMsg( -1, "Reading lines");
+		if( got == 0)
+			iAtEnd = true;
+		else
+			iLines.Added( got);
+	}
+	return true;
 }
 
 static const char* AllDefaultValues[ MaxDefaultValues] = {nullptr};
@@ -158,6 +265,7 @@ const char* GetDefaultValue( enum DefaultValues selection)
 		{
 		case AllowProblematicUnicode: retval = "false"; break;
 		case unknownSetting: retval = DocumentsPath(); break;
+		case StitchCacheMegabytes: retval = "256"; break;
 		case MaxDefaultValues:
 		default: xraise( "Invalid default value selection", "int selection", (int) selection, nullptr); break;
 		}
@@ -186,6 +294,11 @@ void SetDefaultValue( enum DefaultValues selection, const char* newValue)
 			newValue = "false";
 		}
 	}
+	else if( selection == StitchCacheMegabytes)
+	{// Must be a number
+		if( xatoi( newValue) < 0)
+			xraise( "Cache size can't be negative", "str value", newValue, nullptr);
+	}
 	delete[] AllDefaultValues[ selection];
 	size_t newSize = strlen( newValue)+1;
 	char* result = new char[ newSize];
@@ -198,7 +311,8 @@ int SetCmd( CommandProc* cur)
 	static const char* defaultValueNames[] =
 	{
 		"AllowProblematicUnicode",
-		"UnknownSetting"
+		"UnknownSetting",
+		"StitchCacheMegabytes"
 	};
 
 	bool quiet = false;
@@ -254,57 +368,146 @@ int SetCmd( CommandProc* cur)
 	return SUCCESS;
 }
 
-class AsyncReader
-{// support for AsyncGetLine
+class LineWatcher : public IoWatcher
+{// support for AsyncGetLine, reads whatever has arrived on the reactor thread and hands out whole lines
 public:
-    char* iBuffer;
-    size_t iLen;
-    FILE* iFile;
-    JeffSemaphore &iCompletionSema;
-    bool* iReady;
+	std::mutex iLock;
+	LineAssembler iPending;			// Read, but not handed out yet
+	bool iAtEnd = false;			// Nothing more will arrive
+	std::string* iLine = nullptr;	// Waiting for a line to go here
+	AsyncHelper* iReady = nullptr;
 
-    AsyncReader( JeffSemaphore &completionSema, bool *ready, char* buffer, size_t len, FILE* f)
-    :
-        iBuffer( buffer), iLen( len), iFile( f), iCompletionSema( completionSema), iReady( ready)
-    {
-		memset( iBuffer, 0, iLen);
-		static size_t sNiceStackSize = 1024*16;
-		pthread_t threadID;
-		pthread_attr_t pa;
-		Test( pthread_attr_init( &pa));
-		size_t ss;    // Default stack size of 512K is too small for fwrite()
-		Test( pthread_attr_getstacksize( &pa, &ss));
-		if( ss < sNiceStackSize)
-		{
-			ss = sNiceStackSize;
-			Test( pthread_attr_setstacksize( &pa, ss));
+	bool Deliver()
+	{// With iLock held, true if a waiting line was handed out
+		if( iLine == nullptr)
+			return false;
+		if( !iPending.NextLine( *iLine))
+		{// No whole line, unless it's all there is
+			if( !iAtEnd)
+				return false;
+			iPending.TakeRest( *iLine);
 		}
-		Test( pthread_attr_setdetachstate( &pa, PTHREAD_CREATE_DETACHED));
-		Test( pthread_create( &threadID, &pa, AsyncReader::ReadThread, this));
-		Test( pthread_attr_destroy( &pa));
+		iLine = nullptr;
+		iReady->SignalReady();
+		return true;
 	}
-    
-    void* ReadThreadGuts()
-    {
-        iBuffer[ 0] = 0;
-        FGetLine( iBuffer, iLen, iFile);
-        *iReady = true;
-        iCompletionSema.Increment();
-        return( nullptr);
-    }
 
-    static void* ReadThread( void* context)
-    {// Wrapper given to phread.
-        AsyncReader* sd = (AsyncReader*) context;
-        sd->ReadThreadGuts();
-        delete sd;
-        return nullptr;
-    }
+	bool Readable( int fd) override
+	{// Straight into the assembler, it only ever waits for what is already there
+		static const size_t kChunk = 65536;
+		std::lock_guard<std::mutex> hold( iLock);
+		long got;
+		do
+			got = (long) read( fd, iPending.Room( kChunk), kChunk);
+		while( got < 0 && errno == EINTR);
+		if( got > 0)
+			iPending.Added( got);
+		else if( got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			iAtEnd = true;			// The end, or a real error, not just nothing there yet
+		return !Deliver() && !iAtEnd;
+	}
 };
 
-void AsyncGetLine( char* buffer, size_t len, FILE* f, JeffSemaphore &completionSema, bool* ready)
+static std::map<int, LineWatcher*> lineWatchers;	// Only used from the main loop
+
+void AsyncGetLine( std::string &line, FILE* f, AsyncHelper* ready)
+{
+	int fd = fileno( f);
+	LineWatcher* &watcher = lineWatchers[ fd];
+	if( watcher == nullptr)
+		watcher = new LineWatcher();
+	{
+		std::lock_guard<std::mutex> hold( watcher->iLock);
+		line.clear();
+		watcher->iLine = &line;
+		watcher->iReady = ready;
+		if( watcher->Deliver())
+			return;			// Already had a whole line
+	}
+	IoReactor::Get().Watch( fd, watcher);
+}
+
+bool AsyncGetLineWaiting( FILE* f)
+{
+	auto found = lineWatchers.find( fileno( f));
+	if( found == lineWatchers.end())
+		return false;
+	std::lock_guard<std::mutex> hold( found->second->iLock);
+	return found->second->iLine != nullptr;
+}
+
+void AsyncGetLineCancel( FILE* f)
 {
-    new AsyncReader( completionSema, ready, buffer, len, f);
+	auto found = lineWatchers.find( fileno( f));
+	if( found == lineWatchers.end())
+		return;
+	std::lock_guard<std::mutex> hold( found->second->iLock);
+	found->second->iLine = nullptr;		// What has been read stays for the next one
+}
+
+void AsyncGetLineDone( FILE* f)
+{
+	int fd = fileno( f);
+	auto found = lineWatchers.find( fd);
+	if( found == lineWatchers.end())
+		return;
+	IoReactor::Get().Unwatch( fd);
+	delete found->second;
+	lineWatchers.erase( found);
+}
+
+bool AsyncGetLineAtEnd( FILE* f)
+{
+	auto found = lineWatchers.find( fileno( f));
+	if( found == lineWatchers.end())
+		return false;
+	std::lock_guard<std::mutex> hold( found->second->iLock);
+	return found->second->iAtEnd && found->second->iPending.Empty();
+}
+
+static char* NextCommandArgument( char* &pos, bool first)
+{// Splits off the argument at pos, or returns null at the end, in one pass over the line
+	while( *pos > 0 && *pos <= ' ') ++pos;	// Skip whitespace
+	if( first && *pos == '@')
+	{// "@" as first token , special case for running command files
+		++pos;
+		return (char*) "@";	// Use our own "@" so we an nul-termiante it
+	}
+	if( *pos == 0)
+		return nullptr;
+	char* start = pos;		// Parameter begins here
+	char* outpos = pos;		// Removes quotes and quote characters as it goes
+	while( *pos < 0 || *pos > ' ')
+	{// Keep non-white-space characters, while deleting and processing quoting characters \, ", and ',
+		if( *pos == '\\')
+		{// Quoting next character, could be space or tab, or backslash
+			if( *++pos == 0) break;
+			*outpos++ = *pos++;			// Keeping a "\" quoted character
+		}
+		else if( *pos == '"' || *pos == '\'')
+		{// quoted string, skip over that
+			char q = *pos++;
+			for(;;)
+			{// While inside quote
+				if( *pos == 0) break;
+				else if( *pos == q)
+				{// close quote, skip over that without keeping it
+					++pos;
+					break;
+				}
+				else if( *pos == '\\')
+				{// Could be quoting a quote
+					if( *++pos == 0) break;
+					*outpos++ = *pos++;		// Keeping a "\" quoted character
+				}
+				else *outpos++ = *pos++;	// Keeping a chacater inside quotes
+			}
+		}
+		else *outpos++ = *pos++;			// Keeping this non-whitespace character
+	}
+	if( *pos != 0) ++pos;
+	*outpos = 0;	// Truncate the output string we are skipping over
+	return start;
 }
 
 int SplitCommandLine( char* commandLine, int *argc, char** argv, size_t argvsize)
@@ -312,53 +515,26 @@ int SplitCommandLine( char* commandLine, int *argc, char** argv, size_t argvsize
 	*argc = 0;
 	--argvsize;		// This lets us compare before we overrun the size
 	char* pos = commandLine;
-	for(;;)
-	{// For each character in the command line
-		while( *pos > 0 && *pos <= ' ') ++pos;	// Skip whitespace
-		if( *argc == 0 && *pos == '@')
-		{// "@" as first token , special case for running command files
-			argv[ (*argc)++] = (char*) "@";	// Use our own "@" so we an nul-termiante it
-			++pos;
-		}
-		if( *pos == 0) break;
+	while( char* argument = NextCommandArgument( pos, *argc == 0))
+	{// For each argument in the command line
 		if( *argc >= argvsize)
 			xraise( "Too many parameters on command", "int limit", argvsize, nullptr);
-		argv[ (*argc)++] = pos;	// Parameter begins here
-		char* outpos = pos;		// Removes quotes and quote characters as it goes
-		while( *pos < 0 || *pos > ' ')
-		{// Keep non-white-space characters, while deleting and processing quoting characters \, ", and ',
-			if( *pos == '\\')
-			{// Quoting next character, could be space or tab, or backslash
-				if( *++pos == 0) break;
-				*outpos++ = *pos++;			// Keeping a "\" quoted character
-			}
-			else if( *pos == '"' || *pos == '\'')
-			{// quoted string, skip over that
-				char q = *pos++;
-				for(;;)
-				{// While inside quote
-					if( *pos == 0) break;
-					else if( *pos == q)
-					{// close quote, skip over that without keeping it
-						++pos;
-						break;
-					}
-					else if( *pos == '\\')
-					{// Could be quoting a quote
-						if( *++pos == 0) break;
-						*outpos++ = *pos++;		// Keeping a "\" quoted character
-					}
-					else *outpos++ = *pos++;	// Keeping a chacater inside quotes
-				}
-			}
-			else *outpos++ = *pos++;			// Keeping this non-whitespace character
-		}
-		if( *pos != 0) ++pos;
-		*outpos = 0;	// Truncate the output string we are skipping over
+		argv[ (*argc)++] = argument;
 	}
 	return *argc;
 }
 
+int SplitCommandLine( char* commandLine, std::vector<char*> &argv)
+{// Same, but argv grows to fit, and reusing it for the next line reuses its room
+	argv.clear();
+	char* pos = commandLine;
+	while( char* argument = NextCommandArgument( pos, argv.empty()))
+		argv.push_back( argument);
+	int argc = (int) argv.size();
+	argv.push_back( nullptr);
+	return argc;
+}
+
 int JsonCmd( CommandProc* cur)
 {
     static const char* helps[] =
@@ -375,13 +551,9 @@ int JsonCmd( CommandProc* cur)
         nullptr, nullptr,
         "S", helps);
 
-	char* jsonbuf = nullptr;
-	FILE *infile = fopen( cur->iArgv[ paramIndex], "r");
-	TestMsg( infile, "Can't open input file");
-	ReadFile( infile, &jsonbuf);
-	fclose( infile);
+	LoadedFile jsonFile( cur->iArgv[ paramIndex], LoadedFile::kWritable);	// The tree points into it
 	TinyXml json;
-	json.InitializeFromJSON( jsonbuf);
+	json.InitializeFromJSON( jsonFile.Data());
 	WriteOut( &json, stdout);
 	return cur->iFromCommandLine ? 2 : 0;
 }
@@ -470,6 +642,63 @@ int TestCmd( CommandProc* cur)
     return cur->iFromCommandLine ? 2 : 0;
 }
 
+int ListCmd( CommandProc* cur)
+{
+	static const char* helps[] =
+	{
+		"Lists running activities."
+	};
+
+	GetAllOpts(	// No options
+		cur->iArgc, cur->iArgv,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		"", helps);
+
+	uint64_t now = AsyncHelper::iTimerWheel.Now();
+	for( size_t a = 0; a < activities.size(); ++a)
+	{// First one is always the command line
+		AsyncHelper* activity = activities[ a];
+		printf( "%3zu %s, run %d times%s", a+1, activity->Description(), activity->iExecuteCounter,
+			activity->iQueued.load() ? ", ready" : "");
+		if( activity->iTimer.iLevel >= 0)
+			printf( ", next in %.1f seconds", activity->iTimer.iDeadline > now ? (activity->iTimer.iDeadline - now) / 1000.0 : 0.0);
+		printf( "\n");
+	}
+	return cur->iFromCommandLine ? 2 : 0;
+}
+
+int CancelCmd( CommandProc* cur)
+{
+	static const char* helps[] =
+	{
+		"Activity numbers from list to cancel."
+	};
+
+	int paramIndex = GetAllOpts(
+		cur->iArgc, cur->iArgv,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		"I.", helps);
+
+	for( int p = paramIndex; p < cur->iArgc; ++p)
+	{// Each one stops on its own, and reports when it has
+		int number = xatoi( cur->iArgv[ p]);
+		if( number < 1 || number > (int) activities.size())
+			sraise( "No such activity", "int number", number, nullptr);
+		AsyncHelper* activity = activities[ number - 1];
+		if( !activity->Cancel())
+			sraise( "That activity can't be cancelled", "str activity", activity->Description(), nullptr);
+	}
+	return cur->iFromCommandLine ? 2 : 0;
+}
+
 static char const *cmds[] =
 {
     "help",
@@ -479,6 +708,16 @@ static char const *cmds[] =
     "set",
     "test",
     "run",
+    "simulate",
+    "check",
+    "render",
+    "stream",
+    "cache",
+    "batch",
+    "list",
+    "control",
+    "cancel",
+    "bench",
     "@",
     NULL
 };
@@ -491,23 +730,119 @@ static int (*rtns[])( CommandProc*) =
     SetCmd,
     TestCmd,
 	RunCmd,
+	SimulateCmd,
+	CheckCmd,
+	RenderCmd,
+	StreamCmd,
+	CacheCmd,
+	BatchCmd,
+	ListCmd,
+	ControlCmd,
+	CancelCmd,
+	BenchCmd,
 	RunCmd,
     NULL
 };
 
+int DispatchCommandLine( char* commandLine)
+{
+	int result = 0;
+	try
+	{
+		std::vector<char*> av;
+		int ac = SplitCommandLine( commandLine, av);
+		if( ac != 0)
+		{
+			CommandProc cur( ac, av.data());
+			result = Dispatch( &cur, cmds, rtns);
+		}
+	}
+	catch( std::exception& err)
+	{
+		DisplayException( err);
+	}
+	catch( ...)
+	{
+		printf( "Don't know why it failed\n");
+	}
+	return result;
+}
+
+/*
+		A command file run in the background.  Each line runs from the main loop in turn with
+		everything else, so a long script doesn't hold up commands typed in the meantime.
+*/
+class ScriptActivity : public CoActivity
+{
+public:
+	std::string iFileName;
+	FILE* iFile;
+	double iPause;							// Seconds between commands
+	int iCommands = 0;
+
+	ScriptActivity( const char* fileName, FILE* file, double pause)
+	:
+		iFileName( fileName), iFile( file), iPause( pause)
+	{
+	}
+
+	CoTask<> Run() override
+	{
+		std::string line;
+		while( co_await Line( line, iFile))
+		{
+			if( line.find_first_not_of( " \t") == std::string::npos)
+				continue;			// Skip blank lines
+			++iCommands;
+			iNeedNewPrompt = true;
+			if( DispatchCommandLine( &line[ 0]) == 2)
+				break;				// Exit ends the script, not the program
+			if( iPause > 0)
+				co_await Sleep( iPause);
+			else
+				co_await Yield();
+		}
+		Printf( "%s done, %d commands\n", iFileName.c_str(), iCommands);
+	}
+
+	const char* Description() override
+	{
+		snprintf( iDescription, sizeof( iDescription), "Script %s, %d commands so far", iFileName.c_str(), iCommands);
+		return iDescription;
+	}
+
+	void Shutdown() override
+	{
+		CoActivity::Shutdown();
+		if( iFile)
+		{
+			AsyncGetLineDone( iFile);
+			fclose( iFile);
+			iFile = nullptr;
+		}
+	}
+};
+
 int RunCmd( CommandProc* cur)
 {// Runs a command file
-
+	bool background = false;
+	double pause = 0;
+	const char* boolOpts = "b";
+	bool* boolValues[] = { &background};
+	const char* floatOpts = "i";
+	double* floatValues[] = { &pause};
 	static const char* helps[] =
 	{
+		"Run it in the background, alongside commands typed meanwhile.",
+		"Seconds to wait between commands in the background.",
 		"Command file to run"
 	};
 
-	int paramIndex = GetAllOpts(	// No options, just the one parameter
+	int paramIndex = GetAllOpts(	// Just the one parameter
         cur->iArgc, cur->iArgv,
+        boolOpts, boolValues,
         nullptr, nullptr,
-        nullptr, nullptr,
-        nullptr, nullptr,
+        floatOpts, floatValues,
         nullptr, nullptr,
         nullptr, nullptr,
         "S", helps);
@@ -516,18 +851,24 @@ int RunCmd( CommandProc* cur)
 	const char* filename = cur->iArgv[ paramIndex];
 	FILE* stdFile = fopen( filename, "rb");
 	if( stdFile == nullptr) TestMsg( -1, filename);				// Errors out witth errno
+	if( background)
+	{// The activity owns the file now
+		ScriptActivity* script = new ScriptActivity( filename, stdFile, pause);
+		script->Startup();
+		AddActivity( script);
+		return 0;
+	}
 	try
 	{
-		while( !feof( stdFile))
-		{// For each line the input file
-			char scrap[ 256] = {0};
-			int ac = 0;
-			char* av[64];
-			fgets( scrap, CountItems( scrap), stdFile);
-			SplitCommandLine( scrap, &ac, av, CountItems( av));
+		LineReader reader( fileno( stdFile));
+		std::string_view line;
+		std::vector<char*> av;		// Keeps its room from line to line
+		while( reader.NextLine( line))
+		{// For each line the input file, split in place in the reader's buffer
+			int ac = SplitCommandLine( (char*) line.data(), av);
 			if( ac > 0)
 			{// this line isn't logically blank, dispatch on it
-				CommandProc newcur( ac, av);
+				CommandProc newcur( ac, av.data());
 				result = Dispatch( &newcur, cmds, rtns);
 				if( result == 2)
 					break;
@@ -540,6 +881,7 @@ int RunCmd( CommandProc* cur)
 		stdFile = nullptr;
 		throw;
 	}
+	fclose( stdFile);
 	return result;
 }
 
@@ -561,6 +903,78 @@ int Help( CommandProc *cur)
 
 AsyncHelper::~AsyncHelper()
 {
+	iTimerWheel.Cancel( iTimer);
+}
+
+ReadyQueue::ReadyQueue()
+:
+	iHead( &iStub), iTail( &iStub)
+{
+}
+
+void ReadyQueue::Push( ReadyLink* link)
+{// Safe from any number of threads, the list is briefly broken between the two steps
+	link->iNext.store( nullptr, std::memory_order_relaxed);
+	ReadyLink* previous = iHead.exchange( link, std::memory_order_acq_rel);
+	previous->iNext.store( link, std::memory_order_release);
+}
+
+ReadyLink* ReadyQueue::Pop()
+{
+	ReadyLink* tail = iTail;
+	ReadyLink* next = tail->iNext.load( std::memory_order_acquire);
+	if( tail == &iStub)
+	{// Skip over the stub
+		if( next == nullptr)
+			return nullptr;
+		iTail = next;
+		tail = next;
+		next = next->iNext.load( std::memory_order_acquire);
+	}
+	if( next)
+	{// Not the last one, easy
+		iTail = next;
+		return tail;
+	}
+	if( tail != iHead.load( std::memory_order_acquire))
+		return nullptr;		// Someone is part way through pushing after this one
+	Push( &iStub);			// The last one can only leave once something is behind it
+	next = tail->iNext.load( std::memory_order_acquire);
+	if( next)
+	{
+		iTail = next;
+		return tail;
+	}
+	return nullptr;
+}
+
+void ReadyQueue::Signal( AsyncHelper* helper)
+{
+	if( helper->iQueued.exchange( true, std::memory_order_acq_rel))
+		return;				// Already waiting to run, it will see whatever we did before this
+	Push( &helper->iReadyLink);
+	iSema.Increment();
+}
+
+AsyncHelper* ReadyQueue::Wait( const struct timespec* wakeup)
+{
+	if( wakeup == nullptr)
+		iSema.Decrement();
+	else if( !iSema.Decrement( wakeup))
+		return nullptr;
+	ReadyLink* link;
+	while( (link = Pop()) == nullptr)
+		std::this_thread::yield();	// Counted, so only a push that is part way done can get here
+	AsyncHelper* helper = link->iOwner;
+	if( !helper->iRetired)		// Retired ones are about to be deleted, so later signals have to stay no-ops
+		helper->iQueued.exchange( false, std::memory_order_acq_rel);	// Signals from now on run it again
+	return helper;
+}
+
+bool ReadyQueue::Retire( AsyncHelper* helper)
+{// Once claimed, signals are ignored, so it never goes back in the queue
+	helper->iRetired = true;
+	return !helper->iQueued.exchange( true, std::memory_order_acq_rel);
 }
 
 void AsyncHelper::DisplayPrompt()
@@ -571,60 +985,23 @@ void AsyncHelper::DisplayPrompt()
 class AsyncEditableCommandLine : public AsyncHelper, EditableCommandLine
 {
 public:
-    int readCh = 'R'-64;         // Character reseult
     ScopedGetch* gch = nullptr;
-    JeffSemaphore gchLock;      // Using it like a mutex
+    ActivityWatcher watcher;    // Runs Execute when there is something to read
     bool exiting = false;
+    std::vector<char*> av;      // Arguments of the last command, keeps its room for the next one
     
     AsyncEditableCommandLine()
     :
-		EditableCommandLine( "Quilter>")
+		EditableCommandLine( "Quilter>"),
+		watcher( this)
 	{
 	}
-    
-    void* ReadThreadGuts()
-    {
-        while( !exiting)
-        {
-            gchLock.Decrement();
-            while( !exiting)
-            {
-                readCh = gch->ReadCmd();
-                if( readCh != 0)
-					break;
-            }
-            iReadyToExecute = true;
-            iCompletionSema.Increment();
-        }
-        return( nullptr);
-    }
-
-    static void* ReadThread( void* context)
-    {// Wrapper given to phread.
-        AsyncEditableCommandLine* sd = (AsyncEditableCommandLine*) context;
-        sd->ReadThreadGuts();
-        return nullptr;
-    }
 
     void Startup() override
     {
         exiting = false;
         gch = new ScopedGetch();
-        gchLock.Increment();
-        static size_t sNiceStackSize = 1024*16;
-        pthread_t threadID;
-        pthread_attr_t pa;
-        Test( pthread_attr_init( &pa));
-        size_t ss;    // Default stack size of 512K is too small for fwrite()
-        Test( pthread_attr_getstacksize( &pa, &ss));
-        if( ss < sNiceStackSize)
-        {
-            ss = sNiceStackSize;
-            Test( pthread_attr_setstacksize( &pa, ss));
-        }
-        Test( pthread_attr_setdetachstate( &pa, PTHREAD_CREATE_DETACHED));
-        Test( pthread_create( &threadID, &pa, AsyncEditableCommandLine::ReadThread, this));
-        Test( pthread_attr_destroy( &pa));
+        IoReactor::Get().Watch( STDIN_FILENO, &watcher);
     }
 
     virtual const char* Description() override
@@ -638,67 +1015,71 @@ public:
     }
     
     void Execute() override
-    {// Process most recent charactere if there is one, and queue up reading the next
-		char* commandLine = ProcessOneCharacter( readCh);
-		if( commandLine)
+    {// Process everything typed so far, including the rest of a paste, then wait for more
+		do
 		{
-			delete gch;			// Run command line in normal mode
-			gch = nullptr;
-		    try
-            {
-                char* av[64];
-                int ac = 0;
-                if( *commandLine)
-                {// Something to do
-                    SplitCommandLine( commandLine, &ac, av, CountItems( av));
-                    if( ac != 0)
-                    {
-                        CommandProc cur( ac, av);
-                        result = Dispatch( &cur, cmds, rtns);
-                    }
-                }
-            }
-            catch( std::exception& err)
-            {
-                DisplayException( err);
-            }
-            catch( ...)
-            {
-                printf( "Don't know why it failed\n");
-            }
-            *commandLine = 0;
-            if( result == 2)
-            {// Exiting, mark it so
-				exiting = true;
-           }
-            else
-            {
-            iNeedNewPrompt = true;
-			gch = new ScopedGetch();
-		}
-        }
-        gchLock.Increment();        // Unlock read thread
+			int readCh = gch->ReadCmd();
+			if( readCh == 0)
+				break;
+			char* commandLine = ProcessOneCharacter( readCh);
+			if( commandLine)
+			{
+				delete gch;			// Run command line in normal mode
+				gch = nullptr;
+				try
+				{
+					if( *commandLine)
+					{// Something to do
+						int ac = SplitCommandLine( commandLine, av);
+						if( ac != 0)
+						{
+							CommandProc cur( ac, av.data());
+							result = Dispatch( &cur, cmds, rtns);
+						}
+					}
+				}
+				catch( std::exception& err)
+				{
+					DisplayException( err);
+				}
+				catch( ...)
+				{
+					printf( "Don't know why it failed\n");
+				}
+				*commandLine = 0;
+				if( result == 2)
+				{// Exiting, mark it so
+					exiting = true;
+					return;
+				}
+				iNeedNewPrompt = true;
+				gch = new ScopedGetch();
+			}
+		} while( gch->TypeAhead() > 0);
+		IoReactor::Get().Watch( STDIN_FILENO, &watcher);
     }
     
     void Shutdown() override
     {// Restartable shutdown
         exiting = true;
-		gchLock.Increment();
+		IoReactor::Get().Unwatch( STDIN_FILENO);
     }
     
     ~AsyncEditableCommandLine()
     {// non-restartable shutdown
+		delete gch;
     }
 };
 
 class AsyncCommandLine : public AsyncHelper
 {
 public:
-	char cmdLine[ 512] = {0};	// Command line read asynchrounously
+	std::string cmdLine;		// Command line read asynchrounously, any length
+	std::vector<char*> av;		// Its arguments, keeps its room for the next one
 
 	void Startup() override
 	{
-		AsyncGetLine( cmdLine, CountItems( cmdLine), stdin, iCompletionSema, &iReadyToExecute);
+		AsyncGetLine( cmdLine, stdin, this);
 	}
 
 	virtual const char* Description() override
@@ -711,15 +1092,12 @@ public:
 	{// Process most recent command if there is one, and queue up reading the next
 		try
 		{
-			char* av[64];
-			int ac = 0;
-
-			if( *cmdLine)
+			if( !cmdLine.empty())
 			{// Something to do
-				SplitCommandLine( cmdLine, &ac, av, CountItems( av));
+				int ac = SplitCommandLine( &cmdLine[ 0], av);
 				if( ac != 0)
 				{
-					CommandProc cur( ac, av);
+					CommandProc cur( ac, av.data());
 					result = Dispatch( &cur, cmds, rtns);
 				}
 			}
@@ -732,24 +1110,52 @@ public:
 		{
 			printf( "Don't know why it failed\n");
 		}
+		if( result != 2 && AsyncGetLineAtEnd( stdin))
+			result = 2;		// Nothing more to read, same as exit
 		if( result != 2)
 		{// Not exiting, set up next prompt
 			iNeedNewPrompt = true;
-			AsyncGetLine( cmdLine, CountItems( cmdLine), stdin, iCompletionSema, &iReadyToExecute);
+			AsyncGetLine( cmdLine, stdin, this);
 		}
 	}
 	
 	void Shutdown() override
 	{// Restartable shutdown
+		IoReactor::Get().Unwatch( STDIN_FILENO);
 	}
 	
 	~AsyncCommandLine()
 	{// non-restartable shutdown
-		fclose( stdin);	// This should error out the pending read and exit the thread
 	}
 };
 
-JeffSemaphore AsyncHelper::iCompletionSema;
+ReadyQueue AsyncHelper::iReadyQueue;
+TimerWheel AsyncHelper::iTimerWheel( AsyncHelper::iReadyQueue);
+
+class TimerWakeup : public AsyncHelper
+{// Wakes the main loop when a timer is scheduled sooner than it planned to wake up
+public:
+	void Startup() override
+	{
+	}
+	void Execute() override
+	{
+	}
+	void Shutdown() override
+	{
+	}
+};
+static TimerWakeup timerWakeup;
+
+void RetireActivity( AsyncHelper* victim)
+{// Removes a failed activity, it is deleted now or when it next comes out of the ready queue
+	victim->Shutdown();
+	auto found = std::find( activities.begin(), activities.end(), victim);
+	if( found != activities.end())
+		activities.erase( found);
+	if( AsyncHelper::iReadyQueue.Retire( victim))
+		delete victim;
+}
 
 int main( int argc, char **argv)
 {
@@ -763,12 +1169,12 @@ int main( int argc, char **argv)
 		cmdLine =  new AsyncCommandLine() ;
     else
 		cmdLine = new AsyncEditableCommandLine();
-	cmdLine->Startup();
 /*
 		Take note that the LIST comnmand assumes cmdLine is first in activities, so you
 		need to create this before running any command files or command lines.
 */
 	activities.push_back( cmdLine);
+	AsyncHelper::iTimerWheel.SetWakeup( &timerWakeup);
 
 //		Locate startup command file
 
@@ -812,7 +1218,9 @@ int main( int argc, char **argv)
 			cmdLine->result = 2;
 		}
 	}
-	// open up and read from stdin
+	// open up and read from stdin, only now, a command from the shell may have wanted it all, like stream -
+	if( cmdLine->result != 2)
+		cmdLine->Startup();
 	while( cmdLine->result != 2)
 	{
         if( needPrompt)
@@ -820,38 +1228,37 @@ int main( int argc, char **argv)
             cmdLine->DisplayPrompt();
             needPrompt = false;
         }
-		AsyncHelper::iCompletionSema.Decrement();
-		for( int i = 0; i < activities.size(); ++i)
-		{// Process all the handlers, including the first one that takes commands from the command line
-			if( activities[ i]->iReadyToExecute)
-			{// This one is ready to go, launch it
-				activities[ i]->iReadyToExecute = false;	// Reset for next event
-				try
-				{
-					activities[ i]->Execute();
-					needPrompt = activities[i]->iNeedNewPrompt;
-                    ++activities[i]->iExecuteCounter;
-				}
-				catch( std::exception& err)
-				{
-					DisplayException( err);
-					activities[ i]->Shutdown();
-					delete activities[ i];
-					activities.erase( activities.begin() + i);
-					--i;
-					needPrompt = true;
-				}
-				catch( ...)
-				{
-					printf( "Don't know why %s failed\n", activities[ i]->Description());
-					activities[ i]->Shutdown();
-					delete activities[ i];
-					activities.erase( activities.begin() + i);
-					--i;
-					needPrompt = true;
-				}
-                activities[i]->iNeedNewPrompt = false;
-			}
+		struct timespec wakeup;
+		bool timed = AsyncHelper::iTimerWheel.Sleep( &wakeup);
+		AsyncHelper* ready = AsyncHelper::iReadyQueue.Wait( timed ? &wakeup : nullptr);
+		AsyncHelper::iTimerWheel.Advance();		// Anything due goes in the ready queue
+		if( ready == nullptr)
+			continue;
+		if( ready->iRetired)
+		{// Failed while it was queued, last reference is gone now
+			delete ready;
+			continue;
+		}
+		try
+		{// Includes the command line, which takes commands from stdin
+			ready->Execute();
+			needPrompt = ready->iNeedNewPrompt;
+			++ready->iExecuteCounter;
+			ready->iNeedNewPrompt = false;
+			if( ready->iFinished)
+				RetireActivity( ready);
+		}
+		catch( std::exception& err)
+		{
+			DisplayException( err);
+			RetireActivity( ready);
+			needPrompt = true;
+		}
+		catch( ...)
+		{
+			printf( "Don't know why %s failed\n", ready->Description());
+			RetireActivity( ready);
+			needPrompt = true;
 		}
 	}
 /*
@@ -10,13 +10,65 @@
 #define quilter_h
 #include <stdio.h>
 #include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
 #include "JeffSema.h"
+#include "timerwheel.hpp"
+
+class AsyncHelper;
+
+/*
+		Activities that are ready to run, many threads push and only the main loop pops.  It is
+		an intrusive linked list through each activity's link, so pushing never allocates or
+		locks, and an activity that is signalled again before it runs is only queued once.
+*/
+typedef struct ReadyLink
+{
+	std::atomic<ReadyLink*> iNext{ nullptr};
+	AsyncHelper* iOwner = nullptr;				// Null only for the queue's stub
+} ReadyLink_t;
+
+class ReadyQueue
+{
+private:
+	std::atomic<ReadyLink*> iHead;				// Producers swap themselves in here
+	ReadyLink* iTail;							// Only the consumer touches this
+	ReadyLink iStub;
+	JeffSemaphore iSema;						// Counts activities in the queue
+
+	void Push( ReadyLink* link);
+	ReadyLink* Pop();							// Null when empty, or a push is half done
+
+public:
+	ReadyQueue();
+	void Signal( AsyncHelper* helper);			// Any thread, queues the helper unless it already is
+	AsyncHelper* Wait( const struct timespec* wakeup = nullptr);	// Consumer only, next ready helper, null if it is time to wake up
+	bool Retire( AsyncHelper* helper);			// Consumer only, true if the caller may delete it now
+};
 
 class AsyncHelper
 {// A running asynchronous task
 public:
-	static JeffSemaphore iCompletionSema;		// "post" this when you want Execute to run.
-	bool iReadyToExecute = false;				// Set this to true when you want Execute to run.
+	static ReadyQueue iReadyQueue;				// The main loop runs whatever comes out of this
+	static TimerWheel iTimerWheel;				// Puts activities in the ready queue when their time comes
+	Timer_t iTimer;								// For ScheduleExecute, add more Timer_t if you need them, and cancel them when you go
+	ReadyLink_t iReadyLink;
+	std::atomic<bool> iQueued{ false};			// In a ready queue, cleared just before Execute
+	bool iRetired = false;						// Deleted when it comes out of the queue
+	bool iFinished = false;						// Set in Execute when there is nothing more to do, the main loop removes it
+	void SignalReady()							// Call this, from any thread, when you want Execute to run.
+	{
+		iReadyQueue.Signal( this);
+	}
+	void ScheduleExecute( double seconds, double periodSeconds = 0)	// From now, and then every periodSeconds if not zero
+	{
+		iTimerWheel.Schedule( iTimer, seconds, periodSeconds);
+	}
+	void CancelExecute()
+	{
+		iTimerWheel.Cancel( iTimer);
+	}
 	bool iNeedNewPrompt = false;				// If you printf anything, you should request a new command line prompt
 	char iDescription[ 512];					// Everyone needs one
     int iExecuteCounter = 0;                    // Number of times Execute has been called
@@ -31,6 +83,15 @@ public:
 	{// Default can be overridden
 		return iDescription;
 	}
+	AsyncHelper()
+	{
+		iReadyLink.iOwner = this;
+		iTimer.iOwner = this;
+	}
+	virtual bool Cancel()						// Asks it to stop soon, false if it can't be
+	{
+		return false;
+	}
 	virtual ~AsyncHelper();
 #if MACCODE
     int Printf( const char* formatString, ...) __printflike(2, 3);
@@ -43,9 +104,59 @@ public:
 // Utility functions for quilters - some of these might want to move into ConsoleThings or xraise?
 
 size_t ReadFile(FILE *fp, char **buf);
-void AsyncGetLine( char* buffer, size_t len, FILE* f, JeffSemaphore &completionSema, bool* ready);
-void FGetLine( char* buffer, size_t len, FILE* f);
+void AsyncGetLine( std::string &line, FILE* f, AsyncHelper* ready);	// Signals ready when the line is in, however long it is
+bool AsyncGetLineAtEnd( FILE* f);		// True once every line has been handed out and there are no more
+bool AsyncGetLineWaiting( FILE* f);		// True while a line is waiting to be filled in
+void AsyncGetLineCancel( FILE* f);		// The waiting line won't be filled in, or signalled
+void AsyncGetLineDone( FILE* f);		// Before closing a file read with AsyncGetLine
+int SplitCommandLine( char* commandLine, int *argc, char** argv, size_t argvsize);	// Edits commandLine in place
+int SplitCommandLine( char* commandLine, std::vector<char*> &argv);	// No limit, argv is null terminated and keeps its room
+
+/*
+		Collects input that arrives in chunks and hands it out a line at a time.  Each byte is
+		looked at once, 16 at a time, and what has been handed out is only dropped once it is
+		most of the buffer, so megabyte lines, or thousands of short ones, cost no more than
+		reading them.  A line ends with CR, LF, or CR LF, in any mix.  Lines handed out as a
+		string_view stay in the buffer, with the line end replaced by a nul so they work as C
+		strings too, until the next Append or Room.
+*/
+class LineAssembler
+{
+	std::vector<char> iData;			// Always room for a nul after iLength
+	size_t iLength = 0;					// Bytes in iData
+	size_t iStart = 0;					// First byte not handed out yet
+	size_t iScanned = 0;				// Searched for a line end up to here
+	bool iAfterCR = false;				// Last line ended in CR, an LF next is part of it
+	void Compact();
+public:
+	void Append( const char* data, size_t length);
+	char* Room( size_t length);			// To read up to length bytes straight in, then call Added
+	void Added( size_t length);
+	bool NextLine( std::string_view &line);	// False until there is a whole line
+	bool TakeRest( std::string_view &line);	// Whatever is left, for the end of input, false if nothing
+	bool NextLine( std::string &line);	// Copies, for lines that have to outlive the next Append
+	bool TakeRest( std::string &line);
+	bool Empty() const
+	{
+		return iStart >= iLength;
+	}
+};
+
+/*
+		Lines from a whole file, or a pipe, read a big chunk at a time and handed out in place
+*/
+class LineReader
+{
+	int iFd;
+	bool iAtEnd = false;
+	LineAssembler iLines;
+public:
+	explicit LineReader( int fd) : iFd( fd) {}	// Nothing may have been read from it through stdio
+	bool NextLine( std::string_view &line);	// Waits for it, false at the end
+};
 void AddActivity( AsyncHelper* newActivity);	// Adds to list of asynchronous activities
+void RetireActivity( AsyncHelper* victim);		// Shuts down, removes, and deletes an activity, not from its own Execute
+int DispatchCommandLine( char* commandLine);	// Runs one command line, reporting errors, returns 2 if it asked to exit
 std::string DocumentsPath();
 std::string SettingsPath();
 std::string ActivityUniqueString();
@@ -54,6 +165,7 @@ enum DefaultValues
 {
 	AllowProblematicUnicode = 0,
 	unknownSetting,
+	StitchCacheMegabytes,
 	MaxDefaultValues
 };
 
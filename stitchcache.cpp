@@ -0,0 +1,303 @@
+//
+//  stitchcache.cpp
+//  quilter
+//
+//	Generated stitch paths are stored one per file, named by the hash of whatever produced
+//	them, so a repeated render maps the file and skips generation entirely.  Files are
+//	written under a temporary name and renamed, so concurrent quilters never see half a file.
+//	Least recently used files are removed when the total passes StitchCacheMegabytes, and a
+//	hit refreshes the file's modification time to keep it.
+//
+
+#include "stitchcache.hpp"
+#include "quilter.h"
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <filesystem>
+#if MACCODE
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+typedef struct StitchCacheHeader
+{// Leads every cache file, followed by the points themselves
+	char magic[ 8];
+	uint64_t key;
+	uint64_t count;
+	uint64_t pointSize;		// Guards against layout changes in StitchPoint_t
+} StitchCacheHeader_t;
+
+static const char sCacheMagic[ 8] = {'Q', 'S', 'T', 'I', 'T', 'C', 'H', '1'};
+static const char* sCacheFileType = ".qsp";
+
+static std::atomic<uint64_t> sCacheHits( 0);
+static std::atomic<uint64_t> sCacheMisses( 0);
+static std::atomic<uint64_t> sCacheStores( 0);
+static std::atomic<uint64_t> sCacheEvictions( 0);
+
+static std::filesystem::path CacheDirectory()
+{
+	return std::filesystem::path( SettingsPath()) / "Quilter" / "StitchCache";
+}
+
+static std::filesystem::path CacheFileName( uint64_t key)
+{
+	char name[ 32];
+	snprintf( name, CountItems( name), "%016llx%s", (unsigned long long) key, sCacheFileType);
+	return CacheDirectory() / name;
+}
+
+StitchCacheKey::StitchCacheKey()
+{
+	Add( versionString);
+}
+
+void StitchCacheKey::Add( const void* data, size_t len)
+{
+	const unsigned char* d = (const unsigned char*) data;
+	for( size_t i = 0; i < len; ++i)
+	{
+		iHash ^= d[ i];
+		iHash *= 1099511628211ULL;
+	}
+}
+
+void StitchCacheKey::Add( const char* s)
+{
+	Add( s, strlen( s) + 1);
+}
+
+void StitchCacheKey::Add( double d)
+{
+	Add( &d, sizeof( d));
+}
+
+void StitchCacheKey::AddFileIdentity( const char* filename)
+{// Anything that changes the file changes its size or date, which is much cheaper than hashing it
+	std::error_code ec;
+	if( !std::filesystem::is_regular_file( filename, ec))
+		return;
+	std::string full = std::filesystem::absolute( filename, ec).string();
+	Add( full.c_str());
+	uint64_t size = std::filesystem::file_size( filename, ec);
+	Add( &size, sizeof( size));
+	int64 modified = (int64) std::filesystem::last_write_time( filename, ec).time_since_epoch().count();
+	Add( &modified, sizeof( modified));
+}
+
+MappedStitchPath::~MappedStitchPath()
+{
+	Unmap();
+}
+
+void MappedStitchPath::Unmap()
+{
+	if( iBase)
+	{
+#if MACCODE
+		munmap( iBase, iLength);
+#endif
+#if WINCODE
+		UnmapViewOfFile( iBase);
+#endif
+	}
+	iBase = nullptr;
+	iLength = 0;
+	iPoints = nullptr;
+	iCount = 0;
+}
+
+bool MappedStitchPath::Map( const char* filename, uint64_t key)
+{
+	Unmap();
+#if MACCODE
+	int fd = open( filename, O_RDONLY);
+	if( fd < 0)
+		return false;
+	struct stat st;
+	if( fstat( fd, &st) != 0 || (size_t) st.st_size < sizeof( StitchCacheHeader_t))
+	{
+		close( fd);
+		return false;
+	}
+	void* base = mmap( nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close( fd);		// The mapping keeps the file open
+	if( base == MAP_FAILED)
+		return false;
+	iBase = base;
+	iLength = (size_t) st.st_size;
+#endif
+#if WINCODE
+	HANDLE file = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if( file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if( !GetFileSizeEx( file, &size) || (size_t) size.QuadPart < sizeof( StitchCacheHeader_t))
+	{
+		CloseHandle( file);
+		return false;
+	}
+	HANDLE mapping = CreateFileMappingA( file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle( file);
+	if( mapping == nullptr)
+		return false;
+	iBase = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle( mapping);		// The view keeps the mapping open
+	if( iBase == nullptr)
+		return false;
+	iLength = (size_t) size.QuadPart;
+#endif
+	const StitchCacheHeader_t* header = (const StitchCacheHeader_t*) iBase;
+	if( memcmp( header->magic, sCacheMagic, sizeof( sCacheMagic)) != 0
+		|| header->key != key
+		|| header->pointSize != sizeof( StitchPoint_t)
+		|| header->count > (iLength - sizeof( StitchCacheHeader_t)) / sizeof( StitchPoint_t))
+	{// Damaged, or from some other build
+		Unmap();
+		return false;
+	}
+	iPoints = (const StitchPoint_t*) (header + 1);
+	iCount = (size_t) header->count;
+	return true;
+}
+
+static size_t CacheLimitBytes()
+{
+	return (size_t) atoll( GetDefaultValue( StitchCacheMegabytes)) * 1024 * 1024;
+}
+
+static void EnforceCacheLimit( size_t limit)
+{// Remove least recently used files until we fit
+	typedef struct
+	{
+		std::filesystem::file_time_type used;
+		uint64_t size;
+		std::filesystem::path name;
+	} CacheEntry_t;
+	std::vector<CacheEntry_t> entries;
+	uint64_t total = 0;
+	std::error_code ec;
+	for( const auto &entry : std::filesystem::directory_iterator( CacheDirectory(), ec))
+	{// Gather up our files
+		if( entry.path().extension() != sCacheFileType)
+			continue;
+		CacheEntry_t e = { entry.last_write_time( ec), entry.file_size( ec), entry.path()};
+		total += e.size;
+		entries.push_back( e);
+	}
+	if( total <= limit)
+		return;
+	std::sort( entries.begin(), entries.end(), []( const CacheEntry_t &a, const CacheEntry_t &b)
+	{
+		return a.used < b.used;
+	});
+	for( const CacheEntry_t &e : entries)
+	{// Oldest first
+		if( total <= limit)
+			break;
+		if( std::filesystem::remove( e.name, ec))
+		{// Windows won't remove a file someone has mapped, just leave it for next time
+			total -= e.size;
+			++sCacheEvictions;
+		}
+	}
+}
+
+bool StitchCacheLookup( const StitchCacheKey &key, MappedStitchPath &mapped)
+{
+	std::filesystem::path name = CacheFileName( key.Value());
+	if( !mapped.Map( name.string().c_str(), key.Value()))
+	{
+		++sCacheMisses;
+		return false;
+	}
+	std::error_code ec;
+	std::filesystem::last_write_time( name, std::filesystem::file_time_type::clock::now(), ec);	// Most recently used
+	++sCacheHits;
+	return true;
+}
+
+void StitchCacheStore( const StitchCacheKey &key, const StitchPoint_t* points, size_t count)
+{// Failing to cache isn't an error, the caller already has what it needs
+	size_t limit = CacheLimitBytes();
+	size_t needed = sizeof( StitchCacheHeader_t) + count * sizeof( StitchPoint_t);
+	if( needed > limit)
+		return;
+	std::error_code ec;
+	std::filesystem::create_directories( CacheDirectory(), ec);
+	std::filesystem::path name = CacheFileName( key.Value());
+	char unique[ 64];		// Unique across threads and processes sharing the cache
+	snprintf( unique, CountItems( unique), ".%llx.%llx.tmp",
+		(unsigned long long) std::hash<std::thread::id>()( std::this_thread::get_id()),
+		(unsigned long long) std::chrono::steady_clock::now().time_since_epoch().count());
+	std::filesystem::path temporary = name;
+	temporary += unique;
+
+	FILE* f = fopen( temporary.string().c_str(), "wb");
+	if( f == nullptr)
+		return;
+	StitchCacheHeader_t header;
+	memcpy( header.magic, sCacheMagic, sizeof( sCacheMagic));
+	header.key = key.Value();
+	header.count = count;
+	header.pointSize = sizeof( StitchPoint_t);
+	bool ok = fwrite( &header, sizeof( header), 1, f) == 1
+		&& (count == 0 || fwrite( points, sizeof( StitchPoint_t), count, f) == count);
+	ok = (fclose( f) == 0) && ok;
+	if( ok)
+		std::filesystem::rename( temporary, name, ec);
+	if( !ok || ec)
+	{
+		std::filesystem::remove( temporary, ec);
+		return;
+	}
+	++sCacheStores;
+	EnforceCacheLimit( limit);
+}
+
+int CacheCmd( CommandProc* cur)
+{
+	bool clear = false;
+	const char* boolOpts = "c";
+	bool* boolValues[] = { &clear};
+	static const char* helps[] =
+	{
+		"Clear, remove every cached stitch path.",
+		"Displays stitch cache statistics."
+	};
+
+	GetAllOpts(
+		cur->iArgc, cur->iArgv,
+		boolOpts, boolValues,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		nullptr, nullptr,
+		"", helps);
+
+	if( clear)
+		EnforceCacheLimit( 0);
+
+	uint64_t files = 0;
+	uint64_t bytes = 0;
+	std::error_code ec;
+	for( const auto &entry : std::filesystem::directory_iterator( CacheDirectory(), ec))
+	{// Current usage
+		if( entry.path().extension() != sCacheFileType)
+			continue;
+		++files;
+		bytes += entry.file_size( ec);
+	}
+	uint64_t hits = sCacheHits;
+	uint64_t misses = sCacheMisses;
+	printf( "Stitch cache %s\n", CacheDirectory().string().c_str());
+	printf( "%llu files, %.1f of %s MB\n", (unsigned long long) files, bytes / (1024.0 * 1024.0), GetDefaultValue( StitchCacheMegabytes));
+	printf( "%llu hits, %llu misses (%.0f%% hit rate), %llu stored, %llu evicted\n",
+		(unsigned long long) hits, (unsigned long long) misses,
+		hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+		(unsigned long long) (uint64_t) sCacheStores, (unsigned long long) (uint64_t) sCacheEvictions);
+	return cur->iFromCommandLine ? 2 : 0;
+}
@@ -0,0 +1,54 @@
+//
+//  stitchcache.hpp
+//  quilter
+//
+//  Content-addressed cache of generated stitch paths, kept under SettingsPath().
+//
+
+#ifndef stitchcache_hpp
+#define stitchcache_hpp
+
+#include <stdint.h>
+#include <string>
+#include "quilt.hpp"
+
+class StitchCacheKey
+{// FNV-1a hash of everything that determines a generated stitch path
+	uint64_t iHash = 14695981039346656037ULL;
+public:
+	StitchCacheKey();						// Starts out hashing the quilter version
+	void Add( const void* data, size_t len);
+	void Add( const char* s);				// Includes the terminating nul, so "ab","c" differs from "a","bc"
+	void Add( double d);
+	void AddFileIdentity( const char* filename);	// Path, size, and modification time, if it is a file
+	inline uint64_t Value() const
+	{
+		return iHash;
+	}
+};
+
+class MappedStitchPath
+{// A cached stitch path, mapped read-only straight from the cache file
+	void* iBase = nullptr;
+	size_t iLength = 0;
+	const StitchPoint_t* iPoints = nullptr;
+	size_t iCount = 0;
+public:
+	~MappedStitchPath();
+	bool Map( const char* filename, uint64_t key);	// False if missing or not a valid cache file for key
+	void Unmap();
+	inline const StitchPoint_t* Points() const
+	{
+		return iPoints;
+	}
+	inline size_t Count() const
+	{
+		return iCount;
+	}
+};
+
+bool StitchCacheLookup( const StitchCacheKey &key, MappedStitchPath &mapped);	// Counts a hit or a miss
+void StitchCacheStore( const StitchCacheKey &key, const StitchPoint_t* points, size_t count);
+int CacheCmd( CommandProc* cur);
+
+#endif /* stitchcache_hpp */
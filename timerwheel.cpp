@@ -0,0 +1,213 @@
+//
+//  timerwheel.cpp
+//  quilter
+//
+
+#include "timerwheel.hpp"
+#include "quilter.h"
+#include <time.h>
+#include <algorithm>
+
+static inline int FirstSetFrom( uint64_t mask, int start)
+{// How far past start the first set bit is, going around, mask must not be zero
+	uint64_t rotated = start ? (mask >> start) | (mask << (64 - start)) : mask;
+#if WINCODE
+	unsigned long index;
+	_BitScanForward64( &index, rotated);
+	return (int) index;
+#else
+	return __builtin_ctzll( rotated);
+#endif
+}
+
+TimerWheel::TimerWheel( ReadyQueue &queue)
+:
+	iQueue( queue), iStart( std::chrono::steady_clock::now())
+{
+}
+
+uint64_t TimerWheel::Now()
+{
+	return (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - iStart).count();
+}
+
+void TimerWheel::SetWakeup( AsyncHelper* wakeup)
+{
+	iWakeup = wakeup;
+}
+
+void TimerWheel::Place( Timer_t &timer)
+{// With iLock held, into the finest level that reaches its deadline
+	uint64_t deadline = timer.iDeadline < iNext ? iNext : timer.iDeadline;
+	uint64_t delta = deadline - iNext;
+	int level = 0;
+	while( level < kLevels - 1 && delta >= (uint64_t) 1 << (kSlotBits * (level + 1)))
+		++level;
+	if( delta >= (uint64_t) 1 << (kSlotBits * kLevels))
+		deadline = iNext + ((uint64_t) 1 << (kSlotBits * kLevels)) - 1;	// Placed again when it comes around
+	int slot = (int) ((deadline >> (kSlotBits * level)) & (kSlots - 1));
+	timer.iLevel = level;
+	timer.iSlot = slot;
+	timer.iPrev = nullptr;
+	timer.iNext = iSlots[ level][ slot];
+	if( timer.iNext)
+		timer.iNext->iPrev = &timer;
+	iSlots[ level][ slot] = &timer;
+	iOccupied[ level] |= (uint64_t) 1 << slot;
+}
+
+void TimerWheel::Remove( Timer_t &timer)
+{// With iLock held
+	if( timer.iPrev)
+		timer.iPrev->iNext = timer.iNext;
+	else
+		iSlots[ timer.iLevel][ timer.iSlot] = timer.iNext;
+	if( timer.iNext)
+		timer.iNext->iPrev = timer.iPrev;
+	if( iSlots[ timer.iLevel][ timer.iSlot] == nullptr)
+		iOccupied[ timer.iLevel] &= ~((uint64_t) 1 << timer.iSlot);
+	timer.iNext = timer.iPrev = nullptr;
+	timer.iLevel = -1;
+}
+
+void TimerWheel::Cascade( int level)
+{// With iLock held, this level just came around to a slot, move its timers down
+	int slot = (int) ((iNext >> (kSlotBits * level)) & (kSlots - 1));
+	Timer_t* timer = iSlots[ level][ slot];
+	iSlots[ level][ slot] = nullptr;
+	iOccupied[ level] &= ~((uint64_t) 1 << slot);
+	while( timer)
+	{
+		Timer_t* next = timer->iNext;
+		Place( *timer);
+		timer = next;
+	}
+}
+
+void TimerWheel::Schedule( Timer_t &timer, double seconds, double periodSeconds)
+{
+	if( seconds < 0)
+		seconds = 0;
+	uint64_t period = periodSeconds > 0 ? (uint64_t) (periodSeconds * 1000 + 0.5) : 0;
+	if( periodSeconds > 0 && period == 0)
+		period = 1;		// No faster than every tick
+	ScheduleTicks( timer, Now() + (uint64_t) (seconds * 1000 + 0.5), period);
+}
+
+void TimerWheel::ScheduleTicks( Timer_t &timer, uint64_t deadline, uint64_t period)
+{
+	bool nudge;
+	{
+		std::lock_guard<std::mutex> hold( iLock);
+		if( timer.iLevel >= 0)
+			Remove( timer);
+		else
+			++iCount;
+		timer.iDeadline = deadline;
+		timer.iPeriod = period;
+		Place( timer);
+		nudge = deadline < iSleepingUntil && iWakeup != nullptr;
+	}
+	if( nudge)
+		iQueue.Signal( iWakeup);	// Main loop is asleep until after this one is due
+}
+
+void TimerWheel::Cancel( Timer_t &timer)
+{
+	std::lock_guard<std::mutex> hold( iLock);
+	if( timer.iLevel < 0)
+		return;
+	Remove( timer);
+	--iCount;
+}
+
+int TimerWheel::Advance( uint64_t now)
+{
+	std::lock_guard<std::mutex> hold( iLock);
+	iSleepingUntil = 0;		// Only the main loop advances, so it is awake now and will look before sleeping
+	int fired = 0;
+	while( iNext <= now)
+	{
+		int index = (int) (iNext & (kSlots - 1));
+		if( index == 0)
+		{// Bottom level came around, bring down the next slot from above, and above that if it came around too
+			for( int level = 1; level < kLevels; ++level)
+			{
+				Cascade( level);
+				if( ((iNext >> (kSlotBits * level)) & (kSlots - 1)) != 0)
+					break;
+			}
+		}
+		if( iOccupied[ 0] == 0)
+		{// Nothing soon, skip ahead to when the bottom level next comes around
+			iNext = std::min( (iNext | (kSlots - 1)) + 1, now + 1);
+			continue;
+		}
+		while( Timer_t* timer = iSlots[ 0][ index])
+		{// Everything due on this tick
+			Remove( *timer);
+			timer->iFiredAt = iNext;
+			++timer->iFireCount;
+			++fired;
+			if( timer->iPeriod)
+			{// Next one on the same beat, skipping any we were too late for
+				timer->iDeadline += timer->iPeriod;
+				if( timer->iDeadline <= iNext)
+					timer->iDeadline += ((iNext - timer->iDeadline) / timer->iPeriod + 1) * timer->iPeriod;
+				Place( *timer);
+			}
+			else
+				--iCount;
+			if( timer->iOwner)
+				iQueue.Signal( timer->iOwner);
+		}
+		++iNext;
+	}
+	return fired;
+}
+
+bool TimerWheel::FindNext( uint64_t* tick)
+{// With iLock held, exact for the bottom level, when a slot will come down for the levels above
+	if( iCount == 0)
+		return false;
+	uint64_t best = UINT64_MAX;
+	if( iOccupied[ 0])
+		best = iNext + FirstSetFrom( iOccupied[ 0], (int) (iNext & (kSlots - 1)));
+	for( int level = 1; level < kLevels; ++level)
+	{
+		if( iOccupied[ level] == 0)
+			continue;
+		uint64_t turn = iNext >> (kSlotBits * level);
+		int steps = FirstSetFrom( iOccupied[ level], (int) ((turn + 1) & (kSlots - 1))) + 1;
+		best = std::min( best, (turn + steps) << (kSlotBits * level));
+	}
+	*tick = best;
+	return true;
+}
+
+bool TimerWheel::NextDeadline( uint64_t* tick)
+{
+	std::lock_guard<std::mutex> hold( iLock);
+	return FindNext( tick);
+}
+
+bool TimerWheel::Sleep( struct timespec* wakeup)
+{
+	uint64_t tick;
+	{
+		std::lock_guard<std::mutex> hold( iLock);
+		if( !FindNext( &tick))
+		{// Anything scheduled now has to wake us up
+			iSleepingUntil = UINT64_MAX;
+			return false;
+		}
+		iSleepingUntil = tick;
+	}
+	auto delay = iStart + std::chrono::milliseconds( tick) - std::chrono::steady_clock::now();
+	long long nanoseconds = std::max( (long long) std::chrono::duration_cast<std::chrono::nanoseconds>( delay).count(), 0LL);
+	timespec_get( wakeup, TIME_UTC);	// Semaphores wait until a time of day
+	nanoseconds += wakeup->tv_nsec;
+	wakeup->tv_sec += (time_t) (nanoseconds / 1000000000);
+	wakeup->tv_nsec = (long) (nanoseconds % 1000000000);
+	return true;
+}
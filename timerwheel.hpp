@@ -0,0 +1,83 @@
+//
+//  timerwheel.hpp
+//  quilter
+//
+//  Scheduled and periodic Execute calls for activities.
+//
+
+#ifndef timerwheel_hpp
+#define timerwheel_hpp
+
+#include <stdint.h>
+#include <mutex>
+#include <chrono>
+
+class AsyncHelper;
+class ReadyQueue;
+
+typedef struct Timer
+{// Embed one of these for each thing you want to schedule, AsyncHelper has one built in
+	struct Timer* iNext = nullptr;			// Others in the same wheel slot
+	struct Timer* iPrev = nullptr;
+	AsyncHelper* iOwner = nullptr;			// Its Execute runs when the timer goes off
+	uint64_t iDeadline = 0;					// Ticks
+	uint64_t iPeriod = 0;					// Ticks, zero for one shot
+	uint64_t iFiredAt = 0;					// Tick it last went off
+	int iFireCount = 0;
+	int iLevel = -1;						// Where it is in the wheel, -1 if not scheduled
+	int iSlot = 0;
+} Timer_t;
+
+/*
+		Hierarchical timer wheel, four levels of 64 slots with millisecond ticks.  The bottom
+		level holds the next 64 ms one tick per slot, each level above is 64 times coarser,
+		and when a level comes around to a slot, its timers drop down to finer levels.  Adding,
+		cancelling, and firing are constant time, and finding how long the main loop can sleep
+		looks at one bit mask per level.  Anything further out than the top level reaches,
+		about four and a half hours, waits in the top level and is placed again when it comes
+		around.
+*/
+class TimerWheel
+{
+public:
+	static const int kLevels = 4;
+	static const int kSlotBits = 6;
+	static const int kSlots = 1 << kSlotBits;
+
+private:
+	std::mutex iLock;
+	ReadyQueue &iQueue;						// Where timers send their owners
+	std::chrono::steady_clock::time_point iStart;	// Tick zero
+	uint64_t iNext = 0;						// Next tick to process
+	uint64_t iSleepingUntil = 0;			// Tick the main loop will wake up by itself, 0 while it is awake
+	int iCount = 0;							// Timers in the wheel
+	Timer_t* iSlots[ kLevels][ kSlots] = {};
+	uint64_t iOccupied[ kLevels] = {};		// One bit for each slot with something in it
+	AsyncHelper* iWakeup = nullptr;			// Signalled when a new timer is due before iSleepingUntil
+
+	void Place( Timer_t &timer);
+	void Remove( Timer_t &timer);
+	void Cascade( int level);
+	bool FindNext( uint64_t* tick);
+
+public:
+	TimerWheel( ReadyQueue &queue);
+	uint64_t Now();							// Current tick
+	void SetWakeup( AsyncHelper* wakeup);
+	void Schedule( Timer_t &timer, double seconds, double periodSeconds = 0);	// Replaces any earlier schedule
+	void ScheduleTicks( Timer_t &timer, uint64_t deadline, uint64_t period = 0);
+	void Cancel( Timer_t &timer);
+	int Advance( uint64_t now);				// Main loop only, fires everything due by this tick, returns how many
+	int Advance()
+	{
+		return Advance( Now());
+	}
+	bool NextDeadline( uint64_t* tick);		// False if there are no timers
+	bool Sleep( struct timespec* wakeup);	// Main loop only, when to wake up, false for never
+	inline int Count() const
+	{
+		return iCount;
+	}
+};
+
+#endif /* timerwheel_hpp */